@@ -1,8 +1,8 @@
-
 #include "postgres.h"
 
 #include "ossapi.h"
 #include "compress_writer.h"
+#include "oss_gzindex.h"
 #include "utils/memutils.h"
 #include "miscadmin.h"
 #include "utils/builtins.h"
@@ -11,6 +11,7 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "utils/guc.h"
@@ -27,142 +28,189 @@ extern char my_exec_path[];
 #define PIPE_READ							0
 #define PIPE_WRITE							1
 
-int		aStdinPipe[2] = {-1, -1};
-int		aStdoutPipe[2] = {-1, -1};
-int		aStderrPipe[2] = {-1, -1};
-
-oss_request_options oss_ro = {AOS_MIN_SPEED_LIMIT,
-							AOS_MIN_SPEED_TIME, 
-							AOS_DNS_CACHE_TIMOUT, 
-							AOS_CONNECT_TIMEOUT};
-
-oss_exp_options oss_oe = {OSS_FLUSH_BUF_DEFAULT_SIZE, 
-							OSS_WRITE_FILE_DEFAULT_SIZE,
-							OSS_DEFAULT_COMPRESS_THREAD_NUM,
-							false,
-							DEFAULT_PIPE_BLOCK_SIZE,
-							DEFAULT_OSS_COMPRESS_LEVEL};
-
-char	oss_host[MAX_OSS_STR_LEN] = {0};
-char	oss_id[MAX_OSS_STR_LEN] = {0};
-char	oss_key[MAX_OSS_STR_LEN] = {0};
-char	oss_bucket[MAX_OSS_STR_LEN] = {0};
-char	oss_file_name[MAX_OSS_OBJECT_NAME_LEN] = {0};
-
-char	oss_write_error_msg[ERROR_MESSAGE_LEN];
-
-char	*oss_write_buffer = NULL;
-char	*oss_write_temp = NULL;
+/*
+ * Upper bound of the uncompressed data which has been written to the pipe but
+ * whose compressed form has not been read back by the writer thread yet: the
+ * kernel pipe buffer plus the blocks pigz keeps in flight for every thread.
+ */
+#define PIGZ_BLOCK_SIZE						(128 * 1024)
+#define PIPE_KERNEL_BUFFER_SIZE				(64 * 1024)
+#define PIGZ_INFLIGHT_SIZE(nthread)			(PIPE_KERNEL_BUFFER_SIZE + 2 * (nthread) * PIGZ_BLOCK_SIZE)
 
 #ifdef WIN32
 #define		THREAD_PID_NULL		NULL
-pthread_t	pid_compress = THREAD_PID_NULL;
-pthread_t	th_writer = THREAD_PID_NULL;
 #else
 #define		THREAD_PID_NULL		-1
-pid_t		pid_compress = THREAD_PID_NULL;
-pthread_t	th_writer = THREAD_PID_NULL;
 #endif
 
-static volatile int	oss_writer_init = false;
-static volatile int	oss_writer_exit_witherr = false;
+/*
+ * State of one compressed export stream: the pigz subprocess, the pipes to
+ * and from it and the writer thread uploading its output. It hangs off
+ * ext_oss_t->com_hd, so one backend can run several streams at once, e.g.
+ * an INSERT ... SELECT fanning out to more than one writable external table.
+ */
+typedef struct oss_compress_state
+{
+	int			stdin_pipe[2];
+	int			stdout_pipe[2];
+	int			stderr_pipe[2];
+
+#ifdef WIN32
+	pthread_t	pid_compress;
+#else
+	pid_t		pid_compress;
+#endif
+	pthread_t	th_writer;
+
+	volatile int	writer_init;
+	volatile int	writer_exit_witherr;
+
+	/* compressed bytes of the current gzip member taken from pigz by the writer thread */
+	volatile int64	compressed_bytes;
+
+	/*
+	 * With gzip_member_size every member of the oss file is compressed by a
+	 * pigz of its own, so it is a gzip stream decodable on its own. The start
+	 * of each member after the first one goes to the index of the file.
+	 */
+	int64		file_compressed;	/* of the members done */
+	int64		member_start;		/* uncompressed offset of the current member */
+	int64	   *member_in;
+	int64	   *member_out;
+	int			nmembers;
+	int			maxmembers;
+
+	/* private to the writer thread while it runs */
+	char		host[MAX_OSS_STR_LEN];
+	char		id[MAX_OSS_STR_LEN];
+	char		key[MAX_OSS_STR_LEN];
+	char		bucket[MAX_OSS_STR_LEN];
+	char		file_name[MAX_OSS_OBJECT_NAME_LEN];
+	oss_request_options	ro;
+	int			buffer_size;
+	char	   *write_buffer;
+	char	   *write_temp;
+
+	char		error_msg[ERROR_MESSAGE_LEN];
+} oss_compress_state;
 
 static size_t compress_write(void *selfp, void *buffer, size_t request_len);
 static void compress_writer_close(void *selfp);
-static int start_subprocess_open_pipe(int nthread, int compression_level);
-static void reset_global_variable(void);
+static int start_subprocess_open_pipe(oss_compress_state *cs, int nthread, int compression_level);
+static void reset_compress_state(oss_compress_state *cs);
 static void *oss_write_main(void *arg);
-static void shutdown_compress_main_env(void);
-static void shutdown_write_thread(void);
+static void shutdown_compress_main_env(oss_compress_state *cs);
+static void shutdown_write_thread(oss_compress_state *cs);
 static void write_buffer_to_pipe(ext_oss_t *myData);
+static void write_iov_to_pipe(ext_oss_t *myData, struct iovec *iov, int iovcnt);
+static bool compress_file_is_full(ext_oss_t *myData, size_t request_len);
+static void switch_compress_member(ext_oss_t *myData);
+static void finish_compress_file(ext_oss_t *myData);
 static bool file_exists(const char *name);
+static void set_pipe_cloexec(int *pipefd);
 
 #ifndef WIN32
 /* Non-Windows implementation of pipe access */
 #define pgpipe(a)			pipe(a)
 #define piperead(a,b,c)		read(a,b,c)
 #define pipewrite(a,b,c)	write(a,b,c)
+#define pipewritev(a,b,c)	writev(a,b,c)
 #define pipeclose(a)		close(a)
 #endif
 
 int
 init_compress_writer(ext_oss_t *self, bool init_subprocess)
 {
+	oss_compress_state *cs;
 	int	rc = -1;
 
 	self->base.write = (SourceWriteProc) compress_write;
 	self->base.close = (SourceCloseProc) compress_writer_close;
 
-	self->size = self->write_opt.flush_block;
+	if (self->com_hd == NULL)
+	{
+		cs = MemoryContextAllocZero(self->ctx, sizeof(oss_compress_state));
+		cs->stdin_pipe[PIPE_READ] = cs->stdin_pipe[PIPE_WRITE] = -1;
+		cs->stdout_pipe[PIPE_READ] = cs->stdout_pipe[PIPE_WRITE] = -1;
+		cs->stderr_pipe[PIPE_READ] = cs->stderr_pipe[PIPE_WRITE] = -1;
+		cs->pid_compress = THREAD_PID_NULL;
+		cs->th_writer = THREAD_PID_NULL;
+		self->com_hd = (void *) cs;
+	}
+	cs = (oss_compress_state *) self->com_hd;
+
+	if (self->chain.chunks == NULL)
+	{
+		/* the writer thread holds two buffers of self->size */
+		self->size = oss_buffer_grant(self, 2 * (int64) self->write_opt.flush_block,
+									2 * OSS_FLUSH_BUF_MIN_SIZE) / 2;
+		self->write_opt.pipe_block_size = oss_buffer_grant(self, self->write_opt.pipe_block_size,
+														MIN_PIPE_BLOCK_SIZE);
+		oss_write_chain_init(&self->chain, self->write_opt.pipe_block_size,
+							Min(self->write_opt.pipe_block_size, OSS_WRITE_CHUNK_SIZE), self->ctx);
+	}
 
 	if (init_subprocess)
 	{
-		rc = start_subprocess_open_pipe(self->write_opt.nthread, self->write_opt.compression_level);
+		cs->compressed_bytes = 0;
+		rc = start_subprocess_open_pipe(cs, self->write_opt.nthread, self->write_opt.compression_level);
 		if (rc < 0)
 		{
-			shutdown_compress_main_env();
+			shutdown_compress_main_env(cs);
 			elog(ERROR, "oss compresser subprocess start fail");
 		}
 
-		if (pthread_create(&th_writer, NULL, oss_write_main, (void *)self) != 0)
+		if (pthread_create(&cs->th_writer, NULL, oss_write_main, (void *)self) != 0)
 		{
-			shutdown_compress_main_env();
+			cs->th_writer = THREAD_PID_NULL;
+			shutdown_compress_main_env(cs);
 			elog(ERROR, "oss writer thread start fail");
 		}
-		while(oss_writer_init == false)
+		while(cs->writer_init == false && cs->writer_exit_witherr == false)
 		{
 			pg_usleep(100L);
 		}
-		oss_writer_init = false;
+		cs->writer_init = false;
 	}
 
 	self->errmsg[0] = 0;
-	if (self->buffer == NULL)
-	{
-		self->buffer = palloc(self->write_opt.pipe_block_size);
-		memset(self->buffer, 0, self->write_opt.pipe_block_size);
-	}
-
-	if (self->buffer == NULL)
-	{
-		shutdown_compress_main_env();
-		elog(ERROR, "out of memory for pipe buffer");
-	}
 
 	return 0;
 }
 
 static void
-shutdown_compress_main_env(void)
+shutdown_compress_main_env(oss_compress_state *cs)
 {
 	int 		status;
 	int 		r;
 
-	if (aStdinPipe[PIPE_WRITE] != -1)
+	if (cs->stdin_pipe[PIPE_WRITE] != -1)
 	{
-		elog(DEBUG1, "close aStdinPipe writer");
-		pipeclose(aStdinPipe[PIPE_WRITE]);
-		aStdinPipe[PIPE_WRITE] = -1;
+		elog(DEBUG1, "close stdin pipe writer");
+		pipeclose(cs->stdin_pipe[PIPE_WRITE]);
+		cs->stdin_pipe[PIPE_WRITE] = -1;
 	}
 
 #ifndef WIN32
-	if (pid_compress > 0)
+	if (cs->pid_compress > 0)
 	{
-		elog(DEBUG1, "wait compross %d exit", pid_compress);
+		pid_t		pid = cs->pid_compress;
+
+		elog(DEBUG1, "wait compross %d exit", pid);
 
 		/* Just wait for the background process to exit */
-		r = waitpid(pid_compress, &status, 0);
+		r = waitpid(pid, &status, 0);
+		cs->pid_compress = -1;
 		if (r == -1)
 		{
 			elog(ERROR, "could not wait for child process: %s", strerror(errno));
 		}
-		if (r != pid_compress)
+		if (r != pid)
 		{
-			elog(ERROR, "child %d died, expected %d", r, pid_compress);
+			elog(ERROR, "child %d died, expected %d", r, pid);
 		}
 		if (!WIFEXITED(status))
-		{			
-			pid_compress = -1;
+		{
 			elog(ERROR, "child process did not exit normally");
 		}
 		if (WEXITSTATUS(status) != 0)
@@ -170,131 +218,290 @@ shutdown_compress_main_env(void)
 			char msg[MAXPGPATH];
 
 			snprintf(msg, MAXPGPATH, "unknown");
-			if (aStderrPipe[PIPE_READ] != -1)
+			if (cs->stderr_pipe[PIPE_READ] != -1)
 			{
-				piperead(aStderrPipe[PIPE_READ], msg, MAXPGPATH);
+				piperead(cs->stderr_pipe[PIPE_READ], msg, MAXPGPATH);
+				pipeclose(cs->stderr_pipe[PIPE_READ]);
+				cs->stderr_pipe[PIPE_READ] = -1;
 			}
-			pid_compress = -1;
-			pipeclose(aStderrPipe[PIPE_READ]);
-			aStderrPipe[PIPE_READ] = -1;
-			elog(ERROR, "child process exited with error %d %s", WEXITSTATUS(status), msg);	
+			elog(ERROR, "child process exited with error %d %s", WEXITSTATUS(status), msg);
 		}
-		pid_compress = -1;
 	}
 #else
-	if (pid_compress != THREAD_PID_NULL)
+	if (cs->pid_compress != THREAD_PID_NULL)
 	{
-		pthread_join(pid_compress, THREAD_PID_NULL);
-		pid_compress = THREAD_PID_NULL;
+		pthread_join(cs->pid_compress, THREAD_PID_NULL);
+		cs->pid_compress = THREAD_PID_NULL;
 	}
 #endif
 
-	if (th_writer != THREAD_PID_NULL)
+	if (cs->th_writer != THREAD_PID_NULL)
 	{
-		pthread_join(th_writer, NULL);
-		th_writer = THREAD_PID_NULL;
+		pthread_join(cs->th_writer, NULL);
+		cs->th_writer = THREAD_PID_NULL;
 	}
 
-	if (aStdoutPipe[PIPE_READ] != -1)
+	cs->file_compressed += cs->compressed_bytes;
+
+	if (cs->stdout_pipe[PIPE_READ] != -1)
 	{
-		elog(WARNING, "aStdoutPipe reader not close");
-		pipeclose(aStdoutPipe[PIPE_READ]);
-		aStdoutPipe[PIPE_READ] = -1;
+		elog(WARNING, "stdout pipe reader not close");
+		pipeclose(cs->stdout_pipe[PIPE_READ]);
+		cs->stdout_pipe[PIPE_READ] = -1;
 	}
 
-	if (aStderrPipe[PIPE_READ] != -1)
+	if (cs->stderr_pipe[PIPE_READ] != -1)
 	{
-		elog(DEBUG1, "close aStderrPipe reader");
-		pipeclose(aStderrPipe[PIPE_READ]);
-		aStderrPipe[PIPE_READ] = -1;
+		elog(DEBUG1, "close stderr pipe reader");
+		pipeclose(cs->stderr_pipe[PIPE_READ]);
+		cs->stderr_pipe[PIPE_READ] = -1;
 	}
 
-	aStdinPipe[PIPE_READ] = -1;
-	aStdoutPipe[PIPE_WRITE] = -1;
-	aStderrPipe[PIPE_WRITE] = -1;
-	
-	oss_writer_init = false;
-	oss_writer_exit_witherr = false;
+	cs->stdin_pipe[PIPE_READ] = -1;
+	cs->stdout_pipe[PIPE_WRITE] = -1;
+	cs->stderr_pipe[PIPE_WRITE] = -1;
+
+	cs->writer_init = false;
+	cs->writer_exit_witherr = false;
+	cs->compressed_bytes = 0;
 
-	oss_write_error_msg[0] = 0;
+	cs->error_msg[0] = 0;
 }
 
 static size_t
 compress_write(void *selfp, void *buffer, size_t request_len)
 {
 	ext_oss_t *myData = (ext_oss_t *) selfp;
+	oss_compress_state *cs = (oss_compress_state *) myData->com_hd;
 
 	if (request_len <= 0)
 	{
 		return 0;
 	}
 
-	if (oss_writer_exit_witherr)
+	if (cs->writer_exit_witherr)
 	{
-		snprintf(myData->errmsg, ERROR_MESSAGE_LEN, "%s", oss_write_error_msg);
-		shutdown_compress_main_env();
+		snprintf(myData->errmsg, ERROR_MESSAGE_LEN, "%s", cs->error_msg);
+		shutdown_compress_main_env(cs);
 		elog(ERROR, "%s", myData->errmsg);
 	}
 
-	if (request_len > myData->write_opt.pipe_block_size)
-	{		
-		shutdown_compress_main_env();
-		elog(ERROR, "meet one big row, please increase pipe_block_size");
-	}
-
 	myData->write_row_count++;
 	myData->write_byte_count += request_len;
 
-	if ((myData->file_flush_offset + request_len) > myData->write_opt.file_max_size)
+	if (compress_file_is_full(myData, request_len))
 	{
-		elog(DEBUG1, "switch oss file");
+		elog(DEBUG1, "switch oss file, wrote " int64_FMT " byte, compressed " int64_FMT " byte",
+			myData->file_flush_offset, (int64) cs->compressed_bytes);
 		write_buffer_to_pipe(myData);
-		shutdown_compress_main_env();
+		shutdown_compress_main_env(cs);
+		finish_compress_file(myData);
 		oss_wirte_next_file(myData);
 		init_compress_writer(myData, true);
 		myData->file_flush_offset = 0;
 	}
+	else if (myData->write_opt.member_size > 0 &&
+			 myData->file_flush_offset > cs->member_start &&
+			 myData->file_flush_offset - cs->member_start + request_len > myData->write_opt.member_size)
+	{
+		switch_compress_member(myData);
+	}
 
-	if ((myData->offset + request_len) > myData->write_opt.pipe_block_size)
+	if ((myData->chain.len + request_len) > myData->write_opt.pipe_block_size)
 	{
 		write_buffer_to_pipe(myData);
 	}
 
-	memcpy(myData->buffer + myData->offset, buffer, request_len);
-	myData->offset += request_len;
+	if (request_len > myData->write_opt.pipe_block_size)
+	{
+		struct iovec	iov;
+
+		/* one big row goes to pigz straight from the executor's buffer */
+		iov.iov_base = buffer;
+		iov.iov_len = request_len;
+		write_iov_to_pipe(myData, &iov, 1);
+	}
+	else
+	{
+		oss_write_chain_append(&myData->chain, buffer, request_len);
+	}
 	myData->file_flush_offset += request_len;
 
 	return request_len;
 }
 
+/*
+ * The oss file is rolled over on its compressed size. The writer thread
+ * publishes how many compressed bytes it got from pigz for the current file;
+ * the data still sitting in our buffer, in the pipe and inside pigz is
+ * estimated with the compression ratio observed so far.
+ */
+static bool
+compress_file_is_full(ext_oss_t *myData, size_t request_len)
+{
+	oss_compress_state *cs = (oss_compress_state *) myData->com_hd;
+	int64	compressed = cs->file_compressed + cs->compressed_bytes;
+	int64	inflight = PIGZ_INFLIGHT_SIZE(myData->write_opt.nthread) + myData->chain.len;
+	int64	consumed;
+	double	ratio = 1.0;
+
+	if (compressed == 0)
+	{
+		return false;
+	}
+
+	inflight = Min(inflight, myData->file_flush_offset);
+	consumed = myData->file_flush_offset - inflight;
+	if (consumed > 0)
+	{
+		ratio = Min((double) compressed / consumed, 1.0);
+	}
+
+	return compressed + (inflight + request_len) * ratio > myData->write_opt.file_max_size;
+}
+
+/*
+ * Members are cut between rows, so a reader starting at one is at a line
+ * start. pigz is restarted on the same oss file, the writer thread appends
+ * its output after the previous member.
+ */
+static void
+switch_compress_member(ext_oss_t *myData)
+{
+	oss_compress_state *cs = (oss_compress_state *) myData->com_hd;
+
+	write_buffer_to_pipe(myData);
+	shutdown_compress_main_env(cs);
+
+	if (cs->nmembers == cs->maxmembers)
+	{
+		cs->maxmembers = Max(cs->maxmembers * 2, 64);
+		if (cs->member_in == NULL)
+		{
+			cs->member_in = MemoryContextAlloc(myData->ctx, sizeof(int64) * cs->maxmembers);
+			cs->member_out = MemoryContextAlloc(myData->ctx, sizeof(int64) * cs->maxmembers);
+		}
+		else
+		{
+			cs->member_in = repalloc(cs->member_in, sizeof(int64) * cs->maxmembers);
+			cs->member_out = repalloc(cs->member_out, sizeof(int64) * cs->maxmembers);
+		}
+	}
+	cs->member_in[cs->nmembers] = cs->file_compressed;
+	cs->member_out[cs->nmembers] = myData->file_flush_offset;
+	cs->nmembers++;
+
+	cs->member_start = myData->file_flush_offset;
+	init_compress_writer(myData, true);
+}
+
+/*
+ * The oss file is complete, store the index of its members next to it in
+ * the format the import reads with gzip_index.
+ */
+static void
+finish_compress_file(ext_oss_t *myData)
+{
+	oss_compress_state *cs = (oss_compress_state *) myData->com_hd;
+	oss_gzindex *index;
+	char		errmsg[ERROR_MESSAGE_LEN];
+	bool		ok = true;
+	int			i;
+
+	if (cs->nmembers > 0)
+	{
+		index = oss_gzindex_create();
+		if (index == NULL)
+			elog(ERROR, "out of memory");
+		index->length = cs->file_compressed;
+
+		for (i = 0; i < cs->nmembers && ok; i++)
+		{
+			ok = oss_gzindex_add(index, cs->member_in[i], cs->member_out[i], 0,
+								 OSS_GZPOINT_MEMBER | OSS_GZPOINT_LINE, NULL, 0);
+		}
+
+		errmsg[0] = '\0';
+		if (!ok)
+			snprintf(errmsg, ERROR_MESSAGE_LEN, "out of memory");
+		else
+			ok = oss_gzindex_save(&myData->conn, myData->currentfile, index, myData->ro, errmsg);
+		oss_gzindex_free(index);
+
+		if (!ok)
+			elog(WARNING, "could not write the gzip index of %s: %s", myData->currentfile, errmsg);
+		else
+			elog(DEBUG1, "gzip index of %s has %d members", myData->currentfile, cs->nmembers + 1);
+	}
+
+	cs->file_compressed = 0;
+	cs->member_start = 0;
+	cs->nmembers = 0;
+}
+
 static void
 write_buffer_to_pipe(ext_oss_t *myData)
 {
-	int rc;
-	TimevalStruct   before, after;
-	double			elapsed_msec = 0;
+	struct iovec   *iov = NULL;
+	int				iovcnt;
 
-	if (myData->offset <= 0)
+	if (myData->chain.len <= 0)
 	{
 		return;
 	}
 
+	iovcnt = oss_write_chain_iov(&myData->chain, &iov);
+	write_iov_to_pipe(myData, iov, iovcnt);
+	oss_write_chain_reset(&myData->chain);
+
+	return;
+}
+
+/*
+ * Write the whole vector to pigz, iov is consumed.
+ */
+static void
+write_iov_to_pipe(ext_oss_t *myData, struct iovec *iov, int iovcnt)
+{
+	oss_compress_state *cs = (oss_compress_state *) myData->com_hd;
+	int rc;
+	TimevalStruct   before, after;
+	double			elapsed_msec = 0;
+
 	GETTIMEOFDAY(&before);
-	rc = pipewrite(aStdinPipe[PIPE_WRITE], myData->buffer, myData->offset);
-	if (rc < 0)
+	while (iovcnt > 0)
 	{
-		snprintf(myData->errmsg, ERROR_MESSAGE_LEN, "oss compress write to pipe fail %d %s", errno, strerror(errno));
-		shutdown_compress_main_env();
-		elog(ERROR, "%s", myData->errmsg);
-	}
+		rc = pipewritev(cs->stdin_pipe[PIPE_WRITE], iov, iovcnt);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
 
-	myData->offset = 0;
+			snprintf(myData->errmsg, ERROR_MESSAGE_LEN, "oss compress write to pipe fail %d %s", errno, strerror(errno));
+			shutdown_compress_main_env(cs);
+			elog(ERROR, "%s", myData->errmsg);
+		}
+
+		/* skip the chunks the pipe has taken */
+		while (iovcnt > 0 && (size_t) rc >= iov->iov_len)
+		{
+			rc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
 
 	GETTIMEOFDAY(&after);
 	DIFF_MSEC(&after, &before, elapsed_msec);
 	myData->flush_data_timer += elapsed_msec;
-
-	return;
 }
 
 static void
@@ -302,28 +509,41 @@ compress_writer_close(void *selfp)
 {
 	ext_oss_t *myData = (ext_oss_t *) selfp;
 
-	if (myData)
+	if (myData && myData->com_hd)
 	{
-		if (oss_writer_exit_witherr)
+		oss_compress_state *cs = (oss_compress_state *) myData->com_hd;
+
+		if (cs->writer_exit_witherr)
 		{
-			snprintf(myData->errmsg, ERROR_MESSAGE_LEN, "%s", oss_write_error_msg);
-			shutdown_compress_main_env();
+			snprintf(myData->errmsg, ERROR_MESSAGE_LEN, "%s", cs->error_msg);
+			shutdown_compress_main_env(cs);
 			elog(ERROR, "%s", myData->errmsg);
 		}
 
 		write_buffer_to_pipe(myData);
-		shutdown_compress_main_env();
+		shutdown_compress_main_env(cs);
+		finish_compress_file(myData);
 
 		elog(DEBUG1, "oss compress end, wrote row " int64_FMT ", " int64_FMT " byte cost %.3f ms",
 			myData->write_row_count, myData->write_byte_count, myData->flush_data_timer);
-
-		//MemoryContextDelete(myData->wstate_cxt);
-		//myData->wstate = NULL;
 	}
 }
 
+/*
+ * Every stream of the backend forks its own pigz. Our ends of the pipes must
+ * not leak into the pigz of another stream, or that child would hold the
+ * stdin of this one open and this pigz would never see EOF. dup2() clears
+ * the flag on the descriptors the child gets as its stdio.
+ */
+static void
+set_pipe_cloexec(int *pipefd)
+{
+	fcntl(pipefd[PIPE_READ], F_SETFD, FD_CLOEXEC);
+	fcntl(pipefd[PIPE_WRITE], F_SETFD, FD_CLOEXEC);
+}
+
 static int
-start_subprocess_open_pipe(int nthread, int compression_level)
+start_subprocess_open_pipe(oss_compress_state *cs, int nthread, int compression_level)
 {
 	pid_t	pid = -1;
 	char	str_nthread[16];
@@ -345,65 +565,69 @@ start_subprocess_open_pipe(int nthread, int compression_level)
 	pg_ltoa(nthread, str_nthread);
 	snprintf(str_com_level, 16, "-%d", compression_level);
 
-	reset_global_variable();
+	reset_compress_state(cs);
 
-	if (pgpipe(aStdinPipe) < 0)
+	if (pgpipe(cs->stdin_pipe) < 0)
 	{
 		elog(ERROR, "allocating stdin pipe fail");
 		return -1;
 	}
 
-	if (pgpipe(aStdoutPipe) < 0)
+	if (pgpipe(cs->stdout_pipe) < 0)
 	{
-		pipeclose(aStdinPipe[PIPE_READ]);
-		pipeclose(aStdinPipe[PIPE_WRITE]);
-		aStdinPipe[PIPE_READ] = -1;
-		aStdinPipe[PIPE_WRITE] = -1;
+		pipeclose(cs->stdin_pipe[PIPE_READ]);
+		pipeclose(cs->stdin_pipe[PIPE_WRITE]);
+		cs->stdin_pipe[PIPE_READ] = -1;
+		cs->stdin_pipe[PIPE_WRITE] = -1;
 		elog(ERROR, "allocating stdout pipe fail");
 		return -1;
 	}
 
-	if (pgpipe(aStderrPipe) < 0)
+	if (pgpipe(cs->stderr_pipe) < 0)
 	{
-		pipeclose(aStdinPipe[PIPE_READ]);
-		pipeclose(aStdinPipe[PIPE_WRITE]);
-		pipeclose(aStdinPipe[PIPE_READ]);
-		pipeclose(aStdinPipe[PIPE_WRITE]);
-		aStdinPipe[PIPE_READ] = -1;
-		aStdinPipe[PIPE_WRITE] = -1;
-		aStdinPipe[PIPE_READ] = -1;
-		aStdinPipe[PIPE_WRITE] = -1;
+		pipeclose(cs->stdin_pipe[PIPE_READ]);
+		pipeclose(cs->stdin_pipe[PIPE_WRITE]);
+		pipeclose(cs->stdout_pipe[PIPE_READ]);
+		pipeclose(cs->stdout_pipe[PIPE_WRITE]);
+		cs->stdin_pipe[PIPE_READ] = -1;
+		cs->stdin_pipe[PIPE_WRITE] = -1;
+		cs->stdout_pipe[PIPE_READ] = -1;
+		cs->stdout_pipe[PIPE_WRITE] = -1;
 		elog(ERROR, "allocating stderr pipe fail");
 		return -1;
 	}
 
 #ifndef WIN32
 
-	switch ((pid=fork())) 
+	set_pipe_cloexec(cs->stdin_pipe);
+	set_pipe_cloexec(cs->stdout_pipe);
+	set_pipe_cloexec(cs->stderr_pipe);
+
+	switch ((pid=fork()))
 	{
 		case 0:
 		{
-			
+
 			char *const ps_argv[] ={"pigz", "-p", str_nthread, str_com_level, "-f", NULL};
 
-			if (dup2(aStdinPipe[PIPE_READ], STDIN_FILENO) == -1) {
+			if (dup2(cs->stdin_pipe[PIPE_READ], STDIN_FILENO) == -1) {
 				exit(errno);
 			}
 
 			// redirect stdout
-			if (dup2(aStdoutPipe[PIPE_WRITE], STDOUT_FILENO) == -1) {
+			if (dup2(cs->stdout_pipe[PIPE_WRITE], STDOUT_FILENO) == -1) {
 				exit(errno);
 			}
 
 			// redirect stderr
-			if (dup2(aStderrPipe[PIPE_WRITE], STDERR_FILENO) == -1) {
+			if (dup2(cs->stderr_pipe[PIPE_WRITE], STDERR_FILENO) == -1) {
 				exit(errno);
 			}
 
 			// all these are for use by parent only
-			pipeclose(aStdinPipe[PIPE_WRITE]);
-			pipeclose(aStdoutPipe[PIPE_READ]);
-			pipeclose(aStderrPipe[PIPE_READ]);
+			pipeclose(cs->stdin_pipe[PIPE_WRITE]);
+			pipeclose(cs->stdout_pipe[PIPE_READ]);
+			pipeclose(cs->stderr_pipe[PIPE_READ]);
 
 			if (execv(pigz_exec_path, ps_argv) < 0)
 			{
@@ -417,18 +641,18 @@ start_subprocess_open_pipe(int nthread, int compression_level)
 
 		case -1:
 		{
-			pipeclose(aStdinPipe[PIPE_READ]);
-			pipeclose(aStdinPipe[PIPE_WRITE]);
-			pipeclose(aStdoutPipe[PIPE_READ]);
-			pipeclose(aStdoutPipe[PIPE_WRITE]); 
-			pipeclose(aStderrPipe[PIPE_READ]);
-			pipeclose(aStderrPipe[PIPE_WRITE]);
-			aStdinPipe[PIPE_READ] = -1;
-			aStdinPipe[PIPE_WRITE] = -1;
-			aStdoutPipe[PIPE_READ] = -1;
-			aStdoutPipe[PIPE_WRITE] = -1;
-			aStderrPipe[PIPE_READ] = -1;
-			aStderrPipe[PIPE_WRITE] = -1;
+			pipeclose(cs->stdin_pipe[PIPE_READ]);
+			pipeclose(cs->stdin_pipe[PIPE_WRITE]);
+			pipeclose(cs->stdout_pipe[PIPE_READ]);
+			pipeclose(cs->stdout_pipe[PIPE_WRITE]);
+			pipeclose(cs->stderr_pipe[PIPE_READ]);
+			pipeclose(cs->stderr_pipe[PIPE_WRITE]);
+			cs->stdin_pipe[PIPE_READ] = -1;
+			cs->stdin_pipe[PIPE_WRITE] = -1;
+			cs->stdout_pipe[PIPE_READ] = -1;
+			cs->stdout_pipe[PIPE_WRITE] = -1;
+			cs->stderr_pipe[PIPE_READ] = -1;
+			cs->stderr_pipe[PIPE_WRITE] = -1;
 			return -5;
 		}
 		break;
@@ -436,15 +660,15 @@ start_subprocess_open_pipe(int nthread, int compression_level)
 		default:
 		{
 			// parent process
-			pid_compress = pid;
+			cs->pid_compress = pid;
 
-			pipeclose(aStdinPipe[PIPE_READ]);
-			pipeclose(aStdoutPipe[PIPE_WRITE]);
-			pipeclose(aStderrPipe[PIPE_WRITE]);
+			pipeclose(cs->stdin_pipe[PIPE_READ]);
+			pipeclose(cs->stdout_pipe[PIPE_WRITE]);
+			pipeclose(cs->stderr_pipe[PIPE_WRITE]);
 
-			aStdinPipe[PIPE_READ] = -1;
-			aStdoutPipe[PIPE_WRITE] = -1;
-			aStderrPipe[PIPE_WRITE] = -1;
+			cs->stdin_pipe[PIPE_READ] = -1;
+			cs->stdout_pipe[PIPE_WRITE] = -1;
+			cs->stderr_pipe[PIPE_WRITE] = -1;
 			return 0;
 		}
 		break;
@@ -452,7 +676,7 @@ start_subprocess_open_pipe(int nthread, int compression_level)
 #else
 
 	/* for debug */
-	if (pthread_create(&pid_compress, NULL, oss_compress_main, NULL) != 0)
+	if (pthread_create(&cs->pid_compress, NULL, oss_compress_main, NULL) != 0)
 		elog(ERROR, "pthread_create");
 
 #endif
@@ -461,145 +685,149 @@ start_subprocess_open_pipe(int nthread, int compression_level)
 }
 
 static void
-reset_global_variable(void)
+reset_compress_state(oss_compress_state *cs)
 {
-	if (aStdinPipe[PIPE_READ] != -1)
+	if (cs->stdin_pipe[PIPE_READ] != -1)
 	{
-		pipeclose(aStdinPipe[PIPE_READ]);
-		aStdinPipe[PIPE_READ] = -1;
+		pipeclose(cs->stdin_pipe[PIPE_READ]);
+		cs->stdin_pipe[PIPE_READ] = -1;
 	}
 
-	if (aStdinPipe[PIPE_WRITE] != -1)
+	if (cs->stdin_pipe[PIPE_WRITE] != -1)
 	{
-		pipeclose(aStdinPipe[PIPE_WRITE]);
-		aStdinPipe[PIPE_WRITE] = -1;
+		pipeclose(cs->stdin_pipe[PIPE_WRITE]);
+		cs->stdin_pipe[PIPE_WRITE] = -1;
 	}
 
-	if (aStdoutPipe[PIPE_READ] != -1)
+	if (cs->stdout_pipe[PIPE_READ] != -1)
 	{
-		pipeclose(aStdoutPipe[PIPE_READ]);
-		aStdoutPipe[PIPE_READ] = -1;
+		pipeclose(cs->stdout_pipe[PIPE_READ]);
+		cs->stdout_pipe[PIPE_READ] = -1;
 	}
 
-	if (aStdoutPipe[PIPE_WRITE] != -1)
+	if (cs->stdout_pipe[PIPE_WRITE] != -1)
 	{
-		pipeclose(aStdoutPipe[PIPE_WRITE]);
-		aStdoutPipe[PIPE_WRITE] = -1;
+		pipeclose(cs->stdout_pipe[PIPE_WRITE]);
+		cs->stdout_pipe[PIPE_WRITE] = -1;
 	}
 
-	if (aStderrPipe[PIPE_READ] != -1)
+	if (cs->stderr_pipe[PIPE_READ] != -1)
 	{
-		pipeclose(aStderrPipe[PIPE_READ]);
-		aStderrPipe[PIPE_READ] = -1;
+		pipeclose(cs->stderr_pipe[PIPE_READ]);
+		cs->stderr_pipe[PIPE_READ] = -1;
 	}
 
-	if (aStderrPipe[PIPE_WRITE] != -1)
+	if (cs->stderr_pipe[PIPE_WRITE] != -1)
 	{
-		pipeclose(aStderrPipe[PIPE_WRITE]);
-		aStderrPipe[PIPE_WRITE] = -1;
+		pipeclose(cs->stderr_pipe[PIPE_WRITE]);
+		cs->stderr_pipe[PIPE_WRITE] = -1;
 	}
 
-	if (pid_compress != THREAD_PID_NULL)
+	if (cs->pid_compress != THREAD_PID_NULL)
 	{
 #ifndef WIN32
 		int 		status;
 		int 		r;
 
-		r = waitpid(pid_compress, &status, 0);
+		r = waitpid(cs->pid_compress, &status, 0);
 #endif
 		elog(WARNING, "oss compress process does not close");
-		pid_compress = THREAD_PID_NULL;
+		cs->pid_compress = THREAD_PID_NULL;
 	}
 
-	if (th_writer != THREAD_PID_NULL)
+	if (cs->th_writer != THREAD_PID_NULL)
 	{
 		elog(WARNING, "oss compres thread does not close");
-		th_writer = THREAD_PID_NULL;
+		cs->th_writer = THREAD_PID_NULL;
 	}
 
-	oss_writer_init = false;
-	oss_writer_exit_witherr = false;
+	cs->writer_init = false;
+	cs->writer_exit_witherr = false;
 }
 
-static void * 
+static void *
 oss_write_main(void *arg)
 {
 	ext_oss_t *wstate = (ext_oss_t *)arg;
+	oss_compress_state *cs = (oss_compress_state *) wstate->com_hd;
 	int 	rlen = 0;
 	int 	buffer_size = wstate->size;
 	oss_connect		conn;
 	int		offset = 0;
 	bool	exit_with_error = true;
 
-	snprintf(oss_host, MAX_OSS_STR_LEN, "%s", wstate->conn.osshost);
-	snprintf(oss_id, MAX_OSS_STR_LEN, "%s", wstate->conn.ossid);
-	snprintf(oss_key, MAX_OSS_STR_LEN, "%s", wstate->conn.osskey);
-	snprintf(oss_bucket, MAX_OSS_STR_LEN, "%s", wstate->conn.bucket);
-	snprintf(oss_file_name, MAX_OSS_OBJECT_NAME_LEN, "%s", wstate->currentfile); 
-	oss_ro = wstate->ro;
-	oss_oe = wstate->write_opt;
-	conn.osshost = oss_host;
-	conn.ossid = oss_id;
-	conn.osskey = oss_key;
-	conn.bucket = oss_bucket;
-	oss_write_error_msg[0] = 0;
+	snprintf(cs->host, MAX_OSS_STR_LEN, "%s", wstate->conn.osshost);
+	snprintf(cs->id, MAX_OSS_STR_LEN, "%s", wstate->conn.ossid);
+	snprintf(cs->key, MAX_OSS_STR_LEN, "%s", wstate->conn.osskey);
+	snprintf(cs->bucket, MAX_OSS_STR_LEN, "%s", wstate->conn.bucket);
+	snprintf(cs->file_name, MAX_OSS_OBJECT_NAME_LEN, "%s", wstate->currentfile);
+	cs->ro = wstate->ro;
+	cs->buffer_size = buffer_size;
+	conn.osshost = cs->host;
+	conn.ossid = cs->id;
+	conn.osskey = cs->key;
+	conn.bucket = cs->bucket;
+	cs->error_msg[0] = 0;
 
-	if (oss_write_buffer)
+	if (cs->write_buffer)
 	{
-		free(oss_write_buffer);
-		oss_write_buffer = NULL;
+		free(cs->write_buffer);
+		cs->write_buffer = NULL;
 	}
-	oss_write_buffer = malloc(buffer_size);
-	if (oss_write_buffer == NULL)
+	cs->write_buffer = malloc(buffer_size);
+	if (cs->write_buffer == NULL)
 	{
-		snprintf(oss_write_error_msg, ERROR_MESSAGE_LEN, "oss write thread out of memory");
+		snprintf(cs->error_msg, ERROR_MESSAGE_LEN, "oss write thread out of memory");
 		goto oss_write_err;
 	}
 
-	if (oss_write_temp)
+	if (cs->write_temp)
 	{
-		free(oss_write_temp);
-		oss_write_temp = NULL;
+		free(cs->write_temp);
+		cs->write_temp = NULL;
 	}
-	oss_write_temp = malloc(buffer_size);
-	if (oss_write_temp == NULL)
+	cs->write_temp = malloc(buffer_size);
+	if (cs->write_temp == NULL)
 	{
-		snprintf(oss_write_error_msg, ERROR_MESSAGE_LEN, "oss write thread out of memeory");
+		snprintf(cs->error_msg, ERROR_MESSAGE_LEN, "oss write thread out of memeory");
 		goto oss_write_err;
 	}
 
-	oss_writer_init = true;
+	cs->writer_init = true;
 	while(1)
 	{
-		rlen = piperead(aStdoutPipe[PIPE_READ], oss_write_temp, buffer_size);
+		rlen = piperead(cs->stdout_pipe[PIPE_READ], cs->write_temp, buffer_size);
 		if (rlen > 0)
 		{
 			bool	rc = 0;
 
 			if (offset + rlen > buffer_size)
 			{
-				rc = oss_append_file_from_buffer(&conn, oss_file_name, oss_write_buffer,
-											offset, false, 0, oss_ro, true, oss_write_error_msg);
+				rc = oss_append_file_from_buffer(&conn, cs->file_name, cs->write_buffer,
+											offset, false, 0, cs->ro, true, cs->error_msg);
 				if (rc == false)
 				{
 					goto oss_write_err;
 				}
-				memset(oss_write_buffer, 0, buffer_size);
+				memset(cs->write_buffer, 0, buffer_size);
 				offset = 0;
 			}
 
-			memcpy(oss_write_buffer + offset, oss_write_temp, rlen);
+			memcpy(cs->write_buffer + offset, cs->write_temp, rlen);
 			offset += rlen;
+
+			/* everything read from pigz ends up in the current oss file */
+			cs->compressed_bytes += rlen;
 		}
 		else
 		{
 			if(rlen < 0)
 			{
-				snprintf(oss_write_error_msg, ERROR_MESSAGE_LEN, "oss compress read from pipe fail %d %s", errno, strerror(errno));
+				snprintf(cs->error_msg, ERROR_MESSAGE_LEN, "oss compress read from pipe fail %d %s", errno, strerror(errno));
 				goto oss_write_err;
 			}
-			pipeclose(aStdoutPipe[PIPE_READ]);
-			aStdoutPipe[PIPE_READ] = -1;
+			pipeclose(cs->stdout_pipe[PIPE_READ]);
+			cs->stdout_pipe[PIPE_READ] = -1;
 			break;
 		}
 	}
@@ -608,8 +836,8 @@ oss_write_main(void *arg)
 
 	if (offset > 0)
 	{
-		bool rc = oss_append_file_from_buffer(&conn, oss_file_name, oss_write_buffer,
-								offset, false, 0, oss_ro, true, oss_write_error_msg);
+		bool rc = oss_append_file_from_buffer(&conn, cs->file_name, cs->write_buffer,
+								offset, false, 0, cs->ro, true, cs->error_msg);
 		if (rc == false)
 		{
 			exit_with_error = true;
@@ -619,43 +847,38 @@ oss_write_main(void *arg)
 
 oss_write_err:
 
-	oss_writer_exit_witherr = exit_with_error;
-	shutdown_write_thread();
+	shutdown_write_thread(cs);
+	cs->writer_exit_witherr = exit_with_error;
 	return NULL;
 }
 
 static void
-shutdown_write_thread(void)
+shutdown_write_thread(oss_compress_state *cs)
 {
-	oss_host[0] = 0;
-	oss_id[0] = 0;
-	oss_key[0] = 0;
-	oss_bucket[0] = 0;
-	oss_file_name[0] = 0;
+	cs->host[0] = 0;
+	cs->id[0] = 0;
+	cs->key[0] = 0;
+	cs->bucket[0] = 0;
+	cs->file_name[0] = 0;
 
-	if (oss_write_buffer)
+	if (cs->write_buffer)
 	{
-		free(oss_write_buffer);
-		oss_write_buffer = NULL;
+		free(cs->write_buffer);
+		cs->write_buffer = NULL;
 	}
 
-	if (oss_write_temp)
+	if (cs->write_temp)
 	{
-		free(oss_write_temp);
-		oss_write_temp = NULL;
+		free(cs->write_temp);
+		cs->write_temp = NULL;
 	}
 
-	oss_ro.speed_limit = AOS_MIN_SPEED_LIMIT;
-	oss_ro.speed_time = AOS_MIN_SPEED_TIME;
-	oss_ro.dns_cache_timeout = AOS_DNS_CACHE_TIMOUT;
-	oss_ro.connect_timeout = AOS_CONNECT_TIMEOUT;
-
-	oss_oe.flush_block = OSS_FLUSH_BUF_DEFAULT_SIZE;
-	oss_oe.file_max_size = OSS_WRITE_FILE_DEFAULT_SIZE;
-	oss_oe.nthread = OSS_DEFAULT_COMPRESS_THREAD_NUM;
-	oss_oe.async = false;
-	oss_oe.pipe_block_size = DEFAULT_PIPE_BLOCK_SIZE;
-	oss_oe.compression_level = DEFAULT_OSS_COMPRESS_LEVEL;
+	cs->ro.speed_limit = AOS_MIN_SPEED_LIMIT;
+	cs->ro.speed_time = AOS_MIN_SPEED_TIME;
+	cs->ro.dns_cache_timeout = AOS_DNS_CACHE_TIMOUT;
+	cs->ro.connect_timeout = AOS_CONNECT_TIMEOUT;
+	cs->ro.http2 = false;
+	cs->buffer_size = 0;
 }
 
 static bool
@@ -674,4 +897,3 @@ file_exists(const char *name)
 
 	return false;
 }
-
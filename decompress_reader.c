@@ -2,6 +2,7 @@
 
 #include "ossapi.h"
 #include "decompress_reader.h"
+#include "oss_gzindex.h"
 
 /*
  * For inflate, windowBits can be greater than 15 for optional gzip decoding. Add 32 to windowBits
@@ -14,6 +15,8 @@ const char *str_oss_compression[] =
 	"text",
 	"gzip",
 	"zlib",
+	"bzip2",
+	"zstd",
 	"unknown",
 	NULL
 };
@@ -21,27 +24,32 @@ const char *str_oss_compression[] =
 uint64 OSS_ZIP_DECOMPRESS_CHUNKSIZE = OSS_ZIP_DEFAULT_CHUNKSIZE;
 
 #define		GZIP_MAGIC_BLOCK		"\x1f\x8b\x08"
-#define		BZ2_MAGIC_BLOCK		"\x42\x5a\x68"
 
-static uint64 get_z_decompressed_bytes_num(z_decompress_reader *reader);
 static void z_decompress(OssHander	*myData, z_decompress_reader *reader, bool async, char *msg);
+static void z_decompress_range(z_decompress_reader *reader, uint64 produced);
+static void z_decompress_checkpoint(z_decompress_reader *reader, int flags);
+static void z_decompress_finish_file(OssHander *myData, z_decompress_reader *reader, bool async);
 
 z_decompress_reader *
-init_z_decompress_reader(void)
+init_z_decompress_reader(uint64 chunksize)
 {
-	z_decompress_reader *reader = palloc(sizeof(z_decompress_reader));
+	z_decompress_reader *reader = palloc0(sizeof(z_decompress_reader));
 
-	reader->in = palloc(OSS_ZIP_DECOMPRESS_CHUNKSIZE);
-	reader->out = palloc(OSS_ZIP_DECOMPRESS_CHUNKSIZE);
+	reader->chunksize = chunksize;
+
+	reader->in = palloc(reader->chunksize);
+	reader->out = palloc(reader->chunksize);
+	reader->window = palloc(OSS_GZINDEX_WINDOW);
 	if (reader->in == NULL || reader->out == NULL)
 	{
 		elog(ERROR, "create decompress buffer out of memory");
 	}
 
-	memset(reader->in, 0, OSS_ZIP_DECOMPRESS_CHUNKSIZE);
-	memset(reader->out, 0, OSS_ZIP_DECOMPRESS_CHUNKSIZE);
+	memset(reader->in, 0, reader->chunksize);
+	memset(reader->out, 0, reader->chunksize);
 	
 	reader->outOffset = 0;
+	reader->outEnd = 0;
 	return reader;
 }
 
@@ -50,16 +58,26 @@ z_decompress_reader_destroy(z_decompress_reader *reader)
 {
 	inflateEnd(&reader->zstream);
 
+	oss_gzindex_free(reader->build);
+
 	pfree(reader->in);
 	pfree(reader->out);
+	pfree(reader->window);
 	pfree(reader);
 
 	return;
 }
 
+/*
+ * Start decoding the current file of myData. A work queue unit of an indexed
+ * file starts at a checkpoint: raw deflate primed with the bits and window
+ * of the checkpoint, or a gzip member header.
+ */
 void 
-z_decompress_reader_open(z_decompress_reader *reader, bool async, char *msg) 
+z_decompress_reader_open(OssHander *myData, z_decompress_reader *reader, bool async, char *msg)
 {
+	oss_gz_point *point = myData->gz_point;
+	int			windowbits = OSS_INFLATE_WINDOWSBITS;
 	int ret = 0;
 
     /* allocate inflate state for zlib */
@@ -70,12 +88,60 @@ z_decompress_reader_open(z_decompress_reader *reader, bool async, char *msg)
     reader->zstream.next_out = (Byte *)reader->out;
 
     reader->zstream.avail_in = 0;
-    reader->zstream.avail_out = OSS_ZIP_DECOMPRESS_CHUNKSIZE;
+    reader->zstream.avail_out = reader->chunksize;
 
     reader->outOffset = 0;
+	reader->outEnd = 0;
+	reader->eof = false;
+
+	reader->in_offset = myData->offset;
+	reader->in_next = myData->offset;
+	reader->out_base = 0;
+	reader->raw = false;
+	reader->prime_bits = 0;
+	reader->skip_in = 0;
+	reader->last_byte = '\n';
+
+	reader->range_end = myData->gz_end;
+	reader->range_skip = false;
+	reader->range_done = false;
+
+	oss_gzindex_free(reader->build);
+	reader->build = NULL;
+	reader->build_last = 0;
+
+	if (point != NULL)
+	{
+		reader->out_base = point->out;
+		reader->range_skip = (point->flags & OSS_GZPOINT_LINE) == 0;
+
+		if ((point->flags & OSS_GZPOINT_MEMBER) == 0)
+		{
+			windowbits = -MAX_WBITS;
+			reader->raw = true;
+			reader->prime_bits = point->bits;
+		}
+	}
 
     /* with OSS_INFLATE_WINDOWSBITS, it could recognize and decode both zlib and gzip stream. */
-	ret = inflateInit2(&reader->zstream, OSS_INFLATE_WINDOWSBITS);
+	ret = inflateInit2(&reader->zstream, windowbits);
+	if (ret == Z_OK && reader->raw && point->dict_len > 0)
+	{
+		if (!oss_gzindex_window(point, reader->window) ||
+			inflateSetDictionary(&reader->zstream, reader->window, point->dict_len) != Z_OK)
+		{
+			if (async)
+			{
+				snprintf(msg, ERROR_MESSAGE_LEN, "invalid gzip checkpoint in the index of %s", myData->currentfile);
+			}
+			else
+			{
+				elog(ERROR, "invalid gzip checkpoint in the index of %s", myData->currentfile);
+			}
+			return;
+		}
+	}
+
 	if (ret != Z_OK)
 	{
 		if (async)
@@ -88,6 +154,10 @@ z_decompress_reader_open(z_decompress_reader *reader, bool async, char *msg)
 		}
 	}
 
+	/* a failed allocation only means no index */
+	if (myData->gz_build)
+		reader->build = oss_gzindex_create();
+
 	return;
 }
 
@@ -102,21 +172,24 @@ size_t
 z_decompress_internal(OssHander	*myData, z_decompress_reader *com_hd, void *buf,
 								size_t bufSize, bool async, char *msg)
 {
-	uint64 remainingOutLen = get_z_decompressed_bytes_num(com_hd) - com_hd->outOffset;
 	uint64 count = 0;
 
-	if (remainingOutLen == 0)
+	/* a chunk can be all before or after the range of the unit */
+	while (com_hd->outOffset == com_hd->outEnd)
 	{
+		if (com_hd->eof)
+		{
+			return 0;
+		}
+
 		z_decompress(myData, com_hd, async, msg);
 		if (async && msg[0] != '\0')
 		{
 			return 0;
 		}
-		com_hd->outOffset = 0;
-		remainingOutLen = get_z_decompressed_bytes_num(com_hd);
 	}
 
-	count = Min(remainingOutLen, bufSize);
+	count = Min(com_hd->outEnd - com_hd->outOffset, bufSize);
 	memcpy(buf, com_hd->out + com_hd->outOffset, count);
 	com_hd->outOffset += count;
 
@@ -124,28 +197,37 @@ z_decompress_internal(OssHander	*myData, z_decompress_reader *com_hd, void *buf,
 }
 
 /*
- * Read compressed data from underlying reader and decompress to this->out buffer.
- * If no more data to consume, this->zstream.avail_out == OSS_ZIP_DECOMPRESS_CHUNKSIZE;
+ * Read compressed data from underlying reader and decompress to this->out
+ * buffer. Concatenated gzip members are decoded one after the other. At the
+ * end of the file, or of the range of a work queue unit, the next file is
+ * opened and nothing is decoded; reader->eof is set when there is none.
  */
 static void 
 z_decompress(OssHander	*myData, z_decompress_reader *reader, bool async, char *msg)
 {
+	z_stream   *zs = &reader->zstream;
 	int status = 0;
 
-	if (reader->zstream.avail_in == 0)
+	reader->outOffset = 0;
+	reader->outEnd = 0;
+	zs->avail_out = reader->chunksize;
+	zs->next_out = (Byte *)reader->out;
+
+	if (reader->range_done)
 	{
-		uint64 hasRead = 0;
+		goto next_file;
+	}
 
-retry_next:
-		reader->zstream.avail_out = OSS_ZIP_DECOMPRESS_CHUNKSIZE;
-		reader->zstream.next_out = (Byte *)reader->out;
+	if (zs->avail_in == 0)
+	{
+		uint64 hasRead = 0;
 
 		/*
-		* read OSS_ZIP_DECOMPRESS_CHUNKSIZE data from underlying reader and put into this->in
+		* read reader->chunksize data from underlying reader and put into this->in
 		* buffer. read() might happen more than once when reaching EOF, make sure every time read()
 		* will return 0.
 		*/
-		hasRead = SourceRead_internal(myData, reader->in, OSS_ZIP_DECOMPRESS_CHUNKSIZE, false, async, msg);
+		hasRead = SourceRead_internal(myData, reader->in, reader->chunksize, false, async, msg);
 
 		/* EOF, no more data to decompress. */
 		if (hasRead == 0)
@@ -154,52 +236,106 @@ retry_next:
 			{
 				elog(DEBUG1,
 					"No more data to decompress: avail_in = %u, avail_out = %u, total_in = %lu, total_out = %lu",
-					reader->zstream.avail_in, reader->zstream.avail_out, reader->zstream.total_in, reader->zstream.total_out);
+					zs->avail_in, zs->avail_out, zs->total_in, zs->total_out);
 			}
 			else if (msg[0] != '\0')
 			{
 				return;
 			}
 
-			oss_next_file(myData);
-			if (myData->currentfile != NULL)
-			{
-				inflateEnd(&reader->zstream);
-				z_decompress_reader_open(reader, async, msg);
-				if (async && msg[0] != '\0')
-				{
-					return;
-				}
-				else
-				{
-					goto retry_next;
-				}
-			}
+			goto next_file;
+		}
 
-		return;
-        }
+		reader->in_offset = reader->in_next;
+		reader->in_next += hasRead;
+		zs->next_in = (Byte *)reader->in;
+		zs->avail_in = hasRead;
 
-		reader->zstream.next_in = (Byte *)reader->in;
-		reader->zstream.avail_in = hasRead;
-	} 
-	else
+		/* the checkpoint is in the middle of this byte */
+		if (reader->prime_bits > 0)
+		{
+			int			bits = reader->prime_bits;
+
+			reader->prime_bits = 0;
+			inflatePrime(zs, bits, ((unsigned char) reader->in[0]) >> (8 - bits));
+			zs->next_in++;
+			zs->avail_in--;
+		}
+	}
+
+	if (reader->skip_in > 0)
 	{
- 		/* Still have more data in 'in' buffer to decode. */
-		reader->zstream.avail_out = OSS_ZIP_DECOMPRESS_CHUNKSIZE;
-		reader->zstream.next_out = (Byte *)reader->out;
+		uInt		n = Min((uInt) reader->skip_in, zs->avail_in);
+
+		zs->next_in += n;
+		zs->avail_in -= n;
+		reader->skip_in -= n;
 	}
 
-	status = inflate(&reader->zstream, Z_NO_FLUSH);
-	if (status == Z_STREAM_END)
+	while (zs->avail_in > 0 && zs->avail_out > 0)
 	{
-		if (async == false)
+		Byte	   *out = zs->next_out;
+
+		/* stop at every block end to find checkpoints */
+		status = inflate(zs, reader->build ? Z_BLOCK : Z_NO_FLUSH);
+		if (zs->next_out > out)
 		{
-			elog(DEBUG1, "Decompression finished: Z_STREAM_END.");
+			reader->last_byte = zs->next_out[-1];
 		}
-	} 
-	else if (status < 0 || status == Z_NEED_DICT)
+
+		if (status == Z_STREAM_END)
+		{
+			if (async == false)
+			{
+				elog(DEBUG1, "Decompression finished: Z_STREAM_END.");
+			}
+
+			/* raw deflate leaves the gzip trailer of the member to us */
+			if (reader->raw)
+			{
+				uInt		n = Min(8, zs->avail_in);
+
+				zs->next_in += n;
+				zs->avail_in -= n;
+				reader->skip_in = 8 - n;
+				reader->raw = false;
+			}
+
+			status = inflateReset2(zs, OSS_INFLATE_WINDOWSBITS);
+			if (status != Z_OK)
+			{
+				break;
+			}
+
+			/* not another member, e.g. zero padding, the file is done */
+			if (zs->avail_in > 0 && reader->skip_in == 0 && *zs->next_in != 0x1f)
+			{
+				zs->avail_in = 0;
+				reader->range_done = true;
+				break;
+			}
+
+			if (reader->build && zs->avail_in > 0)
+			{
+				z_decompress_checkpoint(reader, OSS_GZPOINT_MEMBER);
+			}
+			continue;
+		}
+		else if (status < 0 || status == Z_NEED_DICT)
+		{
+			break;
+		}
+
+		/* after a block end, but not after the last one */
+		if (reader->build && (zs->data_type & 128) && !(zs->data_type & 64))
+		{
+			z_decompress_checkpoint(reader, 0);
+		}
+	}
+
+	if (status < 0 || status == Z_NEED_DICT)
 	{
-		inflateEnd(&reader->zstream);
+		inflateEnd(zs);
 		if (async)
 		{
 			snprintf(msg, ERROR_MESSAGE_LEN, "Failed to decompress data: %d", status);
@@ -208,14 +344,144 @@ retry_next:
 		{
 			elog(ERROR, "Failed to decompress data: %d", status);
 		}
+		return;
+	}
+
+	reader->outEnd = reader->chunksize - zs->avail_out;
+	z_decompress_range(reader, reader->outEnd);
+	reader->out_base += reader->outEnd;
+
+	return;
+
+next_file:
+	z_decompress_finish_file(myData, reader, async);
+
+	oss_next_file(myData);
+	if (myData->currentfile != NULL)
+	{
+		inflateEnd(zs);
+		z_decompress_reader_open(myData, reader, async, msg);
+	}
+	else
+	{
+		reader->eof = true;
 	}
 
 	return;
 }
 
-static uint64 
-get_z_decompressed_bytes_num(z_decompress_reader *reader)
+/*
+ * A unit gives the lines starting in its range: the first line is skipped
+ * unless the checkpoint is at a line start, the last one is read to its end
+ * past the range.
+ */
+static void
+z_decompress_range(z_decompress_reader *reader, uint64 produced)
 {
-	return OSS_ZIP_DECOMPRESS_CHUNKSIZE - reader->zstream.avail_out;
+	char	   *nl;
+
+	if (reader->range_skip)
+	{
+		nl = memchr(reader->out, '\n', produced);
+		if (nl == NULL)
+		{
+			reader->outOffset = produced;
+		}
+		else
+		{
+			reader->outOffset = nl - reader->out + 1;
+			reader->range_skip = false;
+		}
+	}
+
+	if (reader->range_end >= 0)
+	{
+		int64		from = Max(reader->range_end - 1 - reader->out_base, 0);
+
+		if (from < (int64) produced)
+		{
+			nl = memchr(reader->out + from, '\n', produced - from);
+			if (nl != NULL)
+			{
+				reader->outEnd = Max((uint64) (nl - reader->out + 1), reader->outOffset);
+				reader->range_done = true;
+			}
+		}
+	}
 }
 
+/*
+ * Add a checkpoint at the current position of the decoder if the last one is
+ * far enough, a gzip member start or a deflate block end. Runs in the read
+ * thread, a failure only drops the index.
+ */
+static void
+z_decompress_checkpoint(z_decompress_reader *reader, int flags)
+{
+	z_stream   *zs = &reader->zstream;
+	int64		in = reader->in_offset + ((char *) zs->next_in - reader->in);
+	int64		out = reader->out_base + ((char *) zs->next_out - reader->out);
+	uInt		dict_len = 0;
+	int			bits = 0;
+
+	if (out == 0 || in - reader->build_last < OSS_GZINDEX_SPAN)
+	{
+		return;
+	}
+
+	if ((flags & OSS_GZPOINT_MEMBER) == 0)
+	{
+		bits = zs->data_type & 7;
+		if (inflateGetDictionary(zs, reader->window, &dict_len) != Z_OK)
+		{
+			goto fail;
+		}
+	}
+
+	if (reader->last_byte == '\n')
+	{
+		flags |= OSS_GZPOINT_LINE;
+	}
+
+	if (!oss_gzindex_add(reader->build, in, out, bits, flags, reader->window, dict_len))
+	{
+		goto fail;
+	}
+
+	reader->build_last = in;
+	return;
+
+fail:
+	oss_gzindex_free(reader->build);
+	reader->build = NULL;
+}
+
+/*
+ * The current file has been decoded whole, store the index built on the
+ * way. A scan without the right to write the bucket just goes without.
+ */
+static void
+z_decompress_finish_file(OssHander *myData, z_decompress_reader *reader, bool async)
+{
+	char		errmsg[ERROR_MESSAGE_LEN];
+
+	if (reader->build == NULL)
+	{
+		return;
+	}
+
+	if (reader->build->npoints > 0)
+	{
+		reader->build->length = myData->length;
+
+		errmsg[0] = '\0';
+		if (!oss_gzindex_save(&myData->conn, myData->currentfile, reader->build, myData->ro, errmsg) &&
+			async == false)
+		{
+			elog(DEBUG1, "could not save the gzip index of %s: %s", myData->currentfile, errmsg);
+		}
+	}
+
+	oss_gzindex_free(reader->build);
+	reader->build = NULL;
+}
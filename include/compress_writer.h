@@ -16,6 +16,9 @@
 #define MIN_COMPRESS_LEVEL			1
 #define MAX_COMPRESS_LEVEL			9
 
+/* MB */
+#define MAX_GZIP_MEMBER_SIZE		4000
+
 
 extern int init_compress_writer(ext_oss_t * self, bool init_subprocess);
 
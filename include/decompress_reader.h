@@ -8,6 +8,7 @@
 extern const char *str_oss_compression[];
 
 #define OSS_ZIP_DEFAULT_CHUNKSIZE (1024 * 1024 * 2)
+#define OSS_ZIP_MIN_CHUNKSIZE (256 * 1024)
 
 extern uint64	OSS_ZIP_DECOMPRESS_CHUNKSIZE;
 
@@ -27,19 +28,41 @@ typedef struct _z_stream
 typedef z_stream *z_streamp;
 #endif
 
+typedef struct ext_oss_t OssHander;
+typedef struct ext_oss_t OssSource;
+
 typedef struct z_decompress_reader
 {
 	z_stream	zstream;
 	char		*in;
 	char		*out;
 	uint64		outOffset;
-} z_decompress_reader;
+	uint64		outEnd;			/* end of the output handed out */
+	uint64		chunksize;		/* size of in and out */
+	bool		eof;
 
-typedef struct ext_oss_t OssHander;
-typedef struct ext_oss_t OssSource;
+	/* where the decoding is in the current file */
+	int64		in_offset;		/* file offset of in[0] */
+	int64		in_next;		/* file offset of the next read */
+	int64		out_base;		/* uncompressed offset of out[0] */
+	bool		raw;			/* raw deflate, started from a checkpoint */
+	int			prime_bits;		/* of the first byte read, for a checkpoint */
+	int			skip_in;		/* gzip trailer bytes left to skip */
+	unsigned char last_byte;	/* last byte decoded */
+
+	/* uncompressed range of a work queue unit */
+	int64		range_end;		/* -1 to the end of the file */
+	bool		range_skip;		/* looking for the first line start */
+	bool		range_done;
+
+	/* checkpoint index built while reading a whole file */
+	struct oss_gzindex *build;
+	int64		build_last;
+	unsigned char *window;
+} z_decompress_reader;
 
-extern void z_decompress_reader_open(z_decompress_reader *reader, bool async, char *msg) ;
-extern z_decompress_reader *init_z_decompress_reader(void);
+extern void z_decompress_reader_open(OssHander *myData, z_decompress_reader *reader, bool async, char *msg);
+extern z_decompress_reader *init_z_decompress_reader(uint64 chunksize);
 extern void z_decompress_reader_destroy(z_decompress_reader *reader);
 extern size_t z_decompress_internal(OssHander *myData, z_decompress_reader *com_hd, void *buf,
 													size_t bufSize, bool async, char *msg);
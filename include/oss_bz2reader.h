@@ -0,0 +1,95 @@
+#ifndef INCLUDE_OSS_BZ2READER_H_
+#define INCLUDE_OSS_BZ2READER_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+
+#define BZ2_MAGIC_BLOCK			"\x42\x5a\x68"
+
+#define OSS_BZ2_DEFAULT_WORKERS	4
+#define OSS_BZ2_MIN_WORKERS		1
+#define OSS_BZ2_MAX_WORKERS		16
+
+#define OSS_BZ2_READ_SIZE		(4 * READ_UNIT_SIZE)
+
+/*
+ * A block holds at most 900k bytes before the transform; compressed it can
+ * only exceed that by its tables. Anything longer between two magics is not
+ * bzip2.
+ */
+#define OSS_BZ2_MAX_BLOCK		(4 * 1024 * 1024)
+
+/* decoder state of a worker plus two blocks in and out of flight */
+#define OSS_BZ2_WORKER_MEM		(8 * 1024 * 1024)
+
+typedef enum
+{
+	OSS_BZ2_FREE = 0,
+	OSS_BZ2_READY,				/* compressed, waiting for a worker */
+	OSS_BZ2_BUSY,
+	OSS_BZ2_DONE				/* decoded, waiting for the scan */
+} oss_bz2_state;
+
+/*
+ * One block, rewritten as a bzip2 stream of its own so that it decodes
+ * without the blocks before it.
+ */
+typedef struct oss_bz2_job
+{
+	oss_bz2_state	state;
+	int64		seq;
+	char		filename[OSS_MAX_FILE_PATH];
+	int64		offset;			/* of the block in the file, compressed */
+
+	char	   *in;
+	int64		in_len;
+	int64		in_size;
+
+	char	   *out;
+	int64		out_len;
+	int64		out_size;
+	int64		pos;			/* bytes handed to the scan */
+} oss_bz2_job;
+
+/*
+ * A bzip2 file is a sequence of independent blocks, each starting with a
+ * 48 bit magic at any bit offset. The split thread reads the files of the
+ * segment and cuts them at the magics, the workers decode the blocks in
+ * whatever order they finish, and the scan takes the output back in file
+ * order from a ring of jobs, which bounds the memory.
+ */
+typedef struct oss_bz2reader
+{
+	ext_oss_t  *myData;
+
+	oss_bz2_job *jobs;
+	int			njobs;
+	int64		next_split;		/* seq of the next block cut */
+	int64		next_decode;	/* seq of the next block for a worker */
+	int64		next_read;		/* seq of the block read by the scan */
+	bool		split_done;
+	oss_bz2_job *cur;			/* block being read by the scan */
+
+	pthread_t	splitter;
+	pthread_t  *workers;
+	int			nworkers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;		/* a job changed state, or stop */
+	volatile bool	stop;
+
+	/* the file being cut, touched by the split thread only */
+	unsigned char *buf;
+	int64		buf_size;		/* without the pad byte */
+	int64		buf_len;
+	int64		buf_base;		/* offset of buf in the file */
+
+	int64		blocks;
+	bool		error;
+	char		errmsg[ERROR_MESSAGE_LEN];
+} oss_bz2reader;
+
+extern void CreateBz2Source(ext_oss_t *self);
+
+#endif /* INCLUDE_OSS_BZ2READER_H_ */
@@ -0,0 +1,29 @@
+#ifndef INCLUDE_OSS_ENDPOINT_H_
+#define INCLUDE_OSS_ENDPOINT_H_
+
+#include "postgres.h"
+
+#include "lib/aos_define.h"
+
+/* addresses of an endpoint the requests are spread over */
+#define OSS_ENDPOINT_MAX_ADDRS		16
+#define OSS_ENDPOINT_ADDR_LEN		64
+
+/* the addresses are looked up again after this many seconds */
+#define OSS_ENDPOINT_RESOLVE_SEC	AOS_DNS_CACHE_TIMOUT
+
+/* endpoints a table may choose from, the host of its location included */
+#define OSS_ENDPOINT_MAX			8
+
+/* percent of the scans which try another endpoint than the best one */
+#define OSS_ENDPOINT_EXPLORE_PCT	10
+
+/* a failed or throttled request weighs this many times a good one */
+#define OSS_ENDPOINT_ERROR_PENALTY	10
+
+extern bool oss_endpoint_spread;
+
+extern char *oss_endpoint_choose(char **hosts, int nhosts);
+extern char *oss_endpoint_connect_to(aos_pool_t *p, const char *host);
+
+#endif /* INCLUDE_OSS_ENDPOINT_H_ */
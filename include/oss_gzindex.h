@@ -0,0 +1,66 @@
+#ifndef INCLUDE_OSS_GZINDEX_H_
+#define INCLUDE_OSS_GZINDEX_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+
+/* the index of a gzip object is the object name plus this suffix */
+#define OSS_GZINDEX_SUFFIX		".ossidx"
+#define OSS_GZINDEX_MAGIC		"OSSGZIX2"
+
+/* compressed bytes between two checkpoints */
+#define OSS_GZINDEX_SPAN		(32 * 1024 * 1024)
+#define OSS_GZINDEX_WINDOW		32768
+
+#define OSS_GZINDEX_MAX_SIZE	(256 * 1024 * 1024)
+
+/* room for the ETag of the object, quotes included */
+#define OSS_GZINDEX_ETAG_LEN	128
+
+/* the point is at a gzip member header, decoding needs no window */
+#define OSS_GZPOINT_MEMBER		0x01
+/* out is at a line start */
+#define OSS_GZPOINT_LINE		0x02
+
+/*
+ * A place decoding can start from. in is the offset of the first compressed
+ * byte after the point, bits are the last bits of the byte before it still
+ * to be decoded, window the 32K of uncompressed data before out, deflated.
+ */
+typedef struct oss_gz_point
+{
+	int64		in;
+	int64		out;
+	int32		bits;
+	int32		flags;
+	int32		dict_len;		/* uncompressed size of the window */
+	int32		window_len;
+	unsigned char *window;
+} oss_gz_point;
+
+/*
+ * Checkpoints of one gzip object, kept in malloc'ed memory since they are
+ * built by the read thread. length and etag are those of the object indexed,
+ * an index of another length or ETag is stale: the object was written again.
+ */
+typedef struct oss_gzindex
+{
+	int64		length;
+	char		etag[OSS_GZINDEX_ETAG_LEN];
+	int			npoints;
+	int			maxpoints;
+	oss_gz_point *points;
+} oss_gzindex;
+
+extern oss_gzindex *oss_gzindex_create(void);
+extern void oss_gzindex_free(oss_gzindex *index);
+extern bool oss_gzindex_add(oss_gzindex *index, int64 in, int64 out, int bits, int flags,
+							const unsigned char *dict, int dict_len);
+extern bool oss_gzindex_window(oss_gz_point *point, unsigned char *dict);
+extern oss_gzindex *oss_gzindex_load(oss_connect *conn, char *filename, int64 length,
+									 oss_request_options ro);
+extern bool oss_gzindex_save(oss_connect *conn, char *filename, oss_gzindex *index,
+							 oss_request_options ro, char *msg);
+
+#endif /* INCLUDE_OSS_GZINDEX_H_ */
@@ -0,0 +1,85 @@
+#ifndef INCLUDE_OSS_HEDGE_H_
+#define INCLUDE_OSS_HEDGE_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+
+/* percent of the GETs which may be sent twice */
+#define OSS_HEDGE_DEFAULT_BUDGET		5
+#define OSS_HEDGE_MAX_BUDGET			50
+
+/* a GET slower than this percentile of the recent ones gets a twin */
+#define OSS_HEDGE_DEFAULT_PERCENTILE	95
+#define OSS_HEDGE_MIN_PERCENTILE		50
+#define OSS_HEDGE_MAX_PERCENTILE		99
+
+/* GETs the percentile is taken over, and how many before it is trusted */
+#define OSS_HEDGE_SAMPLES				128
+#define OSS_HEDGE_MIN_SAMPLES			20
+
+/* the percentile is sorted again after this many new samples */
+#define OSS_HEDGE_REFRESH				16
+
+/* below this the twin would only add load, usec */
+#define OSS_HEDGE_MIN_DELAY				(20 * 1000)
+
+/*
+ * The read thread sends its GET itself and hands a copy of the request to
+ * the hedge thread, which waits for the delay and, if the GET is still
+ * running by then, sends the same range on another connection into a
+ * buffer of its own. Whichever comes back first cancels the other; the
+ * twin's data is copied over only once the read thread's GET has given up.
+ */
+typedef struct oss_hedge
+{
+	oss_connect	conn;
+	oss_request_options	ro;
+
+	int			budget;
+	int			percentile;
+
+	/* elapsed usec of the recent GETs and the delay, read thread only */
+	int64		samples[OSS_HEDGE_SAMPLES];
+	int			nsamples;
+	int			next_sample;
+	int			stale;			/* samples since delay was computed */
+	int64		delay;
+
+	pthread_t	th;
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;
+	volatile bool	stop;
+
+	/* the GET of the read thread, under lock */
+	bool		pending;		/* waiting for the delay to pass */
+	bool		busy;			/* the hedge thread has not finished with it */
+	bool		primary_done;
+	bool		hedge_sent;
+	bool		hedge_done;
+	char		filename[OSS_MAX_FILE_PATH];
+	int64		offset;
+	size_t		len;
+	int64		deadline;		/* usec since the epoch */
+
+	volatile int	cancel_primary;
+	volatile int	cancel_hedge;
+
+	/* the twin */
+	char	   *buf;
+	int64		buf_size;
+	size_t		hedge_read;
+	oss_read_timing	hedge_timing;
+	char		errmsg[ERROR_MESSAGE_LEN];
+
+	int64		requests;
+	int64		hedged;
+	int64		won;			/* GETs the twin answered first */
+} oss_hedge;
+
+extern void oss_hedge_start(ext_oss_t *myData);
+extern size_t oss_hedge_read(ext_oss_t *myData, void *buffer, int64 offset, size_t len,
+							 oss_read_timing *timing);
+extern void oss_hedge_stop(ext_oss_t *myData);
+
+#endif /* INCLUDE_OSS_HEDGE_H_ */
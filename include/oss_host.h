@@ -0,0 +1,252 @@
+#ifndef INCLUDE_OSS_HOST_H_
+#define INCLUDE_OSS_HOST_H_
+
+#include "postgres.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "lib/aos_define.h"
+
+/*
+ * State shared by every segment of one host.
+ *
+ * The segments of a host are separate postmasters, so the host state lives in
+ * a POSIX shared memory object owned by the os user running the cluster
+ * rather than in the shared memory of one of them. Bump OSS_HOST_SHM_VERSION
+ * once in a release that changes oss_host_shared, a segment running another
+ * build then maps a different object instead of misreading this one. The
+ * segment creating the object of a version unlinks those of the earlier
+ * versions, which would otherwise stay in /dev/shm until the host reboots.
+ */
+#define OSS_HOST_SHM_NAME		"/oss_ext.%d.v%d"
+#define OSS_HOST_SHM_VERSION	2
+#define OSS_HOST_SHM_MAGIC		0x4f535345
+
+#define OSS_HOST_MAX_CLIENTS	1024
+#define OSS_HOST_MAX_STATS		128
+
+/* default host memory budget of the import and export buffers, in MB */
+#define OSS_HOST_MEMORY_BUDGET_DEFAULT	2048
+#define OSS_HOST_MEMORY_BUDGET_MAX		(1024 * 1024)
+
+/* default and largest memory in MB a process keeps for the next response bodies */
+#define OSS_HOST_BODY_POOL_DEFAULT	16
+#define OSS_HOST_BODY_POOL_MAX		1024
+
+/* host caps of the transfer in MB/s and of the requests per second, 0 is unlimited */
+#define OSS_HOST_BANDWIDTH_LIMIT_MAX	(1024 * 1024)
+#define OSS_HOST_REQUEST_LIMIT_MAX		(1000 * 1000)
+
+/* a bucket fills up to this many seconds of its rate */
+#define OSS_HOST_RATE_BURST_SEC		1
+
+/*
+ * A backend shares the rates while it took from them in this window. When
+ * some backend had to wait lately, one which took more than its share in
+ * the current second waits as well, even if the buckets are not empty.
+ */
+#define OSS_HOST_RATE_ACTIVE_MSEC	2000
+#define OSS_HOST_RATE_CONTENDED_MSEC	100
+
+/* scans sharing their files between the segments of a host */
+#define OSS_HOST_MAX_SCANS			64
+#define OSS_HOST_SCAN_MAX_SEGMENTS	64
+#define OSS_HOST_SCAN_MAX_UNITS		8192
+
+/* endpoints the retry policy keeps a budget and a breaker for */
+#define OSS_HOST_MAX_ENDPOINTS		16
+#define OSS_HOST_ENDPOINT_LEN		128
+
+/* retries all segments of a host may make to one endpoint, per second */
+#define OSS_HOST_RETRY_RATE			100
+
+/*
+ * After this many failed requests in a row the endpoint is taken as down:
+ * while the breaker is open requests fail without being sent. Once it has
+ * been open for OSS_HOST_BREAKER_OPEN_MSEC one request is let through to
+ * probe the endpoint, the others still failing: it closes the breaker when
+ * it goes through, and opens it for another while when it fails.
+ */
+#define OSS_HOST_BREAKER_FAILURES	64
+#define OSS_HOST_BREAKER_OPEN_MSEC	30000
+
+/*
+ * Requests in flight to one endpoint from all segments of a host. The
+ * window grows by one per window of requests that went through, and is cut
+ * by OSS_HOST_WINDOW_DECREASE on a throttled or failed request, or when the
+ * first byte takes OSS_HOST_WINDOW_INFLATION times longer than it lately
+ * did at best; at most once per OSS_HOST_WINDOW_HOLD_MSEC.
+ */
+#define OSS_HOST_WINDOW_MIN			4
+#define OSS_HOST_WINDOW_INIT		32
+#define OSS_HOST_WINDOW_MAX			1024
+#define OSS_HOST_WINDOW_DECREASE	0.7
+#define OSS_HOST_WINDOW_INFLATION	4
+#define OSS_HOST_WINDOW_HOLD_MSEC	200
+
+/* the best first byte time is forgotten after this long, usec below it is noise */
+#define OSS_HOST_RTT_MIN_MSEC		10000
+#define OSS_HOST_RTT_FLOOR_USEC		(20 * 1000)
+
+/*
+ * A request waiting for the window is woken when a slot is given back, and
+ * looks again at least this often for a cancel or a backend which died
+ * holding slots, the latter every OSS_HOST_WINDOW_REAP_WAITS waits.
+ */
+#define OSS_HOST_WINDOW_WAIT_MSEC	100
+#define OSS_HOST_WINDOW_REAP_WAITS	10
+
+/* weight of a request in the moving averages the endpoints are chosen by */
+#define OSS_HOST_HEALTH_WEIGHT		0.05
+
+typedef enum
+{
+	OSS_WINDOW_OK = 0,			/* went through */
+	OSS_WINDOW_CONGESTED,		/* throttled, 5xx or timed out */
+	OSS_WINDOW_NEUTRAL			/* cancelled, tells nothing */
+} oss_window_outcome;
+
+typedef struct oss_host_scan_key
+{
+	uint32		cluster;		/* of the coordinator, see oss_wq_cluster() */
+	int32		session_id;
+	int32		command_id;
+	int32		slice_id;
+	Oid			relid;
+	int32		seq;			/* scans of the process in the command */
+} oss_host_scan_key;
+
+typedef struct oss_host_scan
+{
+	bool		inuse;
+	oss_host_scan_key	key;
+	int			nunits;
+	int			nattached;
+	int32		segments[OSS_HOST_SCAN_MAX_SEGMENTS];	/* -1 if free */
+	pid_t		pids[OSS_HOST_SCAN_MAX_SEGMENTS];
+	uint8		claimed[OSS_HOST_SCAN_MAX_UNITS / 8];
+} oss_host_scan;
+
+/*
+ * Token bucket. A take may drive it below zero, the takers after it wait
+ * until it is paid back, so that one large transfer needs no bucket as
+ * large.
+ */
+typedef struct oss_host_bucket
+{
+	double		tokens;
+	int64		stamp;			/* usec of the last refill */
+} oss_host_bucket;
+
+typedef struct oss_host_endpoint
+{
+	char		name[OSS_HOST_ENDPOINT_LEN];	/* empty if free */
+	int64		window_start;	/* msec, second the retries are counted in */
+	int			window_retries;
+	int			failures;		/* failed requests in a row */
+	int64		open_until;		/* msec, the breaker is open before */
+
+	/* request window */
+	double		window;
+	int			inflight;
+	int64		rtt_min;		/* usec, best time to first byte lately */
+	int64		rtt_min_stamp;	/* msec */
+	int64		last_decrease;	/* msec */
+
+	/* health, moving averages over the requests */
+	int64		requests;
+	double		ttfb_avg;		/* usec, of the downloads */
+	double		error_avg;		/* share of the requests congested */
+} oss_host_endpoint;
+
+typedef struct oss_host_client
+{
+	pid_t		pid;
+	int64		mem_granted;	/* buffer bytes granted to this backend */
+	int16		inflight[OSS_HOST_MAX_ENDPOINTS];	/* requests in the windows */
+
+	/* rate sharing */
+	int64		rate_last;		/* msec of the last take */
+	int64		rate_second;	/* msec, second the takes are counted in */
+	int64		rate_bytes;
+	int64		rate_requests;
+} oss_host_client;
+
+typedef struct oss_host_shared
+{
+	uint32		magic;
+	pthread_mutex_t	lock;		/* process shared, robust */
+
+	/* memory governor */
+	int64		mem_budget;		/* bytes, 0 means unlimited */
+	int64		mem_granted;	/* sum of the client grants */
+	int64		mem_granted_peak;
+	int64		mem_reduced;	/* grants smaller than the ask */
+
+	int			nclients;		/* slots in use */
+	oss_host_client	clients[OSS_HOST_MAX_CLIENTS];
+
+	/* work sharing */
+	int64		scan_units_stolen;
+	oss_host_scan	scans[OSS_HOST_MAX_SCANS];
+
+	/* retry policy */
+	int64		retries;
+	int64		retries_denied;
+	int64		breaker_trips;
+	int			failing;		/* endpoints with failures, read unlocked */
+	int64		window_decreases;
+	int64		window_waits;	/* requests which had to wait for the window */
+	int			window_waiters;	/* waiting now, on window_cond */
+	pthread_cond_t	window_cond;	/* process shared, monotonic clock */
+	oss_host_endpoint	endpoints[OSS_HOST_MAX_ENDPOINTS];
+
+	/* rate governor */
+	int64		bandwidth_limit;	/* bytes per second, 0 is unlimited */
+	int64		request_limit;
+	oss_host_bucket	bytes_bucket;
+	oss_host_bucket	requests_bucket;
+	int64		rate_contended;	/* msec a backend last had to wait */
+	int64		rate_waits;
+	int64		rate_wait_msec;
+
+	/* response body chunks, high-water marks of the processes */
+	int64		body_pool_peak;		/* bytes a process had in use at once */
+	int64		body_pool_idle_peak;
+	int64		body_chunks_peak[AOS_BUF_POOL_CLASSES];
+	int64		body_chunks_allocated;
+	int64		body_chunks_reused;
+} oss_host_shared;
+
+typedef struct oss_host_stat
+{
+	const char *name;
+	int64		value;
+} oss_host_stat;
+
+extern int	oss_host_memory_budget;
+extern int	oss_host_bandwidth_limit;
+extern int	oss_host_request_limit;
+extern int	oss_host_body_pool_size;
+
+extern void oss_host_attach(void);
+extern int64 oss_host_mem_acquire(int64 want, int64 min);
+extern void oss_host_mem_release(int64 bytes);
+extern int	oss_host_get_stats(oss_host_stat *stats, int max);
+extern int	oss_host_scan_attach(const oss_host_scan_key *key, int segindex, int nunits);
+extern int	oss_host_scan_claim(int scan_id, int segindex, const int32 *owners, int nunits, bool *stolen);
+extern void oss_host_scan_detach(int scan_id);
+extern bool oss_host_retry_acquire(const char *endpoint);
+extern bool oss_host_breaker_admit(const char *endpoint);
+extern bool oss_host_breaker_failure(const char *endpoint);
+extern void oss_host_breaker_success(const char *endpoint);
+extern void oss_host_bucket_refill(oss_host_bucket *bucket, double rate, int64 now);
+extern int64 oss_host_rate_take(int64 bytes, int requests);
+extern void oss_host_rate_waited(int64 msec);
+extern void oss_host_body_pool_report(void);
+extern int	oss_host_window_enter(const char *endpoint);
+extern void oss_host_window_leave(int slot, oss_window_outcome outcome, int64 ttfb);
+extern bool oss_host_endpoint_health(const char *endpoint, double *ttfb, double *errors, bool *open);
+
+#endif /* INCLUDE_OSS_HOST_H_ */
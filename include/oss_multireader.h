@@ -0,0 +1,72 @@
+#ifndef INCLUDE_OSS_MULTIREADER_H_
+#define INCLUDE_OSS_MULTIREADER_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+#include "decompress_reader.h"
+
+#define OSS_MULTIREADER_MAX_FILES	16
+
+#define OSS_MR_BLOCK_SIZE		READ_UNIT_SIZE
+#define OSS_MR_READ_SIZE		(4 * READ_UNIT_SIZE)
+#define OSS_MR_INFLATE_SIZE		(256 * 1024)
+
+/* read buffer and line carry of a worker plus its share of the queue */
+#define OSS_MR_WORKER_MEM		(OSS_MR_READ_SIZE + 4 * OSS_MR_BLOCK_SIZE)
+
+/* whole lines of one file, queued for the scan */
+typedef struct oss_mr_block
+{
+	struct oss_mr_block *next;
+	int			len;
+	int			pos;			/* bytes handed to the scan */
+	char		data[1];
+} oss_mr_block;
+
+typedef struct oss_mr_worker
+{
+	char	   *in;				/* compressed input */
+	char	   *carry;			/* decoded data, ends in a partial line */
+	int64		carry_len;
+	int64		carry_size;
+	z_stream	zs;
+} oss_mr_worker;
+
+/*
+ * Several files of the segment are read and decoded at once, each by a
+ * worker thread which cuts its output at line ends. The scan takes the
+ * blocks in whatever order they are ready, so rows of different files
+ * interleave; a row must therefore not span lines.
+ */
+typedef struct oss_multireader
+{
+	oss_connect	conn;
+	oss_request_options	ro;
+	oss_compression_type	type;
+
+	oss_file   *files;
+	int			nfiles;
+	int			nextfile;		/* next file for a worker */
+
+	pthread_t  *workers;
+	int			nworkers;
+	int			running;		/* workers not finished */
+
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;		/* room in the queue or stop */
+	oss_mr_block *head;
+	oss_mr_block *tail;
+	int64		queued;			/* bytes in the queue */
+	int64		queue_limit;
+	volatile bool	stop;
+
+	oss_mr_block *cur;			/* block being read by the scan */
+
+	bool		error;
+	char		errmsg[ERROR_MESSAGE_LEN];
+} oss_multireader;
+
+extern bool CreateMultiReaderSource(ext_oss_t *self);
+
+#endif /* INCLUDE_OSS_MULTIREADER_H_ */
@@ -0,0 +1,70 @@
+#ifndef INCLUDE_OSS_PREFETCH_H_
+#define INCLUDE_OSS_PREFETCH_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+
+#define OSS_PREFETCH_DEFAULT_FILES	4
+#define OSS_PREFETCH_MAX_FILES		16
+
+/* objects up to this size are fetched whole, larger ones get their head fetched */
+#define OSS_PREFETCH_SLOT_SIZE		(2 * READ_UNIT_SIZE)
+
+typedef enum
+{
+	OSS_PREFETCH_EMPTY = 0,
+	OSS_PREFETCH_LOADING,
+	OSS_PREFETCH_READY,
+	OSS_PREFETCH_FAILED
+} oss_prefetch_state;
+
+typedef struct oss_prefetch_slot
+{
+	int			fileno;			/* file of the scan held, -1 if none */
+	oss_prefetch_state	state;
+	char	   *data;
+	int64		len;			/* bytes held, from the start of the file */
+} oss_prefetch_slot;
+
+typedef struct oss_prefetch_file
+{
+	char	   *filename;
+	int64		length;
+} oss_prefetch_file;
+
+/*
+ * The files of a scan are numbered in the order oss_next_file() takes them,
+ * file 0 is the one being read when the prefetch starts. A thread fetches
+ * the files after the one being read into a ring of slots; a slot is reused
+ * only once the scan has moved past its file.
+ */
+typedef struct oss_prefetch
+{
+	oss_connect	conn;
+	oss_request_options	ro;
+
+	oss_prefetch_file *files;
+	int			nfiles;
+
+	oss_prefetch_slot *slots;
+	int			nslots;
+	int64		slot_size;
+
+	pthread_t	th;
+	pthread_mutex_t lock;
+	volatile bool	stop;
+
+	int			consumed;		/* file being read by the scan */
+	int			next;			/* next file to fetch */
+	oss_prefetch_slot *cur;		/* slot of the file being read, or NULL */
+
+	char		errmsg[ERROR_MESSAGE_LEN];
+} oss_prefetch;
+
+extern void oss_prefetch_start(ext_oss_t *myData);
+extern void oss_prefetch_next_file(ext_oss_t *myData);
+extern size_t oss_prefetch_read(ext_oss_t *myData, void *buffer, int64 offset, size_t len);
+extern void oss_prefetch_stop(ext_oss_t *myData);
+
+#endif /* INCLUDE_OSS_PREFETCH_H_ */
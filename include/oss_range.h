@@ -0,0 +1,30 @@
+#ifndef INCLUDE_OSS_RANGE_H_
+#define INCLUDE_OSS_RANGE_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+
+/* MB */
+#define OSS_RANGE_DEFAULT_MIN		1
+#define OSS_RANGE_DEFAULT_MAX		4
+#define OSS_RANGE_LIMIT				64
+
+/*
+ * A GET is sized to this many times the bandwidth-delay product, which
+ * keeps the wait for the first byte to about a fifth of the request.
+ */
+#define OSS_RANGE_BDP_FACTOR		4
+
+/* weight of a new sample in the smoothed latency and rate */
+#define OSS_RANGE_ALPHA				0.25
+
+/* GETs shorter than this say little about the rate */
+#define OSS_RANGE_MIN_SAMPLE		(64 * 1024)
+
+#define OSS_RANGE_ALIGN				(64 * 1024)
+
+extern void oss_range_init(oss_range_tuner *range, int64 min_size, int64 max_size);
+extern void oss_range_observe(oss_range_tuner *range, int64 bytes, oss_read_timing *timing);
+
+#endif /* INCLUDE_OSS_RANGE_H_ */
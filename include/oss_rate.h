@@ -0,0 +1,30 @@
+#ifndef INCLUDE_OSS_RATE_H_
+#define INCLUDE_OSS_RATE_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+#include "oss_host.h"
+
+/* caps of one scan in a segment, MB/s and requests per second */
+#define OSS_RATE_BANDWIDTH_MAX		OSS_HOST_BANDWIDTH_LIMIT_MAX
+#define OSS_RATE_REQUEST_MAX		OSS_HOST_REQUEST_LIMIT_MAX
+
+/* a wait for the rate is cut into steps, so that a cancelled query stops waiting */
+#define OSS_RATE_SLEEP_STEP_MSEC	100
+
+/* buckets of a scan, shared by its threads through the oss_connect copies */
+typedef struct oss_rate_limit
+{
+	pthread_mutex_t lock;
+	int64		bandwidth;		/* bytes per second, 0 is unlimited */
+	int64		requests;
+	oss_host_bucket	bytes_bucket;
+	oss_host_bucket	requests_bucket;
+} oss_rate_limit;
+
+extern oss_rate_limit *oss_rate_limit_create(int bandwidth_mb, int requests);
+extern void oss_rate_acquire(oss_rate_limit *limit, int64 bytes);
+extern void oss_rate_limit_destroy(oss_rate_limit *limit);
+
+#endif /* INCLUDE_OSS_RATE_H_ */
@@ -0,0 +1,65 @@
+#ifndef INCLUDE_OSS_RETRY_H_
+#define INCLUDE_OSS_RETRY_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+#include "oss_rate.h"
+#include "lib/aos_status.h"
+#include "lib/aos_define.h"
+#include "lib/aos_transport.h"
+
+/* retries of one request */
+#define OSS_RETRY_COUNT				30
+
+/* decorrelated jitter: each wait is drawn between the base and 3 times the last one */
+#define OSS_RETRY_BASE_MSEC			50
+#define OSS_RETRY_CAP_MSEC			10000
+
+/* longest Retry-After of the server which is honoured */
+#define OSS_RETRY_AFTER_MAX_MSEC	30000
+
+/* the wait is cut into steps, so that a cancelled query stops retrying */
+#define OSS_RETRY_SLEEP_STEP_MSEC	100
+
+/*
+ * A scan may retry a tenth of its requests on top of the retries one
+ * request always had.
+ */
+#define OSS_RETRY_SCAN_RATIO		10
+#define OSS_RETRY_SCAN_MIN			OSS_RETRY_COUNT
+
+#define OSS_HTTP_TOO_MANY_REQUESTS	429
+#define OSS_HTTP_SERVICE_UNAVAILABLE	503
+
+/* retries of a scan, shared by its threads through the oss_connect copies */
+typedef struct oss_retry_budget
+{
+	volatile int64	requests;
+	volatile int64	retries;
+	volatile int64	denied;
+} oss_retry_budget;
+
+/* one request and its retries */
+typedef struct oss_retry
+{
+	oss_retry_budget *budget;	/* NULL outside of a scan */
+	oss_rate_limit *rate;		/* caps of the scan, NULL if none */
+	const char *endpoint;
+	int			attempt;
+	int			sleep_msec;		/* last wait */
+	unsigned int seed;
+	const char *denied;			/* what refused the last retry, if not the count */
+	bool		refused;		/* the breaker turned the attempt away */
+	int			window_slot;	/* in the host request window, -1 if none */
+	bool		upload;			/* attempt sends a body */
+} oss_retry;
+
+extern oss_retry_budget *oss_retry_budget_create(void);
+extern void oss_retry_init(oss_retry *retry, oss_connect *conn);
+extern bool oss_retry_next(oss_retry *retry, aos_status_t *s, aos_table_t *resp_headers);
+extern void oss_retry_success(oss_retry *retry);
+extern bool oss_retry_enter(oss_retry *retry, aos_http_controller_t *ctl, int64 bytes, bool upload);
+extern void oss_retry_leave(oss_retry *retry, aos_status_t *s, aos_http_controller_t *ctl);
+
+#endif /* INCLUDE_OSS_RETRY_H_ */
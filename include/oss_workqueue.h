@@ -0,0 +1,67 @@
+#ifndef INCLUDE_OSS_WORKQUEUE_H_
+#define INCLUDE_OSS_WORKQUEUE_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+
+/* bytes read at a unit boundary looking for the end of the line */
+#define OSS_WQ_PROBE_SIZE		(64 * 1024)
+
+#define OSS_WQ_SPLIT_SIZE_MAX	(64 * 1024)		/* MB */
+
+/*
+ * A range of a file, or the whole file. The range of a gzip file is
+ * uncompressed, from a checkpoint of its index to the next one used.
+ */
+typedef struct oss_wq_unit
+{
+	int			file;
+	int			point;			/* checkpoint at start, -1 for none */
+	int64		start;
+	int64		end;			/* -1 to the end of a gzip file */
+} oss_wq_unit;
+
+/*
+ * Every segment of the scan cuts the same files into the same units, each
+ * unit belongs to the segment the file would be statically assigned to, or
+ * round robin when files are split. The claims are kept in the host state,
+ * so a segment done with its own units takes those the other segments of
+ * the host have not started yet.
+ *
+ * A unit which is a range of a file reads the lines starting in it: from
+ * the byte after the first newline at or after start - 1, to the first
+ * newline at or after end - 1. Both segments reading the units on each side
+ * of a boundary find the same line end there.
+ *
+ * With gzip_index alone the queue is not shared: each segment reads its own
+ * units, which splits the indexed gzip files over the segments. A segment
+ * which can't get the host scan reads its own units the same way.
+ */
+typedef struct oss_workqueue
+{
+	oss_file   *files;
+	int			nfiles;
+
+	oss_wq_unit *units;
+	int32	   *owners;			/* segment of each unit */
+	int			nunits;
+
+	struct oss_gzindex **indexes;	/* of each file, or NULL */
+	bool		build;			/* index the gzip files without one */
+
+	bool		shared;
+	int			scan;			/* host scan, -1 once detached */
+	int			cursor;			/* next unit to look at when not shared */
+	int64		claimed;
+	int64		stolen;
+
+	char	   *probe;
+	char		errmsg[ERROR_MESSAGE_LEN];
+} oss_workqueue;
+
+extern bool oss_workqueue_start(ext_oss_t *myData, List *files);
+extern void oss_workqueue_next(ext_oss_t *myData);
+extern void oss_workqueue_stop(ext_oss_t *myData);
+
+#endif /* INCLUDE_OSS_WORKQUEUE_H_ */
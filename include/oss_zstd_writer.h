@@ -0,0 +1,22 @@
+#ifndef INCLUDE_OSS_ZSTD_WRITER_H_
+#define INCLUDE_OSS_ZSTD_WRITER_H_
+
+#include "postgres.h"
+
+#include "ossapi.h"
+
+#define DEFAULT_ZSTD_COMPRESS_LEVEL		3
+#define MIN_ZSTD_COMPRESS_LEVEL			1
+#define MAX_ZSTD_COMPRESS_LEVEL			19
+
+/* past this the adaptive level would swing between a slow link and a slow cpu */
+#define MAX_ZSTD_ADAPTIVE_LEVEL			15
+
+/* the adaptive level is reconsidered once per period */
+#define ZSTD_ADAPT_PERIOD_MSEC			1000
+/* share of the period the backend waits before the level moves */
+#define ZSTD_ADAPT_WAIT_RATIO			0.1
+
+extern int init_zstd_writer(ext_oss_t *self);
+
+#endif /* INCLUDE_OSS_ZSTD_WRITER_H_ */
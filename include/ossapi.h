@@ -8,6 +8,7 @@
 
 #ifndef WIN32
 #include <sys/time.h>
+#include <sys/uio.h>
 
 typedef struct timeval TimevalStruct;
 
@@ -42,6 +43,8 @@ do { \
 #define SPIN_SLEEP_MSEC		10
 #define READ_UNIT_SIZE		(1024 * 1024)
 #define INITIAL_BUF_LEN		(16 * READ_UNIT_SIZE)
+#define MIN_BUF_LEN			(4 * READ_UNIT_SIZE)
+#define READ_AHEAD_LEN		(8 * READ_UNIT_SIZE)
 #define ERROR_MESSAGE_LEN	1024
 
 #define WRITE_UNIT_SIZE		(1024 * 1024)
@@ -56,11 +59,14 @@ do { \
 #define OSS_WRITE_FILE_MIN_SIZE		(8 * WRITE_UNIT_SIZE)
 #define OSS_WRITE_FILE_MAX_SIZE		(((uint64) 4000) * WRITE_UNIT_SIZE)
 
+#define OSS_WRITE_CHUNK_SIZE		(256 * 1024)
+
 typedef struct oss_request_options {
     int speed_limit;
     int speed_time;
     int dns_cache_timeout;
     int connect_timeout;
+    bool http2;			/* streams on shared connections */
 } oss_request_options;
 
 typedef struct oss_connect {
@@ -68,6 +74,8 @@ typedef struct oss_connect {
 	char	   *ossid;
 	char	   *osskey;
 	char	   *bucket;
+	struct oss_retry_budget *retry;	/* of the scan, NULL if none */
+	struct oss_rate_limit *rate;	/* caps of the scan, NULL if none */
 } oss_connect;
 
 #ifdef HAVE_LONG_INT_64
@@ -94,6 +102,8 @@ typedef enum
 	OSS_COMPRESSION_NONE = 0,
 	OSS_COMPRESSION_GZIP,
 	OSS_COMPRESSION_ZLIB,
+	OSS_COMPRESSION_BZIP2,
+	OSS_COMPRESSION_ZSTD,
 	OSS_COMPRESSION_UNKNOWN
 } oss_compression_type;
 
@@ -116,6 +126,8 @@ typedef struct oss_exp_options {
 	bool	async;
 	int		pipe_block_size;
 	int		compression_level;
+	bool	adaptive_level;	/* zstd level follows the upload and compress speed */
+	int64	member_size;	/* uncompressed bytes of a gzip member, 0 for one stream */
 } oss_exp_options;
 
 typedef struct
@@ -124,6 +136,50 @@ typedef struct
 	char	   *filename;
 } oss_file;
 
+/* of one GET, in microseconds */
+typedef struct oss_read_timing
+{
+	int64		ttfb;			/* to the first byte of the response */
+	int64		elapsed;
+} oss_read_timing;
+
+/*
+ * Size of the ranged GETs of a scan, tuned from the smoothed first byte
+ * latency and transfer rate of the GETs done so far.
+ */
+typedef struct oss_range_tuner
+{
+	int64		size;
+	int64		min_size;
+	int64		max_size;
+	double		ttfb;			/* usec */
+	double		rate;			/* bytes per usec once the data flows */
+	int64		samples;
+} oss_range_tuner;
+
+typedef struct oss_write_chunk
+{
+	char	   *data;
+	int			len;
+} oss_write_chunk;
+
+/*
+ * Exported rows are batched into a chain of fixed size chunks, the whole chain
+ * is handed to the uploader or to the compressor as one iovec array.
+ */
+typedef struct oss_write_chain
+{
+	oss_write_chunk	*chunks;
+	struct iovec	*iov;
+	int			nchunks;		/* chunks allocated */
+	int			maxchunks;		/* length of chunks[] */
+	int			cur;			/* chunk being filled */
+	int			chunk_size;
+	int64		len;			/* bytes in the chain */
+	int64		capacity;		/* bytes the chain holds before a flush */
+	MemoryContext	ctx;
+} oss_write_chain;
+
 struct ext_oss_t
 {
 	char	   *url;
@@ -143,6 +199,36 @@ struct ext_oss_t
 
 	List	   *filelist;
 
+	/* files read at once by the multi reader, 0 or 1 reads them one by one */
+	int			parallel_files;
+
+	/* ranged GETs of the read thread */
+	oss_range_tuner	range;
+
+	/* duplicate the GETs of the read thread which run into the tail latency */
+	int			hedge_budget;		/* percent of the GETs, 0 disables */
+	int			hedge_percentile;
+	struct oss_hedge *hedge;
+
+	/* threads decoding the blocks of a bzip2 file */
+	int			decode_workers;
+
+	/* files fetched ahead of the one being read */
+	int			prefetch_files;
+	struct oss_prefetch *prefetch;
+
+	/* share the files with the other segments of the host */
+	bool		work_stealing;
+	int64		split_size;		/* MB, 0 reads whole files */
+	struct oss_workqueue *workqueue;
+	Oid			relid;
+
+	/* split gzip files at the checkpoints of their index, and build it */
+	bool		gzip_index;
+	struct oss_gz_point *gz_point;	/* start of the unit, NULL at file start */
+	int64		gz_end;			/* end of the unit uncompressed, -1 at file end */
+	bool		gz_build;		/* index the current file while reading it */
+
 	Source		base;
 
 	/* async mode */
@@ -157,6 +243,15 @@ struct ext_oss_t
 	int			begin;			/* begin of the buffer finished with reading */
 	int			end;			/* end of the buffer finished with reading */
 
+	/*
+	 * sync mode keeps a read ahead of the current file, its bytes are before
+	 * offset, which is how far the file has been fetched.
+	 */
+	char	   *ra_buffer;
+	int			ra_size;
+	int			ra_begin;
+	int			ra_end;
+
 	/*
 	 * because ereport() does not support multi-thread, the read thread stores
 	 * away error messsage in a message buffer.
@@ -169,6 +264,7 @@ struct ext_oss_t
 	uint32		file_max_size;
 
 	int			fileindex;
+	oss_write_chain	chain;
 	int64		file_flush_offset;
 	int64		write_row_count;
 	int64		write_byte_count;
@@ -185,6 +281,9 @@ struct ext_oss_t
 	char		*distributed_column;
 	bool		print_distributed_column;
 
+	/* buffer bytes granted by the host memory governor */
+	int64		mem_granted;
+
 	MemoryContext	ctx;
 };
 
@@ -196,12 +295,30 @@ extern size_t SourceRead_internal(ext_oss_t *myData, void *buffer, size_t len,
 				bool auto_next_file, bool async, char *msg);
 extern void oss_env_init(void);
 extern int64 oss_get_file_length(oss_connect *conn, char *filename, oss_request_options ro);
+extern bool oss_get_file_etag(oss_connect *conn, char *filename, int64 *length, char *etag, int etag_len,
+							  bool async, char *msg, oss_request_options ro);
 extern List *list_ossfiles_ondir(oss_connect *conn, char *dir, oss_request_options ro, bool is_prefix);
 extern bool is_ossfile_exist(oss_connect *conn, char *filename, oss_request_options ro);
 extern size_t oss_read_buffer(oss_connect *conn, char *filename, void *buffer, int64 offset, size_t len, bool async, char *msg, oss_request_options ro);
+extern size_t oss_read_buffer_timed(oss_connect *conn, char *filename, void *buffer, int64 offset, size_t len,
+									bool async, char *msg, oss_request_options ro, oss_read_timing *timing);
+extern size_t oss_read_buffer_cancel(oss_connect *conn, char *filename, void *buffer, int64 offset, size_t len,
+									 char *msg, oss_request_options ro, oss_read_timing *timing, volatile int *cancel);
+extern size_t oss_read_object(oss_connect *conn, char *filename, void *buffer, size_t len, bool async, char *msg, oss_request_options ro);
+extern bool oss_write_object(oss_connect *conn, char *filename, char *data, size_t len, bool async, char *msg, oss_request_options ro);
 extern bool oss_append_file_from_buffer(oss_connect *conn, char *filename, char *data, size_t len, bool checktype,
 										int64 append_position, oss_request_options ro,
 										bool async, char *msg);
+extern bool oss_append_file_from_iov(oss_connect *conn, char *filename, const struct iovec *iov, int iovcnt,
+										bool checktype, int64 append_position, oss_request_options ro,
+										bool async, char *msg);
+extern void oss_write_chain_init(oss_write_chain *chain, int64 capacity, int chunk_size, MemoryContext ctx);
+extern void oss_write_chain_append(oss_write_chain *chain, const char *data, size_t len);
+extern int oss_write_chain_iov(oss_write_chain *chain, struct iovec **iov);
+extern void oss_write_chain_reset(oss_write_chain *chain);
+extern void oss_write_chain_free(oss_write_chain *chain);
+extern int64 oss_buffer_grant(ext_oss_t *myData, int64 want, int64 min);
+extern void oss_buffer_release(ext_oss_t *myData, int64 bytes);
 extern bool is_endpoint_in_white_list(char *endpoint);
 extern void oss_next_file(ext_oss_t *myData);
 extern void oss_wirte_next_file(ext_oss_t *myData);
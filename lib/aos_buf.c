@@ -1,6 +1,31 @@
 #include "lib/aos_buf.h"
 #include "lib/aos_log.h"
 #include <apr_file_io.h>
+#include <apr_thread_mutex.h>
+
+#define AOS_BUF_POOL_KEY "aos_buf_pool"
+
+typedef struct aos_pool_buf_s aos_pool_buf_t;
+
+struct aos_pool_buf_s {
+    aos_buf_t buf;
+    aos_pool_buf_t *next;
+    int size_class;
+};
+
+// the chunks an apr pool holds
+typedef struct {
+    aos_pool_buf_t *bufs;
+} aos_buf_pool_owner_t;
+
+static apr_thread_mutex_t *bufPoolMutexG = NULL;
+static aos_pool_buf_t *bufPoolIdleG[AOS_BUF_POOL_CLASSES];
+static aos_buf_pool_stats_t bufPoolStatsG;
+static int64_t bufPoolMaxIdleG = AOS_BUF_POOL_MAX_IDLE;
+
+static apr_status_t aos_buf_pool_cleanup(void *data);
+static void aos_buf_pool_put(aos_pool_buf_t *bufs);
+static void aos_buf_pool_free(aos_pool_buf_t *bufs);
 
 aos_buf_t *aos_create_buf(aos_pool_t *p, int size)
 {
@@ -169,3 +194,211 @@ void aos_buf_append_string(aos_pool_t *p, aos_buf_t *b, const char *str, int len
         b->last = (uint8_t *)buf + size + len;
     }
 }
+
+int aos_buf_pool_init(aos_pool_t *p)
+{
+    int s;
+    int i;
+    char buf[256];
+
+    if ((s = apr_thread_mutex_create(&bufPoolMutexG, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+        aos_error_log("apr_thread_mutex_create failure, code:%d %s.\n", s, apr_strerror(s, buf, sizeof(buf)));
+        bufPoolMutexG = NULL;
+        return AOSE_INTERNAL_ERROR;
+    }
+
+    memset(&bufPoolStatsG, 0, sizeof(bufPoolStatsG));
+    for (i = 0; i < AOS_BUF_POOL_CLASSES; i++) {
+        bufPoolIdleG[i] = NULL;
+        bufPoolStatsG.classes[i].size = AOS_BUF_POOL_MIN_SIZE << (2 * i);
+    }
+
+    return AOSE_OK;
+}
+
+void aos_buf_pool_deinit()
+{
+    int i;
+
+    // chunks given back later are freed, the mutex goes with its pool
+    bufPoolMutexG = NULL;
+
+    for (i = 0; i < AOS_BUF_POOL_CLASSES; i++) {
+        aos_buf_pool_free(bufPoolIdleG[i]);
+        bufPoolIdleG[i] = NULL;
+        bufPoolStatsG.classes[i].idle = 0;
+    }
+    bufPoolStatsG.bytes_idle = 0;
+}
+
+aos_buf_t *aos_buf_pool_get(aos_pool_t *p, int64_t size)
+{
+    aos_buf_pool_owner_t *owner = NULL;
+    aos_buf_pool_class_stats_t *cs;
+    aos_pool_buf_t *pb;
+    aos_buf_t *b;
+    int c;
+
+    if (bufPoolMutexG == NULL) {
+        return aos_create_buf(p, (int)size);
+    }
+
+    for (c = 0; c < AOS_BUF_POOL_CLASSES - 1; c++) {
+        if (size <= (AOS_BUF_POOL_MIN_SIZE << (2 * c))) {
+            break;
+        }
+    }
+    cs = &bufPoolStatsG.classes[c];
+
+    apr_pool_userdata_get((void **)&owner, AOS_BUF_POOL_KEY, p);
+    if (owner == NULL) {
+        owner = (aos_buf_pool_owner_t *)aos_pcalloc(p, sizeof(aos_buf_pool_owner_t));
+        apr_pool_userdata_setn(owner, AOS_BUF_POOL_KEY, NULL, p);
+        apr_pool_cleanup_register(p, owner, aos_buf_pool_cleanup, apr_pool_cleanup_null);
+    }
+
+    apr_thread_mutex_lock(bufPoolMutexG);
+    pb = bufPoolIdleG[c];
+    if (pb != NULL) {
+        bufPoolIdleG[c] = pb->next;
+        cs->idle--;
+        cs->reused++;
+        bufPoolStatsG.bytes_idle -= cs->size;
+    } else {
+        cs->allocated++;
+    }
+    cs->in_use++;
+    cs->in_use_peak = aos_max(cs->in_use_peak, cs->in_use);
+    bufPoolStatsG.bytes_in_use += cs->size;
+    bufPoolStatsG.bytes_in_use_peak = aos_max(bufPoolStatsG.bytes_in_use_peak, bufPoolStatsG.bytes_in_use);
+    apr_thread_mutex_unlock(bufPoolMutexG);
+
+    if (pb == NULL) {
+        // the large chunks are mapped by malloc each time, which is what
+        // keeping them idle saves
+        pb = (aos_pool_buf_t *)malloc(sizeof(aos_pool_buf_t) + cs->size);
+        if (pb == NULL) {
+            aos_error_log("malloc body chunk failure, size:%d.", cs->size);
+            apr_thread_mutex_lock(bufPoolMutexG);
+            cs->allocated--;
+            cs->in_use--;
+            bufPoolStatsG.bytes_in_use -= cs->size;
+            apr_thread_mutex_unlock(bufPoolMutexG);
+            return NULL;
+        }
+        pb->size_class = c;
+    }
+
+    pb->next = owner->bufs;
+    owner->bufs = pb;
+
+    b = &pb->buf;
+    b->pos = (uint8_t *)pb + sizeof(aos_pool_buf_t);
+    b->start = b->pos;
+    b->last = b->start;
+    b->end = b->last + cs->size;
+    aos_list_init(&b->node);
+
+    return b;
+}
+
+void aos_buf_pool_set_max_idle(int64_t bytes)
+{
+    aos_pool_buf_t *drop = NULL;
+    aos_pool_buf_t *pb;
+    int c;
+
+    if (bufPoolMutexG == NULL) {
+        bufPoolMaxIdleG = bytes;
+        return;
+    }
+
+    apr_thread_mutex_lock(bufPoolMutexG);
+    bufPoolMaxIdleG = bytes;
+    for (c = AOS_BUF_POOL_CLASSES - 1; c >= 0; c--) {
+        while (bufPoolStatsG.bytes_idle > bytes && bufPoolIdleG[c] != NULL) {
+            pb = bufPoolIdleG[c];
+            bufPoolIdleG[c] = pb->next;
+            pb->next = drop;
+            drop = pb;
+            bufPoolStatsG.classes[c].idle--;
+            bufPoolStatsG.bytes_idle -= bufPoolStatsG.classes[c].size;
+        }
+    }
+    apr_thread_mutex_unlock(bufPoolMutexG);
+
+    aos_buf_pool_free(drop);
+}
+
+void aos_buf_pool_get_stats(aos_buf_pool_stats_t *stats)
+{
+    if (bufPoolMutexG == NULL) {
+        *stats = bufPoolStatsG;
+        return;
+    }
+
+    apr_thread_mutex_lock(bufPoolMutexG);
+    *stats = bufPoolStatsG;
+    apr_thread_mutex_unlock(bufPoolMutexG);
+}
+
+static apr_status_t aos_buf_pool_cleanup(void *data)
+{
+    aos_buf_pool_owner_t *owner = (aos_buf_pool_owner_t *)data;
+
+    aos_buf_pool_put(owner->bufs);
+    owner->bufs = NULL;
+
+    return APR_SUCCESS;
+}
+
+// give the chunks of a pool back, keeping as many idle as allowed
+static void aos_buf_pool_put(aos_pool_buf_t *bufs)
+{
+    aos_buf_pool_class_stats_t *cs;
+    aos_pool_buf_t *drop = NULL;
+    aos_pool_buf_t *pb;
+    aos_pool_buf_t *next;
+
+    if (bufs == NULL) {
+        return;
+    }
+
+    if (bufPoolMutexG == NULL) {
+        aos_buf_pool_free(bufs);
+        return;
+    }
+
+    apr_thread_mutex_lock(bufPoolMutexG);
+    for (pb = bufs; pb != NULL; pb = next) {
+        next = pb->next;
+        cs = &bufPoolStatsG.classes[pb->size_class];
+        cs->in_use--;
+        bufPoolStatsG.bytes_in_use -= cs->size;
+
+        if (bufPoolStatsG.bytes_idle + cs->size <= bufPoolMaxIdleG) {
+            pb->next = bufPoolIdleG[pb->size_class];
+            bufPoolIdleG[pb->size_class] = pb;
+            cs->idle++;
+            bufPoolStatsG.bytes_idle += cs->size;
+            bufPoolStatsG.bytes_idle_peak = aos_max(bufPoolStatsG.bytes_idle_peak, bufPoolStatsG.bytes_idle);
+        } else {
+            pb->next = drop;
+            drop = pb;
+        }
+    }
+    apr_thread_mutex_unlock(bufPoolMutexG);
+
+    aos_buf_pool_free(drop);
+}
+
+static void aos_buf_pool_free(aos_pool_buf_t *bufs)
+{
+    aos_pool_buf_t *next;
+
+    while (bufs != NULL) {
+        next = bufs->next;
+        free(bufs);
+        bufs = next;
+    }
+}
@@ -14,6 +14,23 @@ typedef struct {
     uint8_t *end;
 } aos_buf_t;
 
+typedef struct {
+    int size;               // of the chunks of the class
+    int64_t in_use;         // chunks held by requests
+    int64_t in_use_peak;
+    int64_t idle;           // chunks kept for the next requests
+    int64_t allocated;
+    int64_t reused;         // taken from the idle ones
+} aos_buf_pool_class_stats_t;
+
+typedef struct {
+    int64_t bytes_in_use;
+    int64_t bytes_in_use_peak;
+    int64_t bytes_idle;
+    int64_t bytes_idle_peak;
+    aos_buf_pool_class_stats_t classes[AOS_BUF_POOL_CLASSES];
+} aos_buf_pool_stats_t;
+
 typedef struct {
     aos_list_t node;
     int64_t file_pos;
@@ -35,6 +52,29 @@ char *aos_buf_list_content(aos_pool_t *p, aos_list_t *list);
 
 void aos_buf_append_string(aos_pool_t *p, aos_buf_t *b, const char *str, int len);
 
+/**
+ * The chunk pool recycles the memory of response bodies across requests.
+ * A chunk is held by the pool p it was got for, and goes back to the chunk
+ * pool when p is cleared or destroyed. Thread safe.
+ */
+int aos_buf_pool_init(aos_pool_t *p);
+
+void aos_buf_pool_deinit();
+
+/**
+ * @param size the bytes wanted, the chunk is of the smallest class holding
+ *        them, or of the largest class.
+ * @return the empty chunk, NULL if out of memory.
+ */
+aos_buf_t *aos_buf_pool_get(aos_pool_t *p, int64_t size);
+
+/**
+ * @param bytes of the idle chunks kept, the ones beyond are freed.
+ */
+void aos_buf_pool_set_max_idle(int64_t bytes);
+
+void aos_buf_pool_get_stats(aos_buf_pool_stats_t *stats);
+
 /**
  * @param fb file_pos, file_last equal file_size.
  * @return AOSE_OK success, other failure.
@@ -108,6 +108,12 @@ typedef apr_array_header_t aos_array_header_t;
 
 #define AOS_REQUEST_STACK_SIZE 32
 
+// size classes of the body chunk pool, 16KB to 1MB, and the bytes of idle
+// chunks it keeps by default
+#define AOS_BUF_POOL_CLASSES 4
+#define AOS_BUF_POOL_MIN_SIZE (16*1024)
+#define AOS_BUF_POOL_MAX_IDLE (16*1024*1024L)
+
 #define aos_abs(value)       (((value) >= 0) ? (value) : - (value))
 #define aos_max(val1, val2)  (((val1) < (val2)) ? (val2) : (val1))
 #define aos_min(val1, val2)  (((val1) > (val2)) ? (val2) : (val1))
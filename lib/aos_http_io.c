@@ -2,6 +2,8 @@
 #include "lib/aos_http_io.h"
 #include "lib/aos_define.h"
 #include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_proc.h>
 #include <apr_file_io.h>
 
 aos_pool_t *aos_global_pool = NULL;
@@ -18,8 +20,33 @@ static CURL *requestStackG[AOS_REQUEST_STACK_SIZE];
 static int requestStackCountG;
 static char aos_user_agent[256];
 
+// DNS cache, TLS sessions and connections shared by all the handles, with a
+// lock for each kind of data
+static CURLSH *requestShareG = NULL;
+static apr_thread_mutex_t *requestShareMutexG[CURL_LOCK_DATA_LAST];
+
+// HTTP/2 transfers of all threads go through one multi handle, so that they
+// can share connections as streams. The handle is only touched by its
+// thread, the others queue their transfers and wait for them under the mutex
+static CURLM *requestMultiG = NULL;
+static apr_thread_t *requestMultiThreadG = NULL;
+static apr_thread_mutex_t *requestMultiMutexG = NULL;
+static apr_thread_cond_t *requestMultiCondG = NULL;
+static aos_curl_http_transport_t *requestMultiPendingG = NULL;
+static aos_curl_http_transport_t *requestMultiActiveG = NULL;
+static int requestMultiStopG = 0;
+static int requestMultiFailedG = 0;
+
 
 static aos_http_transport_options_t *aos_http_transport_options_create(aos_pool_t *p);
+static int aos_request_share_create();
+static void aos_request_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+static void aos_request_share_unlock(CURL *handle, curl_lock_data data, void *userptr);
+static int aos_request_multi_start();
+static void *APR_THREAD_FUNC aos_request_multi_main(apr_thread_t *thread, void *data);
+static void aos_request_multi_wakeup();
+static int aos_request_multi_unlink(aos_curl_http_transport_t **list, aos_curl_http_transport_t *t);
+static void aos_request_multi_fail_all();
 
 CURL *aos_request_get()
 {
@@ -36,7 +63,11 @@ CURL *aos_request_get()
         curl_easy_reset(request);
     }
     else {
+        // curl_easy_reset keeps the share, only a new handle needs it
         request = curl_easy_init();
+        if (request && requestShareG) {
+            curl_easy_setopt(request, CURLOPT_SHARE, requestShareG);
+        }
     }
 
     return request;
@@ -203,14 +234,37 @@ int aos_read_http_body_file(aos_http_request_t *req, char *buffer, int len)
 int aos_write_http_body_memory(aos_http_response_t *resp, const char *buffer, int len)
 {
     aos_buf_t *b;
+    int64_t want;
+    int written = 0;
+    int n;
+
+    // the last chunk is filled up before another one is taken
+    b = aos_list_get_last(&resp->body, aos_buf_t, node);
+
+    while (len > 0) {
+        if (b == NULL || b->last == b->end) {
+            // the rest of the body when its length is known, otherwise as
+            // much again as came so far
+            want = resp->content_length - resp->body_len;
+            if (want < len) {
+                want = aos_max(len, resp->body_len);
+            }
+            if ((b = aos_buf_pool_get(resp->pool, want)) == NULL) {
+                return -1;
+            }
+            aos_list_add_tail(&b->node, &resp->body);
+        }
 
-    b = aos_create_buf(resp->pool, len);
-    memcpy(b->pos, buffer, len);
-    b->last += len;
-    aos_list_add_tail(&b->node, &resp->body);
-    resp->body_len += len;
+        n = aos_min(len, (int)(b->end - b->last));
+        memcpy(b->last, buffer, n);
+        b->last += n;
+        buffer += n;
+        len -= n;
+        resp->body_len += n;
+        written += n;
+    }
 
-    return len;
+    return written;
 }
 
 int aos_write_http_body_file(aos_http_response_t *resp, const char *buffer, int len)
@@ -282,6 +336,20 @@ int aos_http_io_initialize(const char *user_agent_info, int flags)
     }
     requestStackCountG = 0;
 
+    if ((s = aos_request_share_create()) != AOSE_OK) {
+        return s;
+    }
+
+    if ((s = aos_buf_pool_init(aos_global_pool)) != AOSE_OK) {
+        return s;
+    }
+
+    if ((s = apr_thread_mutex_create(&requestMultiMutexG, APR_THREAD_MUTEX_DEFAULT, aos_global_pool)) != APR_SUCCESS ||
+        (s = apr_thread_cond_create(&requestMultiCondG, aos_global_pool)) != APR_SUCCESS) {
+        aos_error_log("apr_thread_cond_create failure, code:%d %s.\n", s, apr_strerror(s, buf, sizeof(buf)));
+        return AOSE_INTERNAL_ERROR;
+    }
+
     apr_snprintf(aos_user_agent, sizeof(aos_user_agent)-1, "%s(Compatible %s)", 
                  AOS_VER, user_agent_info);
 
@@ -302,12 +370,34 @@ int aos_http_io_initialize(const char *user_agent_info, int flags)
 
 void aos_http_io_deinitialize()
 {
+    apr_status_t rv;
+
+    if (requestMultiThreadG != NULL) {
+        apr_thread_mutex_lock(requestMultiMutexG);
+        requestMultiStopG = 1;
+        apr_thread_cond_broadcast(requestMultiCondG);
+        apr_thread_mutex_unlock(requestMultiMutexG);
+        aos_request_multi_wakeup();
+        apr_thread_join(&rv, requestMultiThreadG);
+        requestMultiThreadG = NULL;
+        curl_multi_cleanup(requestMultiG);
+        requestMultiG = NULL;
+    }
+
     apr_thread_mutex_destroy(requestStackMutexG);
 
     while (requestStackCountG--) {
         curl_easy_cleanup(requestStackG[requestStackCountG]);
     }
 
+    // the handles using the share are gone, the mutexes go with the pool
+    if (requestShareG != NULL) {
+        curl_share_cleanup(requestShareG);
+        requestShareG = NULL;
+    }
+
+    aos_buf_pool_deinit();
+
     if (aos_stderr_file != NULL) {
         apr_file_close(aos_stderr_file);
         aos_stderr_file = NULL;
@@ -331,3 +421,231 @@ int aos_http_send_request(aos_http_controller_t *ctl, aos_http_request_t *req, a
     return aos_http_transport_perform(t);
 }
 
+
+static int aos_request_share_create()
+{
+    int i;
+    int s;
+    char buf[256];
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        if ((s = apr_thread_mutex_create(&requestShareMutexG[i], APR_THREAD_MUTEX_DEFAULT, aos_global_pool)) != APR_SUCCESS) {
+            aos_error_log("apr_thread_mutex_create failure, code:%d %s.\n", s, apr_strerror(s, buf, sizeof(buf)));
+            return AOSE_INTERNAL_ERROR;
+        }
+    }
+
+    // without a share every handle resolves and handshakes on its own, which
+    // still works
+    requestShareG = curl_share_init();
+    if (requestShareG == NULL) {
+        aos_warn_log("curl_share_init failure, handles don't share dns and connections.\n");
+        return AOSE_OK;
+    }
+
+    curl_share_setopt(requestShareG, CURLSHOPT_LOCKFUNC, aos_request_share_lock);
+    curl_share_setopt(requestShareG, CURLSHOPT_UNLOCKFUNC, aos_request_share_unlock);
+    curl_share_setopt(requestShareG, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(requestShareG, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    // connection cache sharing came with 7.57.0
+    curl_share_setopt(requestShareG, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+    return AOSE_OK;
+}
+
+static void aos_request_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    if (data < CURL_LOCK_DATA_LAST) {
+        apr_thread_mutex_lock(requestShareMutexG[data]);
+    }
+}
+
+static void aos_request_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    if (data < CURL_LOCK_DATA_LAST) {
+        apr_thread_mutex_unlock(requestShareMutexG[data]);
+    }
+}
+
+/*
+ * Run the transfer of t through the multi handle and wait for it. Returns
+ * an error without running it when the multi handle can't be had, the
+ * caller then runs it on its own.
+ */
+int aos_request_multi_perform(aos_curl_http_transport_t *t, CURLcode *code)
+{
+    if (requestMultiMutexG == NULL) {
+        return AOSE_INTERNAL_ERROR;
+    }
+
+    apr_thread_mutex_lock(requestMultiMutexG);
+    if (requestMultiThreadG == NULL && !requestMultiFailedG) {
+        if (aos_request_multi_start() != AOSE_OK) {
+            requestMultiFailedG = 1;
+        }
+    }
+    if (requestMultiFailedG || requestMultiStopG) {
+        apr_thread_mutex_unlock(requestMultiMutexG);
+        return AOSE_INTERNAL_ERROR;
+    }
+
+    t->multi_done = 0;
+    t->multi_next = requestMultiPendingG;
+    requestMultiPendingG = t;
+    apr_thread_mutex_unlock(requestMultiMutexG);
+
+    aos_request_multi_wakeup();
+
+    apr_thread_mutex_lock(requestMultiMutexG);
+    while (!t->multi_done) {
+        // a transfer not taken yet fails here, one the multi handle has is
+        // failed by its thread on the way out
+        if (requestMultiStopG && aos_request_multi_unlink(&requestMultiPendingG, t)) {
+            t->multi_code = CURLE_FAILED_INIT;
+            t->multi_done = 1;
+            break;
+        }
+        apr_thread_cond_wait(requestMultiCondG, requestMultiMutexG);
+    }
+    *code = t->multi_code;
+    apr_thread_mutex_unlock(requestMultiMutexG);
+
+    return AOSE_OK;
+}
+
+// the mutex is held
+static int aos_request_multi_start()
+{
+    apr_status_t s;
+    char buf[256];
+
+    requestMultiG = curl_multi_init();
+    if (requestMultiG == NULL) {
+        aos_warn_log("curl_multi_init failure, http2 requests run one per connection.\n");
+        return AOSE_INTERNAL_ERROR;
+    }
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_multi_setopt(requestMultiG, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+    if ((s = apr_thread_create(&requestMultiThreadG, NULL, aos_request_multi_main, NULL, aos_global_pool)) != APR_SUCCESS) {
+        aos_warn_log("apr_thread_create failure, code:%d %s.\n", s, apr_strerror(s, buf, sizeof(buf)));
+        curl_multi_cleanup(requestMultiG);
+        requestMultiG = NULL;
+        requestMultiThreadG = NULL;
+        return AOSE_INTERNAL_ERROR;
+    }
+
+    return AOSE_OK;
+}
+
+static void *APR_THREAD_FUNC aos_request_multi_main(apr_thread_t *thread, void *data)
+{
+    aos_curl_http_transport_t *t;
+    CURLMsg *msg;
+    CURLcode result;
+    int running = 0;
+    int left;
+
+    for (;;) {
+        apr_thread_mutex_lock(requestMultiMutexG);
+        if (requestMultiStopG) {
+            aos_request_multi_fail_all();
+            apr_thread_mutex_unlock(requestMultiMutexG);
+            break;
+        }
+        while (requestMultiPendingG != NULL) {
+            t = requestMultiPendingG;
+            requestMultiPendingG = t->multi_next;
+            if (curl_multi_add_handle(requestMultiG, t->curl) != CURLM_OK) {
+                t->multi_code = CURLE_FAILED_INIT;
+                t->multi_done = 1;
+                apr_thread_cond_broadcast(requestMultiCondG);
+            } else {
+                t->multi_next = requestMultiActiveG;
+                requestMultiActiveG = t;
+            }
+        }
+        apr_thread_mutex_unlock(requestMultiMutexG);
+
+        curl_multi_perform(requestMultiG, &running);
+
+        while ((msg = curl_multi_info_read(requestMultiG, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            // msg is gone once the handle is removed
+            result = msg->data.result;
+            t = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+            curl_multi_remove_handle(requestMultiG, msg->easy_handle);
+
+            apr_thread_mutex_lock(requestMultiMutexG);
+            if (t != NULL) {
+                aos_request_multi_unlink(&requestMultiActiveG, t);
+                t->multi_code = result;
+                t->multi_done = 1;
+            }
+            apr_thread_cond_broadcast(requestMultiCondG);
+            apr_thread_mutex_unlock(requestMultiMutexG);
+        }
+
+        // new transfers wake the poll up, without curl_multi_wakeup they
+        // wait for the timeout
+#if LIBCURL_VERSION_NUM >= 0x074400
+        curl_multi_poll(requestMultiG, NULL, 0, 1000, NULL);
+#else
+        curl_multi_wait(requestMultiG, NULL, 0, 10, NULL);
+#endif
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+// the mutex is held, returns 1 when t was on the list
+static int aos_request_multi_unlink(aos_curl_http_transport_t **list, aos_curl_http_transport_t *t)
+{
+    aos_curl_http_transport_t **link;
+
+    for (link = list; *link != NULL; link = &(*link)->multi_next) {
+        if (*link == t) {
+            *link = t->multi_next;
+            t->multi_next = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the mutex is held; on stop no transfer may be left waiting for the thread
+static void aos_request_multi_fail_all()
+{
+    aos_curl_http_transport_t *t;
+
+    while (requestMultiActiveG != NULL) {
+        t = requestMultiActiveG;
+        requestMultiActiveG = t->multi_next;
+        curl_multi_remove_handle(requestMultiG, t->curl);
+        t->multi_code = CURLE_FAILED_INIT;
+        t->multi_done = 1;
+    }
+    while (requestMultiPendingG != NULL) {
+        t = requestMultiPendingG;
+        requestMultiPendingG = t->multi_next;
+        t->multi_code = CURLE_FAILED_INIT;
+        t->multi_done = 1;
+    }
+    apr_thread_cond_broadcast(requestMultiCondG);
+}
+
+static void aos_request_multi_wakeup()
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+    if (requestMultiG != NULL) {
+        curl_multi_wakeup(requestMultiG);
+    }
+#endif
+}
@@ -16,6 +16,7 @@ static APR_INLINE const char *aos_http_controller_get_reason(aos_http_controller
 
 CURL *aos_request_get();
 void request_release(CURL *request);
+int aos_request_multi_perform(aos_curl_http_transport_t *t, CURLcode *code);
 
 int aos_http_io_initialize(const char *user_agent_info, int flag);
 void aos_http_io_deinitialize();
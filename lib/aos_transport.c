@@ -288,6 +288,15 @@ size_t aos_curl_default_read_callback(char *buffer, size_t size, size_t nitems,
     return bytes;
 }
 
+/* the owner of the request set its cancel flag, drop the transfer */
+static int aos_curl_cancel_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                                    curl_off_t ultotal, curl_off_t ulnow)
+{
+    aos_curl_http_transport_t *t = (aos_curl_http_transport_t *)(clientp);
+
+    return *t->controller->cancel != 0;
+}
+
 static int aos_curl_code_to_status(CURLcode code)
 {
     switch (code) {
@@ -302,9 +311,11 @@ static int aos_curl_code_to_status(CURLcode code)
         case CURLE_OPERATION_TIMEDOUT:
             return AOSE_CONNECTION_FAILED;
         case CURLE_PARTIAL_FILE:
-            return AOSE_OK;
+            return AOSE_CONNECTION_FAILED;
         case CURLE_SSL_CACERT:
             return AOSE_FAILED_VERIFICATION;
+        case CURLE_ABORTED_BY_CALLBACK:
+            return AOSE_ABORT_CALLBACK;
         default:
             return AOSE_INTERNAL_ERROR;
     }
@@ -345,7 +356,13 @@ int aos_curl_transport_setup(aos_curl_http_transport_t *t)
 
     curl_easy_setopt_safe(CURLOPT_FILETIME, 1);
     curl_easy_setopt_safe(CURLOPT_NOSIGNAL, 1);
-    curl_easy_setopt_safe(CURLOPT_NOPROGRESS, 1);
+    if (t->controller->cancel != NULL) {
+        curl_easy_setopt_safe(CURLOPT_XFERINFOFUNCTION, aos_curl_cancel_callback);
+        curl_easy_setopt_safe(CURLOPT_XFERINFODATA, t);
+        curl_easy_setopt_safe(CURLOPT_NOPROGRESS, 0);
+    } else {
+        curl_easy_setopt_safe(CURLOPT_NOPROGRESS, 1);
+    }
     curl_easy_setopt_safe(CURLOPT_TCP_NODELAY, 1);
     curl_easy_setopt_safe(CURLOPT_NETRC, CURL_NETRC_IGNORED);
 
@@ -359,10 +376,35 @@ int aos_curl_transport_setup(aos_curl_http_transport_t *t)
     curl_easy_setopt_safe(CURLOPT_LOW_SPEED_LIMIT, t->controller->options->speed_limit);
     curl_easy_setopt_safe(CURLOPT_LOW_SPEED_TIME, t->controller->options->speed_time);
 
+    // HTTP/2 where the server speaks it, waiting for a connection which
+    // may take the request as another stream rather than opening one
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    if (t->controller->http2) {
+        curl_easy_setopt_safe(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
+        curl_easy_setopt_safe(CURLOPT_PIPEWAIT, 1L);
+    }
+#endif
+
+    // connect to the address picked by the caller instead of the first one
+    // the name resolves to, keeping the name for the Host header and TLS
+#if LIBCURL_VERSION_NUM >= 0x073100
+    if (t->controller->connect_to != NULL) {
+        union aos_func_u func;
+
+        t->connect_to = curl_slist_append(NULL, t->controller->connect_to);
+        func.func1 = (aos_func1_pt)curl_slist_free_all;
+        aos_fstack_push(t->cleanup, t->connect_to, func, 1);
+        curl_easy_setopt_safe(CURLOPT_CONNECT_TO, t->connect_to);
+    }
+#endif
+
     aos_init_curl_headers(t);
     curl_easy_setopt_safe(CURLOPT_HTTPHEADER, t->headers);
 
-    if (NULL == t->req->signed_url) {
+    if (NULL != t->req->url) {
+        t->url = t->req->url;
+    }
+    else if (NULL == t->req->signed_url) {
         if (aos_init_curl_url(t) != AOSE_OK) {
             return t->controller->error_code;
         }
@@ -407,7 +449,9 @@ int aos_curl_http_transport_perform(aos_http_transport_t *t_)
     }
 
     t->controller->start_time = apr_time_now();
-    code = curl_easy_perform(t->curl);
+    if (!t->controller->http2 || aos_request_multi_perform(t, &code) != AOSE_OK) {
+        code = curl_easy_perform(t->curl);
+    }
     t->controller->finish_time = apr_time_now();
     aos_move_transport_state(t, TRANS_STATE_DONE);
     
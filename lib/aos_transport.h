@@ -42,6 +42,9 @@ struct aos_http_transport_options_s {
     int64_t start_time;                         \
     int64_t first_byte_time;                    \
     int64_t finish_time;                        \
+    volatile int *cancel;                       \
+    char *connect_to;                           \
+    int http2;                                  \
     uint32_t owner:1;                           \
     void *user_data;
 
@@ -66,10 +69,12 @@ struct aos_http_request_s {
     char *host;
     char *proto;
     char *signed_url;
+    char *url;          // prebuilt from host and uri, or NULL
     
     http_method_e method;
     char *uri;
     char *resource;
+    char *canon_res;    // prebuilt "/" resource, or NULL
     aos_table_t *headers;
     aos_table_t *query_params;
     
@@ -129,9 +134,14 @@ struct aos_curl_http_transport_s {
     CURL *curl;
     char *url;
     struct curl_slist *headers;
+    struct curl_slist *connect_to;
     curl_read_callback header_callback;
     curl_read_callback read_callback;
     curl_write_callback write_callback;
+    // transfer run by the multi handle, under its mutex
+    int multi_done;
+    CURLcode multi_code;
+    struct aos_curl_http_transport_s *multi_next;
 };
 
 AOS_CPP_END
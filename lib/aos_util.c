@@ -1,6 +1,58 @@
 #include "lib/aos_util.h"
 #include "lib/aos_log.h"
 
+// build with AOS_USE_OPENSSL_SHA1 for the sha1 of libcrypto, which takes
+// the SHA extensions of the cpu where there are. It goes through the EVP
+// digest API, SHA1_Init() and the like being deprecated in OpenSSL 3.0
+#ifdef AOS_USE_OPENSSL_SHA1
+#include <pthread.h>
+#include <openssl/evp.h>
+typedef EVP_MD_CTX *aos_sha1_ctx_t;
+#define aos_sha1_init(c)            EVP_DigestInit_ex(*(c), EVP_sha1(), NULL)
+#define aos_sha1_update(c, d, n)    EVP_DigestUpdate(*(c), d, n)
+#define aos_sha1_final(out, c)      EVP_DigestFinal_ex(*(c), out, NULL)
+#define aos_sha1_copy(dst, src)     EVP_MD_CTX_copy_ex(*(dst), *(src))
+#else
+typedef apr_sha1_ctx_t aos_sha1_ctx_t;
+#define aos_sha1_init(c)            (apr_sha1_init(c), 1)
+#define aos_sha1_update(c, d, n)    (apr_sha1_update(c, (const char *)(d), (unsigned int)(n)), 1)
+#define aos_sha1_final(out, c)      (apr_sha1_final(out, c), 1)
+#define aos_sha1_copy(dst, src)     (*(dst) = *(src), 1)
+#endif
+
+// sha1 states after the inner and outer padded key blocks of the last key
+// the thread signed with, a request only hashes its message and the digest
+// in work
+typedef struct {
+    int valid;
+    int key_len;
+    unsigned char key[64];
+    aos_sha1_ctx_t inner;
+    aos_sha1_ctx_t outer;
+    aos_sha1_ctx_t work;
+} aos_hmac_sha1_key_t;
+
+static __thread aos_hmac_sha1_key_t g_s_hmac_key;
+
+#ifdef AOS_USE_OPENSSL_SHA1
+// frees the EVP contexts of g_s_hmac_key when its thread exits
+static pthread_key_t g_s_hmac_key_free;
+static pthread_once_t g_s_hmac_key_once = PTHREAD_ONCE_INIT;
+static int g_s_hmac_key_free_created = 0;
+
+static void aos_hmac_sha1_key_free(void *arg);
+static void aos_hmac_sha1_key_free_create(void);
+#endif
+
+// the Date of the second the thread last asked for
+static __thread apr_time_t g_s_gmt_sec = -1;
+static __thread char g_s_gmt_str[AOS_MAX_GMT_TIME_LEN];
+
+static int aos_hmac_sha1_key_init(aos_hmac_sha1_key_t *k, const unsigned char *key, int key_len);
+static int aos_hmac_sha1_key_alloc(aos_hmac_sha1_key_t *k);
+static void aos_hmac_sha1_once(unsigned char hmac[20], const unsigned char *key, int key_len,
+                               const unsigned char *message, int message_len);
+
 static const char *g_s_wday[] = {
     "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
 };
@@ -56,6 +108,11 @@ int aos_get_gmt_str_time(char datestr[AOS_MAX_GMT_TIME_LEN])
     apr_time_exp_t result;
 
     now = apr_time_now();
+    if (apr_time_sec(now) == g_s_gmt_sec) {
+        memcpy(datestr, g_s_gmt_str, AOS_MAX_GMT_TIME_LEN);
+        return AOSE_OK;
+    }
+
     if ((s = apr_time_exp_gmt(&result, now)) != APR_SUCCESS) {
         aos_error_log("apr_time_exp_gmt fialure, code:%d %s.", s, apr_strerror(s, buf, sizeof(buf)));
         return AOSE_INTERNAL_ERROR;
@@ -64,8 +121,12 @@ int aos_get_gmt_str_time(char datestr[AOS_MAX_GMT_TIME_LEN])
     if ((s = aos_convert_to_gmt_time(datestr, g_s_gmt_format, &result))
         != AOSE_OK) {
         aos_error_log("aos_convert_to_GMT failure, code:%d.", s);
+        return s;
     }
 
+    memcpy(g_s_gmt_str, datestr, AOS_MAX_GMT_TIME_LEN);
+    g_s_gmt_sec = apr_time_sec(now);
+
     return s;
 }
 
@@ -239,15 +300,43 @@ int aos_base64_encode(const unsigned char *in, int inLen, char *out)
 void HMAC_SHA1(unsigned char hmac[20], const unsigned char *key, int key_len,
                const unsigned char *message, int message_len)
 {
-    unsigned char kopad[64], kipad[64];
-    int i;
+    aos_hmac_sha1_key_t *k = &g_s_hmac_key;
     unsigned char digest[APR_SHA1_DIGESTSIZE];
-    apr_sha1_ctx_t context;
     
     if (key_len > 64) {
         key_len = 64;
     }
 
+    if (!k->valid || k->key_len != key_len || memcmp(k->key, key, key_len) != 0) {
+        if (!aos_hmac_sha1_key_init(k, key, key_len)) {
+            aos_hmac_sha1_once(hmac, key, key_len, message, message_len);
+            return;
+        }
+    }
+
+    if (!aos_sha1_copy(&k->work, &k->inner) ||
+        !aos_sha1_update(&k->work, message, message_len) ||
+        !aos_sha1_final(digest, &k->work) ||
+        !aos_sha1_copy(&k->work, &k->outer) ||
+        !aos_sha1_update(&k->work, digest, 20) ||
+        !aos_sha1_final(hmac, &k->work))
+    {
+        aos_error_log("sha1 of the request signature failed, signing without the cached key");
+        k->valid = 0;
+        aos_hmac_sha1_once(hmac, key, key_len, message, message_len);
+    }
+}
+
+static int aos_hmac_sha1_key_init(aos_hmac_sha1_key_t *k, const unsigned char *key, int key_len)
+{
+    unsigned char kopad[64], kipad[64];
+    int i;
+
+    k->valid = 0;
+    if (!aos_hmac_sha1_key_alloc(k)) {
+        return 0;
+    }
+
     for (i = 0; i < key_len; i++) {
         kopad[i] = key[i] ^ 0x5c;
         kipad[i] = key[i] ^ 0x36;
@@ -258,14 +347,90 @@ void HMAC_SHA1(unsigned char hmac[20], const unsigned char *key, int key_len,
         kipad[i] = 0 ^ 0x36;
     }
 
+    if (!aos_sha1_init(&k->inner) || !aos_sha1_update(&k->inner, kipad, 64) ||
+        !aos_sha1_init(&k->outer) || !aos_sha1_update(&k->outer, kopad, 64))
+    {
+        return 0;
+    }
+
+    memcpy(k->key, key, key_len);
+    k->key_len = key_len;
+    k->valid = 1;
+
+    return 1;
+}
+
+#ifdef AOS_USE_OPENSSL_SHA1
+static int aos_hmac_sha1_key_alloc(aos_hmac_sha1_key_t *k)
+{
+    if (k->inner != NULL) {
+        return 1;
+    }
+
+    k->inner = EVP_MD_CTX_new();
+    k->outer = EVP_MD_CTX_new();
+    k->work = EVP_MD_CTX_new();
+    if (k->inner == NULL || k->outer == NULL || k->work == NULL) {
+        aos_hmac_sha1_key_free(k);
+        return 0;
+    }
+
+    pthread_once(&g_s_hmac_key_once, aos_hmac_sha1_key_free_create);
+    if (g_s_hmac_key_free_created) {
+        pthread_setspecific(g_s_hmac_key_free, k);
+    }
+
+    return 1;
+}
+
+static void aos_hmac_sha1_key_free(void *arg)
+{
+    aos_hmac_sha1_key_t *k = (aos_hmac_sha1_key_t *)arg;
+
+    EVP_MD_CTX_free(k->inner);
+    EVP_MD_CTX_free(k->outer);
+    EVP_MD_CTX_free(k->work);
+    k->inner = NULL;
+    k->outer = NULL;
+    k->work = NULL;
+    k->valid = 0;
+}
+
+static void aos_hmac_sha1_key_free_create(void)
+{
+    g_s_hmac_key_free_created = (pthread_key_create(&g_s_hmac_key_free, aos_hmac_sha1_key_free) == 0);
+}
+#else
+static int aos_hmac_sha1_key_alloc(aos_hmac_sha1_key_t *k)
+{
+    return 1;
+}
+#endif
+
+// HMAC-SHA-1 with the sha1 of apr and nothing cached, when the cached
+// states can't be used
+static void aos_hmac_sha1_once(unsigned char hmac[20], const unsigned char *key, int key_len,
+                               const unsigned char *message, int message_len)
+{
+    unsigned char kpad[64];
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    apr_sha1_ctx_t context;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        kpad[i] = (i < key_len ? key[i] : 0) ^ 0x36;
+    }
     apr_sha1_init(&context);
-    apr_sha1_update(&context, (const char *)kipad, 64);
+    apr_sha1_update(&context, (const char *)kpad, 64);
     apr_sha1_update(&context, (const char *)message, (unsigned int)message_len);
     apr_sha1_final(digest, &context);
 
+    for (i = 0; i < 64; i++) {
+        kpad[i] = (i < key_len ? key[i] : 0) ^ 0x5c;
+    }
     apr_sha1_init(&context);
-    apr_sha1_update(&context, (const char *)kopad, 64);
-    apr_sha1_update(&context, (const char *)digest, 20);
+    apr_sha1_update(&context, (const char *)kpad, 64);
+    apr_sha1_update(&context, (const char *)digest, APR_SHA1_DIGESTSIZE);
     apr_sha1_final(hmac, &context);
 }
 
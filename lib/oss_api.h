@@ -165,6 +165,23 @@ aos_status_t *oss_get_object_to_buffer(const oss_request_options_t *options,
                                        aos_list_t *buffer, 
                                        aos_table_t **resp_headers);
 
+/*
+ * @brief  get oss object to buffer, the request built from the object template
+ * @param[in]   options             the oss request options
+ * @param[in]   tpl                 the template of the object
+ * @param[in]   headers             the headers for request
+ * @param[in]   params              the params for request
+ * @param[out]  buffer              the buffer containing object content
+ * @param[out]  resp_headers  oss server response headers
+ * @return  aos_status_t, code is 2xx success, other failure
+ */
+aos_status_t *oss_get_object_to_buffer_by_template(const oss_request_options_t *options, 
+                                                   const oss_object_template_t *tpl,
+                                                   aos_table_t *headers, 
+                                                   aos_table_t *params,
+                                                   aos_list_t *buffer, 
+                                                   aos_table_t **resp_headers);
+
 /*
  * @brief  get oss object to file
  * @param[in]   options             the oss request options
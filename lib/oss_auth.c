@@ -35,6 +35,8 @@ static int oss_get_canonicalized_resource(aos_pool_t *p,
         const aos_table_t *params, aos_buf_t *signbuf);
 static int oss_get_canonicalized_params(aos_pool_t *p,
     const aos_table_t *params, aos_buf_t *signbuf);
+static int oss_get_string_to_sign_buf(http_method_e method, const aos_string_t *canon_res,
+    const aos_table_t *headers, const aos_table_t *params, char *buf, int size);
 
 static int is_oss_sub_resource(const char *str)
 {
@@ -282,31 +284,175 @@ int oss_sign_request(aos_http_request_t *req,
                      const oss_config_t *config)
 {
     aos_string_t canon_res;
+    aos_string_t signstr;
     char canon_buf[AOS_MAX_URI_LEN];
     char datestr[AOS_MAX_GMT_TIME_LEN];
+    char signbuf[OSS_SIGN_BUF_LEN];
     const char *value;
     int res = AOSE_OK;
     int len = 0;
     
-    len = strlen(req->resource);
-    if (len >= AOS_MAX_URI_LEN - 1) {
-        aos_error_log("http resource too long, %s.", req->resource);
-        return AOSE_INVALID_ARGUMENT;
-    }
+    if (req->canon_res != NULL) {
+        canon_res.data = req->canon_res;
+        canon_res.len = strlen(req->canon_res);
+    } else {
+        len = strlen(req->resource);
+        if (len >= AOS_MAX_URI_LEN - 1) {
+            aos_error_log("http resource too long, %s.", req->resource);
+            return AOSE_INVALID_ARGUMENT;
+        }
 
-    canon_res.data = canon_buf;
-    canon_res.len = apr_snprintf(canon_buf, sizeof(canon_buf), "/%s", req->resource);
+        canon_res.data = canon_buf;
+        canon_res.len = apr_snprintf(canon_buf, sizeof(canon_buf), "/%s", req->resource);
+    }
 
     if ((value = apr_table_get(req->headers, OSS_CANNONICALIZED_HEADER_DATE)) == NULL) {
         aos_get_gmt_str_time(datestr);
         apr_table_set(req->headers, OSS_DATE, datestr);
     }
 
+    len = oss_get_string_to_sign_buf(req->method, &canon_res, req->headers,
+                                     req->query_params, signbuf, sizeof(signbuf));
+    if (len >= 0) {
+        signstr.data = signbuf;
+        signstr.len = len;
+        oss_sign_headers(req->pool, &signstr, &config->access_key_id,
+                         &config->access_key_secret, req->headers);
+        return AOSE_OK;
+    }
+
     res = oss_get_signed_headers(req->pool, &config->access_key_id, 
                                  &config->access_key_secret, &canon_res, req);
     return res;
 }
 
+/*
+ * oss_get_string_to_sign() into buf, without allocating. Returns the length,
+ * or -1 when the string does not fit or is invalid; the caller then takes
+ * the pool path, which reports the error.
+ */
+static int oss_get_string_to_sign_buf(http_method_e method, 
+                                      const aos_string_t *canon_res,
+                                      const aos_table_t *headers, 
+                                      const aos_table_t *params, 
+                                      char *buf, int size)
+{
+    const char *keys[OSS_SIGN_MAX_SORTED];
+    const aos_array_header_t *tarr;
+    const aos_table_entry_t *telts;
+    const char *value;
+    const char *c;
+    aos_string_t str;
+    int count;
+    int pos;
+    int len = 0;
+    int i;
+    char sep;
+
+#define signbuf_put(DATA, LEN) do {                                     \
+        if (len + (LEN) >= size) {                                      \
+            return -1;                                                  \
+        }                                                               \
+        memcpy(buf + len, DATA, LEN);                                   \
+        len += (LEN);                                                   \
+    } while (0)
+
+#define signbuf_put_from_headers(KEY) do {                              \
+        if ((value = apr_table_get(headers, KEY)) != NULL) {            \
+            signbuf_put(value, (int)strlen(value));                     \
+        }                                                               \
+        signbuf_put("\n", 1);                                           \
+    } while (0)
+
+    value = aos_http_method_to_string(method);
+    signbuf_put(value, (int)strlen(value));
+    signbuf_put("\n", 1);
+
+    signbuf_put_from_headers(OSS_CONTENT_MD5);
+    signbuf_put_from_headers(OSS_CONTENT_TYPE);
+
+    // date
+    if ((value = apr_table_get(headers, OSS_CANNONICALIZED_HEADER_DATE)) == NULL) {
+        value = apr_table_get(headers, OSS_DATE);
+    }
+    if (NULL == value || *value == '\0') {
+        return -1;
+    }
+    signbuf_put(value, (int)strlen(value));
+    signbuf_put("\n", 1);
+
+    // user meta headers, sorted as the pool path does
+    count = 0;
+    if (!apr_is_empty_table(headers)) {
+        tarr = aos_table_elts(headers);
+        telts = (aos_table_entry_t*)tarr->elts;
+        for (pos = 0; pos < tarr->nelts; ++pos) {
+            if (is_oss_canonicalized_header(telts[pos].key)) {
+                if (count == OSS_SIGN_MAX_SORTED) {
+                    return -1;
+                }
+                keys[count++] = telts[pos].key;
+            }
+        }
+        aos_gnome_sort(keys, count);
+    }
+    for (i = 0; i < count; ++i) {
+        value = apr_table_get(headers, keys[i]);
+        aos_str_set(&str, value);
+        aos_strip_space(&str);
+        if ((int)strlen(keys[i]) + 1 + str.len > AOS_MAX_HEADER_LEN) {
+            return -1;
+        }
+        for (c = keys[i]; *c != '\0'; c++) {
+            char lower = tolower((unsigned char)*c);
+            signbuf_put(&lower, 1);
+        }
+        signbuf_put(":", 1);
+        signbuf_put(str.data, str.len);
+        signbuf_put("\n", 1);
+    }
+
+    // canonicalized resource
+    signbuf_put(canon_res->data, canon_res->len);
+
+    count = 0;
+    if (params != NULL && !apr_is_empty_table(params)) {
+        tarr = aos_table_elts(params);
+        telts = (aos_table_entry_t*)tarr->elts;
+        for (pos = 0; pos < tarr->nelts; ++pos) {
+            if (is_oss_sub_resource(telts[pos].key)) {
+                if (count == OSS_SIGN_MAX_SORTED) {
+                    return -1;
+                }
+                keys[count++] = telts[pos].key;
+            }
+        }
+        aos_gnome_sort(keys, count);
+    }
+    sep = '?';
+    for (i = 0; i < count; ++i) {
+        value = apr_table_get(params, keys[i]);
+        if (value != NULL && *value == '\0') {
+            value = NULL;
+        }
+        if (1 + (int)strlen(keys[i]) + (value ? 1 + (int)strlen(value) : 0) >= AOS_MAX_QUERY_ARG_LEN) {
+            return -1;
+        }
+        signbuf_put(&sep, 1);
+        signbuf_put(keys[i], (int)strlen(keys[i]));
+        if (value != NULL) {
+            signbuf_put("=", 1);
+            signbuf_put(value, (int)strlen(value));
+        }
+        sep = '&';
+    }
+
+#undef signbuf_put_from_headers
+#undef signbuf_put
+
+    return len;
+}
+
 int get_oss_request_signature(const oss_request_options_t *options, 
                               aos_http_request_t *req,
                               const aos_string_t *expires, 
@@ -8,6 +8,11 @@
 
 OSS_CPP_START
 
+// a string to sign up to this long, with up to OSS_SIGN_MAX_SORTED meta
+// headers and sub resources, is built on the stack instead of in the pool
+#define OSS_SIGN_BUF_LEN 4096
+#define OSS_SIGN_MAX_SORTED 16
+
 /**
   * @brief  sign oss headers 
 **/
@@ -117,6 +117,30 @@ aos_status_t *oss_get_object_to_buffer(const oss_request_options_t *options,
     return s;
 }
 
+aos_status_t *oss_get_object_to_buffer_by_template(const oss_request_options_t *options, 
+                                                   const oss_object_template_t *tpl,
+                                                   aos_table_t *headers, 
+                                                   aos_table_t *params,
+                                                   aos_list_t *buffer, 
+                                                   aos_table_t **resp_headers)
+{
+    aos_status_t *s = NULL;
+    aos_http_request_t *req = NULL;
+    aos_http_response_t *resp = NULL;
+
+    headers = aos_table_create_if_null(options, headers, 0);
+    params = aos_table_create_if_null(options, params, 0);
+
+    oss_init_object_request_by_template(options, tpl, HTTP_GET, 
+                                        &req, params, headers, &resp);
+
+    s = oss_process_request(options, req, resp);
+    oss_init_read_response_body_to_buffer(buffer, resp);
+    *resp_headers = resp->headers;
+
+    return s;
+}
+
 aos_status_t *oss_get_object_to_file(const oss_request_options_t *options,
                                      const aos_string_t *bucket, 
                                      const aos_string_t *object,
@@ -611,6 +611,87 @@ void oss_init_object_request(const oss_request_options_t *options,
     oss_get_object_uri(options, bucket, object, *req);
 }
 
+int oss_object_template_init(oss_object_template_t *tpl,
+                             const oss_request_options_t *options,
+                             const aos_string_t *bucket,
+                             const aos_string_t *object)
+{
+    aos_http_request_t *req;
+    const char *proto;
+    char uristr[3*AOS_MAX_URI_LEN+1];
+
+    tpl->valid = 0;
+
+    if (options->config->endpoint.len >= AOS_MAX_URI_LEN ||
+        bucket->len + object->len + 2 >= AOS_MAX_URI_LEN) {
+        return AOSE_INVALID_ARGUMENT;
+    }
+
+    req = aos_http_request_create(options->pool);
+    oss_get_object_uri(options, bucket, object, req);
+
+    if (strlen(req->proto) >= sizeof(tpl->proto) ||
+        strlen(req->host) >= AOS_MAX_URI_LEN ||
+        strlen(req->uri) >= AOS_MAX_URI_LEN ||
+        aos_url_encode(uristr, req->uri, AOS_MAX_URI_LEN) != AOSE_OK) {
+        return AOSE_INVALID_ARGUMENT;
+    }
+
+    // the same as aos_init_curl_url() without query string
+    proto = strlen(req->proto) != 0 ? req->proto : AOS_HTTP_PREFIX;
+
+    apr_snprintf(tpl->endpoint, sizeof(tpl->endpoint), "%.*s",
+                 options->config->endpoint.len, options->config->endpoint.data);
+    tpl->is_cname = options->config->is_cname;
+    tpl->bucket_len = bucket->len;
+    apr_snprintf(tpl->proto, sizeof(tpl->proto), "%s", req->proto);
+    apr_snprintf(tpl->host, sizeof(tpl->host), "%s", req->host);
+    apr_snprintf(tpl->uri, sizeof(tpl->uri), "%s", req->uri);
+    apr_snprintf(tpl->resource, sizeof(tpl->resource), "%s", req->resource);
+    apr_snprintf(tpl->canon_res, sizeof(tpl->canon_res), "/%s", req->resource);
+    apr_snprintf(tpl->url, sizeof(tpl->url), "%s%s/%s", proto, req->host, uristr);
+    tpl->valid = 1;
+
+    return AOSE_OK;
+}
+
+int oss_object_template_match(const oss_object_template_t *tpl,
+                              const oss_request_options_t *options,
+                              const aos_string_t *bucket,
+                              const aos_string_t *object)
+{
+    const aos_string_t *endpoint = &options->config->endpoint;
+    const char *name = tpl->resource + tpl->bucket_len + 1;
+
+    return tpl->valid &&
+        tpl->is_cname == options->config->is_cname &&
+        strlen(tpl->endpoint) == (size_t)endpoint->len &&
+        memcmp(tpl->endpoint, endpoint->data, endpoint->len) == 0 &&
+        tpl->bucket_len == bucket->len &&
+        memcmp(tpl->resource, bucket->data, bucket->len) == 0 &&
+        strlen(name) == (size_t)object->len &&
+        memcmp(name, object->data, object->len) == 0;
+}
+
+void oss_init_object_request_by_template(const oss_request_options_t *options,
+        const oss_object_template_t *tpl, http_method_e method,
+        aos_http_request_t **req, aos_table_t *params, aos_table_t *headers,
+        aos_http_response_t **resp)
+{
+    oss_init_request(options, method, req, params, headers, resp);
+
+    (*req)->proto = (char *)tpl->proto;
+    (*req)->host = (char *)tpl->host;
+    (*req)->uri = (char *)tpl->uri;
+    (*req)->resource = (char *)tpl->resource;
+    (*req)->canon_res = (char *)tpl->canon_res;
+
+    // the url of the template has no query string
+    if (aos_is_empty_table(params)) {
+        (*req)->url = (char *)tpl->url;
+    }
+}
+
 void oss_init_live_channel_request(const oss_request_options_t *options, 
                                    const aos_string_t *bucket,
                                    const aos_string_t *live_channel,
@@ -14,6 +14,24 @@ OSS_CPP_START
         }\
     } while(0)
 
+/**
+  * what the requests to one object have in common, built once: the host,
+  * the uri, the resource and its canonical form for the signature, and the
+  * encoded url. Fixed size, so that it can live in thread local storage.
+**/
+typedef struct oss_object_template_s {
+    int valid;
+    int is_cname;
+    int bucket_len;
+    char endpoint[AOS_MAX_URI_LEN];
+    char proto[16];
+    char host[AOS_MAX_URI_LEN];
+    char uri[AOS_MAX_URI_LEN];
+    char resource[AOS_MAX_URI_LEN];
+    char canon_res[AOS_MAX_URI_LEN];
+    char url[4*AOS_MAX_URI_LEN+32];
+} oss_object_template_t;
+
 /**
   * @brief  check hostname ends with specific oss domain suffix.
 **/
@@ -103,6 +121,33 @@ void oss_get_object_uri(const oss_request_options_t *options,
                         const aos_string_t *object,
                         aos_http_request_t *req);
 
+/**
+  * @brief  build the request template of the object
+  * @return AOSE_OK, or AOSE_INVALID_ARGUMENT when the names are too long
+  *         for a template, the requests are then built the usual way
+**/
+int oss_object_template_init(oss_object_template_t *tpl,
+                             const oss_request_options_t *options,
+                             const aos_string_t *bucket,
+                             const aos_string_t *object);
+
+/**
+  * @brief  check the template was built for the object and endpoint
+**/
+int oss_object_template_match(const oss_object_template_t *tpl,
+                              const oss_request_options_t *options,
+                              const aos_string_t *bucket,
+                              const aos_string_t *object);
+
+/**
+  * @brief  init oss object request from the template of the object,
+  *         which must outlive the request
+**/
+void oss_init_object_request_by_template(const oss_request_options_t *options,
+        const oss_object_template_t *tpl, http_method_e method,
+        aos_http_request_t **req, aos_table_t *params, aos_table_t *headers,
+        aos_http_response_t **resp);
+
 /**
   * @brief   bucket uri using third-level domain if hostname is oss domain, otherwise second-level domain
 **/
@@ -0,0 +1,576 @@
+#include "postgres.h"
+
+#include <bzlib.h>
+
+#include "utils/memutils.h"
+
+#include "ossapi.h"
+#include "oss_prefetch.h"
+#include "oss_bz2reader.h"
+
+#define BZ2_MAGIC_MASK		UINT64CONST(0xffffffffffff)
+#define BZ2_BLOCK_MAGIC		UINT64CONST(0x314159265359)
+#define BZ2_EOS_MAGIC		UINT64CONST(0x177245385090)
+
+/* largest block a stream header can announce, 900k */
+#define BZ2_MAX_ORIG_PTR	(9 * 100000)
+
+/* bits read past a magic to tell it from the same bits inside a block */
+#define BZ2_LOOKAHEAD_BITS	128
+
+static size_t Bz2SourceRead(void *selfp, void *buffer, size_t request_len);
+static void Bz2SourceClose(void *selfp);
+static void *oss_bz2_split_main(void *arg);
+static void *oss_bz2_worker_main(void *arg);
+static bool bz2_split_file(oss_bz2reader *bz, char *msg);
+static bool bz2_block_ok(oss_bz2reader *bz, int64 m);
+static bool bz2_eos_ok(oss_bz2reader *bz, int64 m, bool eof);
+static bool bz2_push(oss_bz2reader *bz, int64 start, int64 end, char *msg);
+static bool bz2_decode(oss_bz2_job *job, char *msg);
+static uint32 bz2_get_bits(const unsigned char *buf, int64 pos, int n);
+static void bz2_put_bits(unsigned char *buf, int64 *pos, uint64 value, int n);
+static void bz2_set_error(oss_bz2reader *bz, char *msg);
+
+/*
+ * Read the bzip2 files of the segment with num_parallel_worker threads
+ * decoding their blocks. The current file has been set by the caller.
+ */
+void
+CreateBz2Source(ext_oss_t *self)
+{
+	oss_bz2reader *bz;
+	int64		granted;
+	int			nworkers = self->decode_workers;
+	int			i;
+
+	granted = oss_buffer_grant(self, nworkers * (int64) OSS_BZ2_WORKER_MEM, OSS_BZ2_WORKER_MEM);
+	nworkers = Max(1, Min(nworkers, granted / OSS_BZ2_WORKER_MEM));
+
+	bz = MemoryContextAllocZero(self->ctx, sizeof(oss_bz2reader));
+	bz->myData = self;
+	bz->njobs = 2 * nworkers;
+	bz->jobs = MemoryContextAllocZero(self->ctx, sizeof(oss_bz2_job) * bz->njobs);
+	bz->workers = MemoryContextAllocZero(self->ctx, sizeof(pthread_t) * nworkers);
+
+	/*
+	 * A block with the bits looked at past it, what is read after it, and a
+	 * pad byte for the bit copy.
+	 */
+	bz->buf_size = OSS_BZ2_MAX_BLOCK + BZ2_LOOKAHEAD_BITS / 8 + 8 + OSS_BZ2_READ_SIZE;
+	bz->buf = MemoryContextAllocZero(self->ctx, bz->buf_size + 8);
+
+	pthread_mutex_init(&bz->lock, NULL);
+	pthread_cond_init(&bz->cond, NULL);
+
+	self->com_hd = (void *) bz;
+	self->base.read = (SourceReadProc) Bz2SourceRead;
+	self->base.close = (SourceCloseProc) Bz2SourceClose;
+
+	if (pthread_create(&bz->splitter, NULL, oss_bz2_split_main, bz) != 0)
+		elog(ERROR, "create oss thread use pthread_create oss_bz2_split_main faild");
+
+	for (i = 0; i < nworkers; i++)
+	{
+		if (pthread_create(&bz->workers[i], NULL, oss_bz2_worker_main, bz) != 0)
+			elog(ERROR, "create oss thread use pthread_create oss_bz2_worker_main faild");
+		bz->nworkers++;
+	}
+
+	if (self->segindex == 0)
+	{
+		elog(DEBUG1, "decode bzip2 blocks with %d workers", nworkers);
+	}
+}
+
+static size_t
+Bz2SourceRead(void *selfp, void *buffer, size_t request_len)
+{
+	ext_oss_t  *self = (ext_oss_t *) selfp;
+	oss_bz2reader *bz = (oss_bz2reader *) self->com_hd;
+	oss_bz2_job *job;
+	size_t		n;
+
+	while (bz->cur == NULL)
+	{
+		pthread_mutex_lock(&bz->lock);
+
+		if (bz->error)
+		{
+			pthread_mutex_unlock(&bz->lock);
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("%s", bz->errmsg)));
+		}
+
+		job = &bz->jobs[bz->next_read % bz->njobs];
+		if (bz->next_read < bz->next_split && job->state == OSS_BZ2_DONE)
+		{
+			bz->cur = job;
+		}
+		else if (bz->split_done && bz->next_read == bz->next_split)
+		{
+			pthread_mutex_unlock(&bz->lock);
+			return 0;
+		}
+
+		pthread_mutex_unlock(&bz->lock);
+
+		if (bz->cur == NULL)
+			pg_usleep(SPIN_SLEEP_MSEC * 1000);
+	}
+
+	job = bz->cur;
+	n = Min(request_len, (size_t) (job->out_len - job->pos));
+	memcpy(buffer, job->out + job->pos, n);
+	job->pos += n;
+
+	if (job->pos == job->out_len)
+	{
+		pthread_mutex_lock(&bz->lock);
+		job->state = OSS_BZ2_FREE;
+		bz->next_read++;
+		pthread_cond_broadcast(&bz->cond);
+		pthread_mutex_unlock(&bz->lock);
+		bz->cur = NULL;
+	}
+
+	return n;
+}
+
+static void
+Bz2SourceClose(void *selfp)
+{
+	ext_oss_t  *self = (ext_oss_t *) selfp;
+	oss_bz2reader *bz = (oss_bz2reader *) self->com_hd;
+	int			i;
+
+	if (bz == NULL)
+		return;
+
+	pthread_mutex_lock(&bz->lock);
+	bz->stop = true;
+	pthread_cond_broadcast(&bz->cond);
+	pthread_mutex_unlock(&bz->lock);
+
+	pthread_join(bz->splitter, NULL);
+	for (i = 0; i < bz->nworkers; i++)
+	{
+		pthread_join(bz->workers[i], NULL);
+	}
+
+	oss_prefetch_stop(self);
+
+	elog(DEBUG1, "oss bzip2 reader: " int64_FMT " blocks decoded", bz->blocks);
+
+	for (i = 0; i < bz->njobs; i++)
+	{
+		free(bz->jobs[i].in);
+		free(bz->jobs[i].out);
+	}
+
+	pthread_cond_destroy(&bz->cond);
+	pthread_mutex_destroy(&bz->lock);
+
+	self->com_hd = NULL;
+}
+
+static void *
+oss_bz2_split_main(void *arg)
+{
+	oss_bz2reader *bz = (oss_bz2reader *) arg;
+	ext_oss_t  *myData = bz->myData;
+	char		msg[ERROR_MESSAGE_LEN];
+
+	msg[0] = '\0';
+
+	while (myData->currentfile != NULL && !bz->stop)
+	{
+		/* the work queue could not find the unit it claimed */
+		if (myData->length < 0 && myData->errmsg[0] != '\0')
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN, "%s", myData->errmsg);
+			break;
+		}
+
+		if (!bz2_split_file(bz, msg))
+			break;
+
+		oss_next_file(myData);
+	}
+
+	if (msg[0] != '\0')
+		bz2_set_error(bz, msg);
+
+	pthread_mutex_lock(&bz->lock);
+	bz->split_done = true;
+	pthread_cond_broadcast(&bz->cond);
+	pthread_mutex_unlock(&bz->lock);
+
+	return NULL;
+}
+
+/*
+ * Cut the current file at its block magics. A block runs from its magic to
+ * the next block or end of stream magic; what lies between an end of stream
+ * and the next block, the stream trailer and header, belongs to no block.
+ */
+static bool
+bz2_split_file(oss_bz2reader *bz, char *msg)
+{
+	ext_oss_t  *myData = bz->myData;
+	int64		scan = 0;		/* next bit to look at */
+	int64		start = -1;		/* magic of the open block */
+	uint64		reg = 0;
+	bool		eof = false;
+	bool		first = true;
+
+	bz->buf_len = 0;
+	bz->buf_base = 0;
+
+	for (;;)
+	{
+		int64		limit;
+		int64		keep;
+		size_t		n;
+
+		/* drop what was looked at and is not part of the open block */
+		keep = (start >= 0) ? (start >> 3) : (Max(scan - 64, 0) >> 3);
+		if (keep > 0)
+		{
+			memmove(bz->buf, bz->buf + keep, bz->buf_len - keep);
+			bz->buf_len -= keep;
+			bz->buf_base += keep;
+			scan -= keep * 8;
+			if (start >= 0)
+				start -= keep * 8;
+		}
+
+		/* the block length check below keeps room for a read, never read past it */
+		if (bz->buf_size - bz->buf_len < OSS_BZ2_READ_SIZE)
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN,
+					 "oss_import: no end of bzip2 block found in file \"%s\" after offset " int64_FMT,
+					 myData->currentfile, bz->buf_base);
+			return false;
+		}
+
+		n = SourceRead_internal(myData, bz->buf + bz->buf_len, OSS_BZ2_READ_SIZE, false, true, msg);
+		if (msg[0] != '\0')
+			return false;
+		if (n == 0)
+			eof = true;
+		bz->buf_len += n;
+
+		if (first && bz->buf_len > 0)
+		{
+			if (bz->buf_len < 4 || memcmp(bz->buf, BZ2_MAGIC_BLOCK, 3) != 0)
+			{
+				snprintf(msg, ERROR_MESSAGE_LEN, "oss_import: file \"%s\" is not a bzip2 file",
+						 myData->currentfile);
+				return false;
+			}
+			first = false;
+		}
+
+		limit = eof ? bz->buf_len * 8 : bz->buf_len * 8 - BZ2_LOOKAHEAD_BITS;
+
+		while (scan < limit)
+		{
+			uint64		magic;
+			int64		m;
+
+			reg = (reg << 1) | ((bz->buf[scan >> 3] >> (7 - (scan & 7))) & 1);
+			scan++;
+
+			magic = reg & BZ2_MAGIC_MASK;
+			if (magic != BZ2_BLOCK_MAGIC && magic != BZ2_EOS_MAGIC)
+				continue;
+
+			m = scan - 48;
+			if (m < 0)
+				continue;
+
+			if (magic == BZ2_BLOCK_MAGIC ? !bz2_block_ok(bz, m) : !bz2_eos_ok(bz, m, eof))
+				continue;
+
+			if (start >= 0 && !bz2_push(bz, start, m, msg))
+				return false;
+
+			start = (magic == BZ2_BLOCK_MAGIC) ? m : -1;
+		}
+
+		if (start >= 0 && scan - start > (int64) OSS_BZ2_MAX_BLOCK * 8)
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN,
+					 "oss_import: no end of bzip2 block found in file \"%s\" after offset " int64_FMT,
+					 myData->currentfile, bz->buf_base + (start >> 3));
+			return false;
+		}
+
+		if (eof || bz->stop)
+			break;
+	}
+
+	if (start >= 0 && !bz->stop)
+	{
+		snprintf(msg, ERROR_MESSAGE_LEN, "oss_import: bzip2 file \"%s\" is truncated",
+				 myData->currentfile);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The 48 bits of a magic may well occur inside a block. The header that
+ * follows a true one is a block crc, the randomised bit, an origin pointer
+ * within the largest block and a non empty map of the bytes used.
+ */
+static bool
+bz2_block_ok(oss_bz2reader *bz, int64 m)
+{
+	if (m + 121 > bz->buf_len * 8)
+		return false;
+
+	return bz2_get_bits(bz->buf, m + 81, 24) < BZ2_MAX_ORIG_PTR &&
+		bz2_get_bits(bz->buf, m + 105, 16) != 0;
+}
+
+/*
+ * An end of stream is followed by the stream crc, padding to a byte, and
+ * either the end of the file or the header of the next stream.
+ */
+static bool
+bz2_eos_ok(oss_bz2reader *bz, int64 m, bool eof)
+{
+	int64		next = (m + 80 + 7) >> 3;
+
+	if (eof && next == bz->buf_len)
+		return true;
+
+	return next + 4 <= bz->buf_len &&
+		memcmp(bz->buf + next, BZ2_MAGIC_BLOCK, 3) == 0 &&
+		bz->buf[next + 3] >= '1' && bz->buf[next + 3] <= '9';
+}
+
+/*
+ * Queue the block between bits start and end of the buffer, rewritten as a
+ * stream of its own: a header announcing the largest block size, the block,
+ * and an end of stream whose crc, combining that of a single block, is the
+ * block crc.
+ */
+static bool
+bz2_push(oss_bz2reader *bz, int64 start, int64 end, char *msg)
+{
+	oss_bz2_job *job;
+	int64		nbits = end - start;
+	int64		nbytes = (nbits + 7) >> 3;
+	int64		len = 4 + ((nbits + 80 + 7) >> 3);
+	const unsigned char *src = bz->buf + (start >> 3);
+	int			shift = start & 7;
+	unsigned char *dst;
+	int64		pos;
+	int64		i;
+
+	pthread_mutex_lock(&bz->lock);
+	while (bz->jobs[bz->next_split % bz->njobs].state != OSS_BZ2_FREE && !bz->stop)
+	{
+		pthread_cond_wait(&bz->cond, &bz->lock);
+	}
+	job = &bz->jobs[bz->next_split % bz->njobs];
+	pthread_mutex_unlock(&bz->lock);
+
+	if (bz->stop)
+		return false;
+
+	/* a free job is only touched by this thread */
+	if (job->in_size < len)
+	{
+		char	   *in = realloc(job->in, len);
+
+		if (in == NULL)
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN, "oss read thread out of memory");
+			return false;
+		}
+		job->in = in;
+		job->in_size = len;
+	}
+
+	dst = (unsigned char *) job->in;
+	memset(dst, 0, len);
+	memcpy(dst, BZ2_MAGIC_BLOCK "9", 4);
+
+	for (i = 0; i < nbytes; i++)
+	{
+		if (shift == 0)
+			dst[4 + i] = src[i];
+		else
+			dst[4 + i] = (src[i] << shift) | (src[i + 1] >> (8 - shift));
+	}
+	if (nbits & 7)
+		dst[4 + nbytes - 1] &= 0xff << (8 - (nbits & 7));
+
+	pos = 32 + nbits;
+	bz2_put_bits(dst, &pos, BZ2_EOS_MAGIC, 48);
+	bz2_put_bits(dst, &pos, bz2_get_bits(bz->buf, start + 48, 32), 32);
+
+	job->in_len = len;
+	job->offset = bz->buf_base + (start >> 3);
+	snprintf(job->filename, OSS_MAX_FILE_PATH, "%s", bz->myData->currentfile);
+
+	pthread_mutex_lock(&bz->lock);
+	job->seq = bz->next_split++;
+	job->state = OSS_BZ2_READY;
+	pthread_cond_broadcast(&bz->cond);
+	pthread_mutex_unlock(&bz->lock);
+
+	return true;
+}
+
+static void *
+oss_bz2_worker_main(void *arg)
+{
+	oss_bz2reader *bz = (oss_bz2reader *) arg;
+	char		msg[ERROR_MESSAGE_LEN];
+
+	for (;;)
+	{
+		oss_bz2_job *job;
+
+		pthread_mutex_lock(&bz->lock);
+		while (!bz->stop && !bz->error && !bz->split_done && bz->next_decode == bz->next_split)
+		{
+			pthread_cond_wait(&bz->cond, &bz->lock);
+		}
+
+		if (bz->stop || bz->error || bz->next_decode == bz->next_split)
+		{
+			pthread_mutex_unlock(&bz->lock);
+			break;
+		}
+
+		job = &bz->jobs[bz->next_decode % bz->njobs];
+		bz->next_decode++;
+		job->state = OSS_BZ2_BUSY;
+		pthread_mutex_unlock(&bz->lock);
+
+		msg[0] = '\0';
+		if (!bz2_decode(job, msg))
+		{
+			bz2_set_error(bz, msg);
+			break;
+		}
+
+		pthread_mutex_lock(&bz->lock);
+		job->state = OSS_BZ2_DONE;
+		bz->blocks++;
+		pthread_cond_broadcast(&bz->cond);
+		pthread_mutex_unlock(&bz->lock);
+	}
+
+	return NULL;
+}
+
+static bool
+bz2_decode(oss_bz2_job *job, char *msg)
+{
+	bz_stream	bs;
+	int			ret;
+	bool		ok = false;
+
+	memset(&bs, 0, sizeof(bz_stream));
+	if (BZ2_bzDecompressInit(&bs, 0, 0) != BZ_OK)
+	{
+		snprintf(msg, ERROR_MESSAGE_LEN, "failed to initialize bzip2 decoder for %s", job->filename);
+		return false;
+	}
+
+	bs.next_in = job->in;
+	bs.avail_in = job->in_len;
+	job->out_len = 0;
+	job->pos = 0;
+
+	for (;;)
+	{
+		unsigned int avail;
+
+		if (job->out_size - job->out_len < READ_UNIT_SIZE / 4)
+		{
+			int64		size = Max(job->out_size * 2, READ_UNIT_SIZE);
+			char	   *out = realloc(job->out, size);
+
+			if (out == NULL)
+			{
+				snprintf(msg, ERROR_MESSAGE_LEN, "oss read thread out of memory");
+				goto done;
+			}
+			job->out = out;
+			job->out_size = size;
+		}
+
+		avail = (unsigned int) Min(job->out_size - job->out_len, (int64) 1 << 30);
+		bs.next_out = job->out + job->out_len;
+		bs.avail_out = avail;
+
+		ret = BZ2_bzDecompress(&bs);
+		job->out_len += avail - bs.avail_out;
+
+		if (ret == BZ_STREAM_END)
+			break;
+
+		if (ret != BZ_OK || (bs.avail_in == 0 && bs.avail_out > 0))
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN,
+					 "failed to decompress %s: bad bzip2 block at offset " int64_FMT " (error %d)",
+					 job->filename, job->offset, ret);
+			goto done;
+		}
+	}
+
+	ok = true;
+
+done:
+	BZ2_bzDecompressEnd(&bs);
+
+	return ok;
+}
+
+static uint32
+bz2_get_bits(const unsigned char *buf, int64 pos, int n)
+{
+	uint32		value = 0;
+	int			i;
+
+	for (i = 0; i < n; i++, pos++)
+	{
+		value = (value << 1) | ((buf[pos >> 3] >> (7 - (pos & 7))) & 1);
+	}
+
+	return value;
+}
+
+static void
+bz2_put_bits(unsigned char *buf, int64 *pos, uint64 value, int n)
+{
+	int			i;
+
+	for (i = n - 1; i >= 0; i--, (*pos)++)
+	{
+		if ((value >> i) & 1)
+			buf[*pos >> 3] |= 0x80 >> (*pos & 7);
+	}
+}
+
+static void
+bz2_set_error(oss_bz2reader *bz, char *msg)
+{
+	pthread_mutex_lock(&bz->lock);
+	if (!bz->error && !bz->stop)
+	{
+		snprintf(bz->errmsg, ERROR_MESSAGE_LEN, "%s", msg);
+		bz->error = true;
+	}
+	pthread_cond_broadcast(&bz->cond);
+	pthread_mutex_unlock(&bz->lock);
+}
@@ -0,0 +1,238 @@
+#include "postgres.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "ossapi.h"
+#include "oss_host.h"
+#include "oss_endpoint.h"
+
+/* addresses of one endpoint, as last looked up by the process */
+typedef struct oss_endpoint_addrs
+{
+	char		host[OSS_HOST_ENDPOINT_LEN];	/* empty if free */
+	int			naddrs;
+	char		addrs[OSS_ENDPOINT_MAX_ADDRS][OSS_ENDPOINT_ADDR_LEN];
+	int64		resolved;		/* sec */
+} oss_endpoint_addrs;
+
+bool		oss_endpoint_spread = true;
+
+static pthread_mutex_t oss_endpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static oss_endpoint_addrs oss_endpoint_cache[OSS_ENDPOINT_MAX];
+static uint32 oss_endpoint_next = 0;
+
+static bool oss_endpoint_host_name(const char *endpoint, char *name, int len);
+static int	oss_endpoint_resolve(const char *name, char addrs[][OSS_ENDPOINT_ADDR_LEN]);
+
+/*
+ * The endpoint a scan sends its requests to: the one whose requests from
+ * the segments of the host lately had the shortest time to first byte,
+ * errors counted as a penalty. An endpoint no request went to yet is
+ * tried first, one with its breaker open is passed over, and now and then
+ * a scan takes another one so that an endpoint which got better is noticed.
+ */
+char *
+oss_endpoint_choose(char **hosts, int nhosts)
+{
+	int			best = -1;
+	double		best_score = 0;
+	int			i;
+
+	for (i = 0; i < nhosts; i++)
+	{
+		double		ttfb;
+		double		errors;
+		bool		open;
+		double		score;
+
+		if (!oss_host_endpoint_health(hosts[i], &ttfb, &errors, &open))
+		{
+			elog(DEBUG1, "oss endpoint %s has no requests yet, trying it", hosts[i]);
+			return hosts[i];
+		}
+
+		if (open)
+			continue;
+
+		score = Max(ttfb, OSS_HOST_RTT_FLOOR_USEC) * (1 + OSS_ENDPOINT_ERROR_PENALTY * errors);
+		if (best < 0 || score < best_score)
+		{
+			best = i;
+			best_score = score;
+		}
+	}
+
+	/* every breaker is open, any endpoint is as bad as the next */
+	if (best < 0)
+		return hosts[random() % nhosts];
+
+	if (nhosts > 1 && random() % 100 < OSS_ENDPOINT_EXPLORE_PCT)
+	{
+		i = (best + 1 + random() % (nhosts - 1)) % nhosts;
+		elog(DEBUG1, "oss endpoint %s tried instead of %s", hosts[i], hosts[best]);
+		return hosts[i];
+	}
+
+	return hosts[best];
+}
+
+/*
+ * The CURLOPT_CONNECT_TO of the next request to the endpoint, allocated in
+ * p, or NULL to leave the address to curl. An endpoint resolves to several
+ * addresses of which the resolver hands the same first one to every
+ * segment; taking them in turn spreads the connections of the host over
+ * all of them. The bucket name in front of the endpoint names the same
+ * addresses, so the endpoint is resolved once for all buckets.
+ * Called from any thread, no elog.
+ */
+char *
+oss_endpoint_connect_to(aos_pool_t *p, const char *host)
+{
+	char		name[OSS_HOST_ENDPOINT_LEN];
+	char		addrs[OSS_ENDPOINT_MAX_ADDRS][OSS_ENDPOINT_ADDR_LEN];
+	oss_endpoint_addrs *entry = NULL;
+	oss_endpoint_addrs *oldest = NULL;
+	struct timeval tv;
+	char	   *connect_to = NULL;
+	int			naddrs;
+	int			i;
+
+	if (!oss_endpoint_spread || host == NULL)
+		return NULL;
+
+	if (!oss_endpoint_host_name(host, name, sizeof(name)))
+		return NULL;
+
+	gettimeofday(&tv, NULL);
+
+	pthread_mutex_lock(&oss_endpoint_lock);
+
+	if (oss_endpoint_next == 0)
+		oss_endpoint_next = (uint32) getpid();
+
+	for (i = 0; i < OSS_ENDPOINT_MAX; i++)
+	{
+		oss_endpoint_addrs *e = &oss_endpoint_cache[i];
+
+		if (strcmp(e->host, name) == 0)
+		{
+			entry = e;
+			break;
+		}
+		if (oldest == NULL || e->resolved < oldest->resolved)
+			oldest = e;
+	}
+
+	if (entry == NULL || tv.tv_sec - entry->resolved >= OSS_ENDPOINT_RESOLVE_SEC)
+	{
+		/* the lookup may take a while, the other threads go on meanwhile */
+		pthread_mutex_unlock(&oss_endpoint_lock);
+		naddrs = oss_endpoint_resolve(name, addrs);
+		pthread_mutex_lock(&oss_endpoint_lock);
+
+		if (entry == NULL || strcmp(entry->host, name) != 0)
+			entry = oldest;
+		snprintf(entry->host, OSS_HOST_ENDPOINT_LEN, "%s", name);
+		entry->naddrs = naddrs;
+		memcpy(entry->addrs, addrs, sizeof(addrs));
+		entry->resolved = tv.tv_sec;
+	}
+
+	if (entry->naddrs > 1)
+	{
+		const char *addr = entry->addrs[oss_endpoint_next++ % entry->naddrs];
+
+		/* any host and port, to this address on the same port */
+		if (strchr(addr, ':') != NULL)
+			connect_to = apr_psprintf(p, "::[%s]:", addr);
+		else
+			connect_to = apr_psprintf(p, "::%s:", addr);
+	}
+
+	pthread_mutex_unlock(&oss_endpoint_lock);
+
+	return connect_to;
+}
+
+/*
+ * The name in the endpoint, without the scheme and the port. False when
+ * there is nothing to spread: the endpoint is an address already.
+ */
+static bool
+oss_endpoint_host_name(const char *endpoint, char *name, int len)
+{
+	unsigned char addr[sizeof(struct in6_addr)];
+	char	   *colon;
+
+	if (strncmp(endpoint, AOS_HTTP_PREFIX, strlen(AOS_HTTP_PREFIX)) == 0)
+		endpoint += strlen(AOS_HTTP_PREFIX);
+	else if (strncmp(endpoint, AOS_HTTPS_PREFIX, strlen(AOS_HTTPS_PREFIX)) == 0)
+		endpoint += strlen(AOS_HTTPS_PREFIX);
+
+	if (endpoint[0] == '[' || endpoint[0] == '\0')
+		return false;
+
+	snprintf(name, len, "%s", endpoint);
+	colon = strchr(name, ':');
+	if (colon != NULL)
+		*colon = '\0';
+
+	return inet_pton(AF_INET, name, addr) != 1;
+}
+
+/*
+ * Look the name up, returning how many addresses were found. The
+ * addresses are sorted so that every process takes them in the same order.
+ */
+static int
+oss_endpoint_resolve(const char *name, char addrs[][OSS_ENDPOINT_ADDR_LEN])
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	int			naddrs = 0;
+	int			i;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(name, NULL, &hints, &res) != 0)
+		return 0;
+
+	for (ai = res; ai != NULL && naddrs < OSS_ENDPOINT_MAX_ADDRS; ai = ai->ai_next)
+	{
+		char		addr[OSS_ENDPOINT_ADDR_LEN];
+		const void *src;
+		bool		dup = false;
+
+		if (ai->ai_family == AF_INET)
+			src = &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+		else if (ai->ai_family == AF_INET6)
+			src = &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+		else
+			continue;
+
+		if (inet_ntop(ai->ai_family, src, addr, sizeof(addr)) == NULL)
+			continue;
+
+		for (i = 0; i < naddrs && !dup; i++)
+			dup = (strcmp(addrs[i], addr) == 0);
+		if (dup)
+			continue;
+
+		/* insertion sort, there are a handful */
+		for (i = naddrs; i > 0 && strcmp(addrs[i - 1], addr) > 0; i--)
+			memcpy(addrs[i], addrs[i - 1], OSS_ENDPOINT_ADDR_LEN);
+		memcpy(addrs[i], addr, OSS_ENDPOINT_ADDR_LEN);
+		naddrs++;
+	}
+
+	freeaddrinfo(res);
+
+	return naddrs;
+}
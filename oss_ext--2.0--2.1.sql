@@ -0,0 +1,2 @@
+CREATE OR REPLACE FUNCTION pg_catalog.oss_ext_host_stats(OUT segment_id integer, OUT name text, OUT value bigint)
+RETURNS SETOF record AS '$libdir/oss_ext.so', 'oss_ext_host_stats' LANGUAGE C VOLATILE EXECUTE ON ALL SEGMENTS;
@@ -0,0 +1,14 @@
+
+CREATE OR REPLACE FUNCTION pg_catalog.read_from_oss() RETURNS integer AS '$libdir/oss_ext.so', 'oss_import' LANGUAGE C STABLE;
+CREATE OR REPLACE FUNCTION pg_catalog.write_to_oss()  RETURNS integer AS '$libdir/oss_ext.so', 'oss_export' LANGUAGE C STABLE;
+
+-- declare the protocol name along with in/out funcs
+CREATE TRUSTED PROTOCOL oss (
+    readfunc  = pg_catalog.read_from_oss, 
+    writefunc = pg_catalog.write_to_oss
+);
+
+GRANT ALL ON PROTOCOL oss TO PUBLIC;
+
+CREATE OR REPLACE FUNCTION pg_catalog.oss_ext_host_stats(OUT segment_id integer, OUT name text, OUT value bigint)
+RETURNS SETOF record AS '$libdir/oss_ext.so', 'oss_ext_host_stats' LANGUAGE C VOLATILE EXECUTE ON ALL SEGMENTS;
@@ -18,6 +18,18 @@
 #include "ossapi.h"
 #include "decompress_reader.h"
 #include "compress_writer.h"
+#include "oss_host.h"
+#include "oss_prefetch.h"
+#include "oss_multireader.h"
+#include "oss_workqueue.h"
+#include "oss_gzindex.h"
+#include "oss_bz2reader.h"
+#include "oss_zstd_writer.h"
+#include "oss_range.h"
+#include "oss_hedge.h"
+#include "oss_retry.h"
+#include "oss_rate.h"
+#include "oss_endpoint.h"
 
 #define MAX_DELIMITER_ARRARY_LEN	4
 
@@ -29,12 +41,14 @@ static size_t AsyncSourceRead(void *selfp, void *buffer, size_t request_len);
 static void CreateAsyncOssSource(ext_oss_t * self);
 static void *AsyncOssSourceMain(void *arg);
 static void CreateOssSource(ext_oss_t *self);
+static void CreateDecompressReader(ext_oss_t *self);
 
 static size_t SourceWrite(void *selfp, void *buffer, size_t request_len);
 static void WriteSourceClose(void *selfp);
 static void CreateOssWriteSource(ext_oss_t * self);
 static void flush_and_switch_to_next_file(ext_oss_t  *myData);
 static void flush_ossfile(ext_oss_t  *myData);
+static void flush_big_row(ext_oss_t *myData, char *data, size_t len);
 static bool is_oss_protocol(char *protocol);
 static char *truncate_options(const char *url_with_options);
 static bool oss_isblank(const char c);
@@ -42,6 +56,8 @@ static char *find_delimiter(const char *url_with_options);
 static char *get_opt_oss(const char *url, const char *key);
 static ext_oss_t *parse_oss_protocol(Relation rel, char *url, bool is_export);
 static void free_data(ext_oss_t *myData);
+static void track_data(ext_oss_t *myData);
+static void untrack_data(ext_oss_t *myData);
 static void oss_ext_abort_callback(ResourceReleasePhase phase, bool isCommit, bool isTopLevel, void *arg);
 
 /* Do the module magic dance */
@@ -49,13 +65,72 @@ PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(oss_import);
 PG_FUNCTION_INFO_V1(oss_export);
 PG_FUNCTION_INFO_V1(oss_validate_urls);
+PG_FUNCTION_INFO_V1(oss_ext_host_stats);
 
 Datum		oss_import(PG_FUNCTION_ARGS);
 Datum		oss_export(PG_FUNCTION_ARGS);
 Datum		oss_validate_urls(PG_FUNCTION_ARGS);
+Datum		oss_ext_host_stats(PG_FUNCTION_ARGS);
+
+void		_PG_init(void);
 
 static bool is_oss_ext_callback_registered = false;
-static ext_oss_t	*curr_mydata = NULL;
+/* every open oss table of the backend, freed on abort */
+static List	*curr_mydata_list = NIL;
+
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("oss_ext.host_memory_budget",
+							"Sets the memory in MB the oss buffers of all segments of a host may use.",
+							"Buffers are shrunk when the budget is used up. Zero disables the limit.",
+							&oss_host_memory_budget,
+							OSS_HOST_MEMORY_BUDGET_DEFAULT,
+							0, OSS_HOST_MEMORY_BUDGET_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("oss_ext.host_bandwidth_limit",
+							"Sets the MB/s the oss requests of all segments of a host may transfer.",
+							"Concurrent scans share it evenly when it is used up. Zero disables the limit.",
+							&oss_host_bandwidth_limit,
+							0,
+							0, OSS_HOST_BANDWIDTH_LIMIT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("oss_ext.host_request_limit",
+							"Sets the oss requests per second all segments of a host may send.",
+							"Concurrent scans share it evenly when it is used up. Zero disables the limit.",
+							&oss_host_request_limit,
+							0,
+							0, OSS_HOST_REQUEST_LIMIT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("oss_ext.body_pool_size",
+							"Sets the memory in MB each process keeps for the bodies of its next oss responses.",
+							"Response bodies are read into chunks which are reused by the next requests, "
+							"up to this much of them is kept when no request holds them.",
+							&oss_host_body_pool_size,
+							OSS_HOST_BODY_POOL_DEFAULT,
+							0, OSS_HOST_BODY_POOL_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("oss_ext.spread_addresses",
+							 "Spreads the oss requests over all addresses the endpoint resolves to.",
+							 "Otherwise every request connects to the first address, as the resolver orders them.",
+							 &oss_endpoint_spread,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+}
 
 static void
 oss_ext_abort_callback(ResourceReleasePhase phase, bool isCommit, bool isTopLevel, void *arg)
@@ -65,14 +140,29 @@ oss_ext_abort_callback(ResourceReleasePhase phase, bool isCommit, bool isTopLeve
 	if (phase != RESOURCE_RELEASE_AFTER_LOCKS)
 		return;
 
-	myData = curr_mydata;
-	if (myData)
+	while (curr_mydata_list != NIL)
 	{
+		myData = (ext_oss_t *) linitial(curr_mydata_list);
+		curr_mydata_list = list_delete_first(curr_mydata_list);
 		free_data(myData);
-		curr_mydata = NULL;
 	}
 }
 
+static void
+track_data(ext_oss_t *myData)
+{
+	MemoryContext	old_ctx = MemoryContextSwitchTo(TopMemoryContext);
+
+	curr_mydata_list = lappend(curr_mydata_list, myData);
+	MemoryContextSwitchTo(old_ctx);
+}
+
+static void
+untrack_data(ext_oss_t *myData)
+{
+	curr_mydata_list = list_delete_ptr(curr_mydata_list, myData);
+}
+
 /*
  * Import data into GPDB.
  */
@@ -96,8 +186,8 @@ oss_import(PG_FUNCTION_ARGS)
 	{
 		if (myData)
 		{
+			untrack_data(myData);
 			free_data(myData);
-			curr_mydata = NULL;
 		}
 
 		EXTPROTOCOL_SET_USER_CTX(fcinfo, NULL);
@@ -125,25 +215,39 @@ oss_import(PG_FUNCTION_ARGS)
 		if (is_oss_protocol(myData->protocol) == false)
 			elog(ERROR, "internal error: oss_ext called with a different protocol");
 
-		list_oss_file(myData);
+		track_data(myData);
 
-		oss_next_file(myData);
+		list_oss_file(myData);
 
-		if (myData->currentfile == NULL)
+		/* with parallel_files the workers take the files from the list themselves */
+		if (myData->parallel_files < 2 || !CreateMultiReaderSource(myData))
 		{
-			;
-		}
-		else if (myData->async == true)
-		{
-			CreateAsyncOssSource(myData);
-		}
-		else if (myData->async == false)
-		{
-			CreateOssSource(myData);
+			oss_next_file(myData);
+
+			/* the read thread would clear it */
+			if (myData->errmsg[0] != '\0')
+				elog(ERROR, "%s", myData->errmsg);
+
+			oss_prefetch_start(myData);
+
+			if (myData->currentfile == NULL)
+			{
+				;
+			}
+			else if (myData->file_opt.type == OSS_COMPRESSION_BZIP2)
+			{
+				CreateBz2Source(myData);
+			}
+			else if (myData->async == true)
+			{
+				CreateAsyncOssSource(myData);
+			}
+			else if (myData->async == false)
+			{
+				CreateOssSource(myData);
+			}
 		}
 
-		Assert(curr_mydata == NULL);
-		curr_mydata = myData;
 		EXTPROTOCOL_SET_USER_CTX(fcinfo, myData);
 	}
 
@@ -171,6 +275,57 @@ oss_import(PG_FUNCTION_ARGS)
 	PG_RETURN_INT32((int) nread);
 }
 
+/*
+ * Counters of the host state shared by the segments of this host, one row
+ * per counter.
+ */
+Datum
+oss_ext_host_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	oss_host_stat *stats;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext	oldcontext;
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		oss_host_attach();
+		stats = palloc(sizeof(oss_host_stat) * OSS_HOST_MAX_STATS);
+		funcctx->max_calls = oss_host_get_stats(stats, OSS_HOST_MAX_STATS);
+		funcctx->user_fctx = stats;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	stats = (oss_host_stat *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		oss_host_stat *stat = &stats[funcctx->call_cntr];
+		Datum		values[3];
+		bool		nulls[3] = {false, false, false};
+		HeapTuple	tuple;
+
+		values[0] = Int32GetDatum(GpIdentity.segindex);
+		values[1] = CStringGetTextDatum(stat->name);
+		values[2] = Int64GetDatum(stat->value);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
 Datum
 oss_validate_urls(PG_FUNCTION_ARGS)
 {
@@ -231,6 +386,32 @@ list_oss_file(ext_oss_t * myData)
 		files = list_ossfiles_usesegid(myData);
 	}
 
+	/* the gzip indexes stored next to the files are not data */
+	if (myData->file_opt.type == OSS_COMPRESSION_GZIP)
+	{
+		List	   *datafiles = NIL;
+		int			suffixlen = strlen(OSS_GZINDEX_SUFFIX);
+
+		foreach(lc, files)
+		{
+			oss_file   *ossfile = (oss_file *) lfirst(lc);
+			int			namelen = strlen(ossfile->filename);
+
+			if (namelen > suffixlen &&
+				strcmp(ossfile->filename + namelen - suffixlen, OSS_GZINDEX_SUFFIX) == 0)
+			{
+				freelist = lappend(freelist, ossfile);
+			}
+			else
+			{
+				datafiles = lappend(datafiles, ossfile);
+			}
+		}
+
+		list_free(files);
+		files = datafiles;
+	}
+
 	if (myData->segindex == 0)
 	{
 		int			numfile = list_length(files);
@@ -263,23 +444,32 @@ list_oss_file(ext_oss_t * myData)
 		}
 	}
 
-	foreach(lc, files)
+	if ((myData->work_stealing || myData->gzip_index) && oss_workqueue_start(myData, files))
 	{
-		oss_file   *ossfile = (oss_file *) lfirst(lc);
-
-		if ((count % myData->numsegments) == myData->segindex)
+		/* the work queue keeps its own copy of the files */
+		freelist = list_concat(freelist, files);
+		files = NIL;
+	}
+	else
+	{
+		foreach(lc, files)
 		{
-			if (ossfile->length == 0)
+			oss_file   *ossfile = (oss_file *) lfirst(lc);
+
+			if ((count % myData->numsegments) == myData->segindex)
 			{
-				ossfile->length = oss_get_file_length(&myData->conn, ossfile->filename, myData->ro);
+				if (ossfile->length == 0)
+				{
+					ossfile->length = oss_get_file_length(&myData->conn, ossfile->filename, myData->ro);
+				}
+				myData->filelist = lappend(myData->filelist, ossfile);
 			}
-			myData->filelist = lappend(myData->filelist, ossfile);
-		}
-		else
-		{
-			freelist = lappend(freelist, ossfile);
+			else
+			{
+				freelist = lappend(freelist, ossfile);
+			}
+			count++;
 		}
-		count++;
 	}
 
 	if (freelist)
@@ -361,6 +551,7 @@ AsyncOssSourceMain(void *arg)
 	int			end;
 	int			size;
 	int			len;
+	int			range;
 	char	   *data;
 	int64		offset = 0;
 
@@ -376,16 +567,19 @@ AsyncOssSourceMain(void *arg)
 		size = self->size;
 		data = self->buffer;
 
+		/* the range size is only changed by this thread */
+		range = (int) self->range.size;
+
 		if (begin > end)
 		{
 			len = begin - end;
-			if (len <= READ_UNIT_SIZE)
+			if (len <= range)
 				len = 0;	
 		}
 		else
 		{
 			len = size - end;
-			if (begin == 0 && len <= READ_UNIT_SIZE)
+			if (begin == 0 && len <= range)
 				len = 0;
 		}
 
@@ -400,7 +594,7 @@ AsyncOssSourceMain(void *arg)
 			/* retry */
 		}
 
-		len = Min(len, READ_UNIT_SIZE);
+		len = Min(len, range);
 
 		if (self->file_opt.type == OSS_COMPRESSION_NONE)
 		{
@@ -429,8 +623,15 @@ AsyncOssSourceMain(void *arg)
 			else
 			{
 				offset = self->offset;
-				bytesread = oss_read_buffer(&self->conn, self->currentfile, data + end, offset, len,
-											true, self->errmsg, self->ro);
+				bytesread = oss_prefetch_read(self, data + end, offset, len);
+				if (bytesread == 0)
+				{
+					oss_read_timing timing;
+
+					bytesread = oss_hedge_read(self, data + end, offset, len, &timing);
+					if (bytesread > 0)
+						oss_range_observe(&self->range, bytesread, &timing);
+				}
 				self->offset += bytesread;
 			}
 		}
@@ -472,7 +673,15 @@ CreateAsyncOssSource(ext_oss_t * self)
 	self->base.read = (SourceReadProc) AsyncSourceRead;
 	self->base.close = (SourceCloseProc) AsyncSourceClose;
 
-	self->size = INITIAL_BUF_LEN;
+	/*
+	 * The ring is the read ahead of the scan, sized from the host memory
+	 * budget. It holds at least four of the largest ranges, or the ranges
+	 * are kept to a quarter of what the budget allows.
+	 */
+	self->size = oss_buffer_grant(self, Max(INITIAL_BUF_LEN, 4 * self->range.max_size), MIN_BUF_LEN);
+	self->size -= self->size % READ_UNIT_SIZE;
+	if (self->range.max_size > self->size / 4)
+		oss_range_init(&self->range, Min(self->range.min_size, self->size / 4), self->size / 4);
 	self->begin = 0;
 	self->end = 0;
 	self->buffer = palloc(self->size);
@@ -486,10 +695,11 @@ CreateAsyncOssSource(ext_oss_t * self)
 
 	if (self->file_opt.type == OSS_COMPRESSION_GZIP)
 	{
-		z_decompress_reader *com_hd = NULL;
-		com_hd = init_z_decompress_reader();
-		self->com_hd = (void *)com_hd;
-		z_decompress_reader_open(com_hd, false, NULL);
+		CreateDecompressReader(self);
+	}
+	else
+	{
+		oss_hedge_start(self);
 	}
 
 	pthread_mutex_init(&self->lock, NULL);
@@ -521,6 +731,7 @@ AsyncSourceRead(void *selfp, void *buffer, size_t request_len)
 		newsize = (request_len * 4 - 1) -
 			((request_len * 4 - 1) % READ_UNIT_SIZE) +
 			READ_UNIT_SIZE;
+		oss_buffer_grant(self, newsize - self->size, newsize - self->size);
 		newbuf = palloc(newsize);
 		memset(newbuf, 0, newsize);
 
@@ -617,6 +828,16 @@ AsyncSourceClose(void *selfp)
 		pthread_join(self->th, NULL);
 	}
 
+	oss_prefetch_stop(self);
+	oss_hedge_stop(self);
+
+	if (self->range.samples > 0)
+	{
+		elog(DEBUG1, "oss range size " int64_FMT " after " int64_FMT " reads, first byte %.1f ms, %.1f MB/s",
+			 self->range.size, self->range.samples, self->range.ttfb / 1000.0,
+			 self->range.rate * 1000000.0 / (1024 * 1024));
+	}
+
 	if (self->buffer != NULL)
 		pfree(self->buffer);
 	self->buffer = NULL;
@@ -635,16 +856,29 @@ CreateOssSource(ext_oss_t * self)
 
 	if (self->file_opt.type == OSS_COMPRESSION_GZIP)
 	{
-		z_decompress_reader *com_hd = NULL;
 		self->base.read = (SourceReadProc) z_decompress_read;
-		com_hd = init_z_decompress_reader();
-		self->com_hd = (void *)com_hd;
-		z_decompress_reader_open(com_hd, false, NULL);
+		CreateDecompressReader(self);
 	}
 
 	return;
 }
 
+/*
+ * The inflate buffers are sized from the host memory budget as well.
+ */
+static void
+CreateDecompressReader(ext_oss_t *self)
+{
+	z_decompress_reader *com_hd = NULL;
+	int64		chunksize;
+
+	chunksize = oss_buffer_grant(self, 2 * OSS_ZIP_DECOMPRESS_CHUNKSIZE,
+								2 * OSS_ZIP_MIN_CHUNKSIZE) / 2;
+	com_hd = init_z_decompress_reader(chunksize);
+	self->com_hd = (void *)com_hd;
+	z_decompress_reader_open(self, com_hd, false, NULL);
+}
+
 Datum 
 oss_export(PG_FUNCTION_ARGS)
 {
@@ -665,8 +899,8 @@ oss_export(PG_FUNCTION_ARGS)
 	{
 		if (myData)
 		{
+			untrack_data(myData);
 			free_data(myData);
-			curr_mydata = NULL;
 		}
 
 		EXTPROTOCOL_SET_USER_CTX(fcinfo, NULL);
@@ -695,6 +929,8 @@ oss_export(PG_FUNCTION_ARGS)
 		if (is_oss_protocol(myData->protocol) == false)
 			elog(ERROR, "internal error: oss_ext called with a different protocol");
 
+		track_data(myData);
+
 		if (myData->segindex == 0)
 		{
 			elog(NOTICE, "begin writiing data to oss directory %s, with block size %u MB and oss file size %u MB", 
@@ -705,6 +941,12 @@ oss_export(PG_FUNCTION_ARGS)
 				elog(NOTICE, "writiing ossfile type is gzip compress thread %d compress level %d pipe size %d kB", 
 					myData->write_opt.nthread, myData->write_opt.compression_level, myData->write_opt.pipe_block_size/1024);
 			}
+			else if (myData->file_opt.type == OSS_COMPRESSION_ZSTD)
+			{
+				elog(NOTICE, "writiing ossfile type is zstd compress thread %d compress level %d%s pipe size %d kB",
+					myData->write_opt.nthread, myData->write_opt.compression_level,
+					myData->write_opt.adaptive_level ? " adaptive" : "", myData->write_opt.pipe_block_size/1024);
+			}
 		}
 
 		oss_wirte_next_file(myData);
@@ -719,10 +961,12 @@ oss_export(PG_FUNCTION_ARGS)
 			{
 				init_compress_writer(myData, true);
 			}
+			else if (myData->file_opt.type == OSS_COMPRESSION_ZSTD)
+			{
+				init_zstd_writer(myData);
+			}
 		}
 
-		Assert(curr_mydata == NULL);
-		curr_mydata = myData;
 		EXTPROTOCOL_SET_USER_CTX(fcinfo, myData);
 	}
 
@@ -750,14 +994,9 @@ CreateOssWriteSource(ext_oss_t * self)
 	self->base.write = (SourceWriteProc) SourceWrite;
 	self->base.close = (SourceCloseProc) WriteSourceClose;
 
-	self->size = self->flush_block;
-	self->begin = 0;
-	self->end = 0;
-	self->buffer = palloc(self->size);
-	if (self->buffer == NULL)
-		elog(ERROR, "out of memory while allocating buffer in CreateOssWriteSource");
-
-	memset(self->buffer, 0, self->size);
+	/* a busy host gets smaller, more frequent appends */
+	self->flush_block = oss_buffer_grant(self, self->flush_block, OSS_FLUSH_BUF_MIN_SIZE);
+	oss_write_chain_init(&self->chain, self->flush_block, OSS_WRITE_CHUNK_SIZE, self->ctx);
 
 	return;
 }
@@ -773,27 +1012,22 @@ SourceWrite(void *selfp, void *buffer, size_t request_len)
 		return 0;
 	}
 
-	if (request_len > myData->flush_block)
-	{
-		elog(ERROR, "single row of data is greater than the length of the data cache, please set oss_flush_block_size greater than %zu MB", request_len/WRITE_UNIT_SIZE);
-	}
-
 	myData->write_row_count++;
 	myData->write_byte_count += request_len;
 
-	/* put into local buffer */
-	if ((myData->offset + request_len) <= myData->flush_block)
+	if (request_len > myData->flush_block)
 	{
-		memcpy(myData->buffer + myData->offset, data, request_len);
-		myData->offset += request_len;
+		flush_big_row(myData, data, request_len);
 		return request_len;
 	}
 
-	flush_and_switch_to_next_file(myData);
+	if ((myData->chain.len + request_len) > myData->flush_block)
+	{
+		flush_and_switch_to_next_file(myData);
+	}
 
 	/* put into local buffer */
-	memcpy(myData->buffer, data, request_len);
-	myData->offset += request_len;
+	oss_write_chain_append(&myData->chain, data, request_len);
 
 	return request_len;
 }
@@ -801,7 +1035,7 @@ SourceWrite(void *selfp, void *buffer, size_t request_len)
 static void
 flush_and_switch_to_next_file(ext_oss_t  *myData)
 {
-	if ((myData->file_flush_offset + myData->offset) > myData->file_max_size)
+	if ((myData->file_flush_offset + myData->chain.len) > myData->file_max_size)
 	{
 		oss_wirte_next_file(myData);
 		myData->file_flush_offset = 0;
@@ -810,21 +1044,66 @@ flush_and_switch_to_next_file(ext_oss_t  *myData)
 	flush_ossfile(myData);
 }
 
+/*
+ * A row larger than the flush block is not buffered, it is appended to the
+ * oss file straight from the executor's buffer in flush block sized pieces.
+ * The row is never split across oss files.
+ */
+static void
+flush_big_row(ext_oss_t *myData, char *data, size_t len)
+{
+	TimevalStruct   before, after;
+	double                  elapsed_msec = 0;
+
+	if (myData->chain.len > 0)
+	{
+		flush_and_switch_to_next_file(myData);
+	}
+
+	if (myData->file_flush_offset > 0 && (myData->file_flush_offset + len) > myData->file_max_size)
+	{
+		oss_wirte_next_file(myData);
+		myData->file_flush_offset = 0;
+	}
+
+	elog(DEBUG1, "stream one big row of %zu byte to oss file %s", len, myData->currentfile);
+
+	GETTIMEOFDAY(&before);
+	while (len > 0)
+	{
+		size_t		n = Min(len, (size_t) myData->flush_block);
+
+		oss_append_file_from_buffer(&myData->conn, myData->currentfile, data, n,
+									false, 0, myData->ro, false, NULL);
+		myData->file_flush_offset += n;
+		data += n;
+		len -= n;
+	}
+	GETTIMEOFDAY(&after);
+	DIFF_MSEC(&after, &before, elapsed_msec);
+
+	myData->flush_data_timer += elapsed_msec;
+}
+
 static void
 flush_ossfile(ext_oss_t  *myData)
 {
 	TimevalStruct   before, after;
 	double                  elapsed_msec = 0;
+	struct iovec   *iov = NULL;
+	int				iovcnt;
+
+	iovcnt = oss_write_chain_iov(&myData->chain, &iov);
 
 	GETTIMEOFDAY(&before);
-	oss_append_file_from_buffer(&myData->conn, myData->currentfile, myData->buffer,
-								myData->offset, false, 0, myData->ro, false, NULL);
+	oss_append_file_from_iov(&myData->conn, myData->currentfile, iov, iovcnt,
+								false, 0, myData->ro, false, NULL);
 	GETTIMEOFDAY(&after);
 	DIFF_MSEC(&after, &before, elapsed_msec);
 
-	myData->file_flush_offset += myData->offset;
+	myData->file_flush_offset += myData->chain.len;
 	myData->flush_data_timer += elapsed_msec;
-	myData->offset = 0;
+	oss_write_chain_reset(&myData->chain);
 }
 
 
@@ -833,15 +1112,14 @@ WriteSourceClose(void *selfp)
 {
 	ext_oss_t  *myData = (ext_oss_t *) selfp;
 
-	if (myData->buffer)
+	if (myData->chain.chunks)
 	{
-		if (myData->offset > 0)
+		if (myData->chain.len > 0)
 		{
 			flush_and_switch_to_next_file(myData);
 		}
 
-		pfree(myData->buffer);
-		myData->buffer = NULL;
+		oss_write_chain_free(&myData->chain);
 	}
 
 	elog(DEBUG1, "segment %d wrote row " int64_FMT ", " int64_FMT " byte, write data cost %.3f ms", 
@@ -1026,7 +1304,24 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 	char		*speed_time = NULL;
 	char		*dns_cache_timeout = NULL;
 	char		*connect_timeout = NULL;
+	char		*http2str = NULL;
 	char		*tmp_com_type = NULL;
+	char		*prefetchstr = NULL;
+	char		*parallelstr = NULL;
+	char		*stealstr = NULL;
+	char		*splitstr = NULL;
+	char		*gzindexstr = NULL;
+	char		*workerstr = NULL;
+	char		*rangestr = NULL;
+	char		*hedgestr = NULL;
+	char		*ratestr = NULL;
+	char		*endpointstr = NULL;
+	char	   *endpoints[OSS_ENDPOINT_MAX];
+	int			nendpoints = 0;
+	int			bandwidth_limit = 0;
+	int			request_limit = 0;
+	int			range_min = OSS_RANGE_DEFAULT_MIN;
+	int			range_max = OSS_RANGE_DEFAULT_MAX;
 	MemoryContext	ctx;
 	MemoryContext	old_ctx;
 	ext_oss_t		*oss;
@@ -1071,6 +1366,31 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 	oss->conn.osshost = pstrdup(host + protocol_len + strlen("://"));
 	pfree(host);
 
+	/* other endpoints of the bucket, internal or accelerated, to choose from */
+	endpointstr = get_opt_oss(oss->url, "endpoints");
+	if (endpointstr)
+	{
+		char	   *tok;
+		char	   *save = NULL;
+
+		endpoints[nendpoints++] = oss->conn.osshost;
+		for (tok = strtok_r(endpointstr, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+		{
+			if (*tok == '\0' || strcmp(tok, oss->conn.osshost) == 0)
+				continue;
+			if (nendpoints >= OSS_ENDPOINT_MAX)
+			{
+				elog(ERROR, "endpoints can name at most %d endpoints besides the host",
+							OSS_ENDPOINT_MAX - 1);
+			}
+			endpoints[nendpoints++] = pstrdup(tok);
+		}
+		pfree(endpointstr);
+
+		oss->conn.osshost = oss_endpoint_choose(endpoints, nendpoints);
+		elog(DEBUG1, "oss endpoint %s chosen of %d", oss->conn.osshost, nendpoints);
+	}
+
 	oss->conn.ossid = get_opt_oss(oss->url, "id");
 	oss->conn.osskey = get_opt_oss(oss->url, "key");
 
@@ -1094,6 +1414,14 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 		{
 			oss->file_opt.type = OSS_COMPRESSION_GZIP;
 		}
+		else if (strcasecmp(tmp_com_type, str_oss_compression[OSS_COMPRESSION_BZIP2]) == 0)
+		{
+			oss->file_opt.type = OSS_COMPRESSION_BZIP2;
+		}
+		else if (strcasecmp(tmp_com_type, str_oss_compression[OSS_COMPRESSION_ZSTD]) == 0)
+		{
+			oss->file_opt.type = OSS_COMPRESSION_ZSTD;
+		}
 		else if (strcasecmp(tmp_com_type, str_oss_compression[OSS_COMPRESSION_NONE]) == 0)
 		{
 			oss->file_opt.type = OSS_COMPRESSION_NONE;
@@ -1108,6 +1436,31 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 	}
 
 	oss->conn.bucket = get_opt_oss(oss->url, "bucket");
+	oss->conn.retry = oss_retry_budget_create();
+
+	ratestr = get_opt_oss(oss->url, "bandwidth_limit");
+	if (ratestr)
+	{
+		bandwidth_limit = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(ratestr)));
+		if (bandwidth_limit < 0 || bandwidth_limit > OSS_RATE_BANDWIDTH_MAX)
+		{
+			elog(ERROR, "bandwidth_limit must be greater than or equal to 0 and less than or equal to %d",
+						OSS_RATE_BANDWIDTH_MAX);
+		}
+		pfree(ratestr);
+	}
+	ratestr = get_opt_oss(oss->url, "request_limit");
+	if (ratestr)
+	{
+		request_limit = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(ratestr)));
+		if (request_limit < 0 || request_limit > OSS_RATE_REQUEST_MAX)
+		{
+			elog(ERROR, "request_limit must be greater than or equal to 0 and less than or equal to %d",
+						OSS_RATE_REQUEST_MAX);
+		}
+		pfree(ratestr);
+	}
+	oss->conn.rate = oss_rate_limit_create(bandwidth_limit, request_limit);
 	
 	asyncstr = get_opt_oss(oss->url, "async");
 	if (asyncstr)
@@ -1120,6 +1473,123 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 		oss->async = true;
 	}
 
+	oss->parallel_files = 0;
+	parallelstr = get_opt_oss(oss->url, "parallel_files");
+	if (parallelstr)
+	{
+		oss->parallel_files = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(parallelstr)));
+		if (oss->parallel_files < 0 || oss->parallel_files > OSS_MULTIREADER_MAX_FILES)
+		{
+			elog(ERROR, "parallel_files must be greater than or equal to 0 and less than or equal to %d",
+						OSS_MULTIREADER_MAX_FILES);
+		}
+		pfree(parallelstr);
+	}
+
+	rangestr = get_opt_oss(oss->url, "range_size_min");
+	if (rangestr)
+	{
+		range_min = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(rangestr)));
+		pfree(rangestr);
+	}
+	rangestr = get_opt_oss(oss->url, "range_size_max");
+	if (rangestr)
+	{
+		range_max = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(rangestr)));
+		pfree(rangestr);
+	}
+	if (range_min < 1 || range_max > OSS_RANGE_LIMIT || range_min > range_max)
+	{
+		elog(ERROR, "range_size_min and range_size_max must be between 1 and %d, range_size_min not above range_size_max",
+					OSS_RANGE_LIMIT);
+	}
+	oss_range_init(&oss->range, (int64) range_min * 1024 * 1024, (int64) range_max * 1024 * 1024);
+
+	oss->hedge_budget = OSS_HEDGE_DEFAULT_BUDGET;
+	hedgestr = get_opt_oss(oss->url, "hedge_budget");
+	if (hedgestr)
+	{
+		oss->hedge_budget = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(hedgestr)));
+		if (oss->hedge_budget < 0 || oss->hedge_budget > OSS_HEDGE_MAX_BUDGET)
+		{
+			elog(ERROR, "hedge_budget must be greater than or equal to 0 and less than or equal to %d",
+						OSS_HEDGE_MAX_BUDGET);
+		}
+		pfree(hedgestr);
+	}
+	oss->hedge_percentile = OSS_HEDGE_DEFAULT_PERCENTILE;
+	hedgestr = get_opt_oss(oss->url, "hedge_percentile");
+	if (hedgestr)
+	{
+		oss->hedge_percentile = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(hedgestr)));
+		if (oss->hedge_percentile < OSS_HEDGE_MIN_PERCENTILE || oss->hedge_percentile > OSS_HEDGE_MAX_PERCENTILE)
+		{
+			elog(ERROR, "hedge_percentile must be greater than or equal to %d and less than or equal to %d",
+						OSS_HEDGE_MIN_PERCENTILE, OSS_HEDGE_MAX_PERCENTILE);
+		}
+		pfree(hedgestr);
+	}
+	oss->hedge = NULL;
+
+	oss->prefetch_files = OSS_PREFETCH_DEFAULT_FILES;
+	prefetchstr = get_opt_oss(oss->url, "prefetch_files");
+	if (prefetchstr)
+	{
+		oss->prefetch_files = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(prefetchstr)));
+		if (oss->prefetch_files < 0 || oss->prefetch_files > OSS_PREFETCH_MAX_FILES)
+		{
+			elog(ERROR, "prefetch_files must be greater than or equal to 0 and less than or equal to %d",
+						OSS_PREFETCH_MAX_FILES);
+		}
+		pfree(prefetchstr);
+	}
+
+	oss->work_stealing = false;
+	stealstr = get_opt_oss(oss->url, "work_stealing");
+	if (stealstr)
+	{
+		oss->work_stealing = DatumGetBool(DirectFunctionCall1(boolin, CStringGetDatum(stealstr)));
+		pfree(stealstr);
+	}
+
+	oss->split_size = 0;
+	splitstr = get_opt_oss(oss->url, "split_size");
+	if (splitstr)
+	{
+		oss->split_size = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(splitstr)));
+		if (oss->split_size < 0 || oss->split_size > OSS_WQ_SPLIT_SIZE_MAX)
+		{
+			elog(ERROR, "split_size must be greater than or equal to 0 and less than or equal to %d",
+						OSS_WQ_SPLIT_SIZE_MAX);
+		}
+		pfree(splitstr);
+	}
+
+	oss->relid = (rel != NULL) ? RelationGetRelid(rel) : InvalidOid;
+
+	oss->gzip_index = false;
+	gzindexstr = get_opt_oss(oss->url, "gzip_index");
+	if (gzindexstr)
+	{
+		oss->gzip_index = DatumGetBool(DirectFunctionCall1(boolin, CStringGetDatum(gzindexstr)));
+		pfree(gzindexstr);
+	}
+	oss->gz_end = -1;
+
+	/* num_parallel_worker of a writable table is the pigz threads, see below */
+	oss->decode_workers = OSS_BZ2_DEFAULT_WORKERS;
+	workerstr = is_export ? NULL : get_opt_oss(oss->url, "num_parallel_worker");
+	if (workerstr)
+	{
+		oss->decode_workers = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(workerstr)));
+		if (oss->decode_workers < OSS_BZ2_MIN_WORKERS || oss->decode_workers > OSS_BZ2_MAX_WORKERS)
+		{
+			elog(ERROR, "num_parallel_worker must be greater than or equal to %d and less than or equal to %d",
+						OSS_BZ2_MIN_WORKERS, OSS_BZ2_MAX_WORKERS);
+		}
+		pfree(workerstr);
+	}
+
 	if (oss->file_opt.ossdir == NULL && oss->file_opt.osspath == NULL && oss->file_opt.ossprefix == NULL)
 	{
 		elog(ERROR, "you must specify the parameter dir or filepath or prefix");
@@ -1166,6 +1636,12 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 	oss->write_byte_count = 0;
 	oss->flush_data_timer = 0;
 
+	if (!oss->is_export && oss->file_opt.type == OSS_COMPRESSION_ZSTD)
+	{
+		elog(ERROR, "readable oss table does not support compression type %s",
+					str_oss_compression[OSS_COMPRESSION_ZSTD]);
+	}
+
 	if (oss->is_export)
 	{
 		char	*str_fb = get_opt_oss(oss->url, "oss_flush_block_size");
@@ -1181,6 +1657,12 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 			elog(ERROR, "writeable oss table only supports the export of data in append mode");
 		}
 
+		if (oss->file_opt.type == OSS_COMPRESSION_BZIP2)
+		{
+			elog(ERROR, "writeable oss table does not support compression type %s",
+						str_oss_compression[OSS_COMPRESSION_BZIP2]);
+		}
+
 		if (oss->file_opt.ossdir == NULL && oss->file_opt.ossprefix == NULL)
 		{
 			elog(ERROR, "writeable oss table only supports the export of data to the virtual directory, dir or prefix must be specified");
@@ -1237,9 +1719,10 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 
 		oss->export_relname = pstrdup(relname);
 
-		if (oss->file_opt.type == OSS_COMPRESSION_GZIP)
+		if (oss->file_opt.type == OSS_COMPRESSION_GZIP || oss->file_opt.type == OSS_COMPRESSION_ZSTD)
 		{
 			char	*tmp_str = NULL;
+			bool	zstd = (oss->file_opt.type == OSS_COMPRESSION_ZSTD);
 
 			oss->async = true;
 
@@ -1248,7 +1731,9 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 			oss->write_opt.nthread = OSS_DEFAULT_COMPRESS_THREAD_NUM;
 			oss->write_opt.async = false;
 			oss->write_opt.pipe_block_size = DEFAULT_PIPE_BLOCK_SIZE;
-			oss->write_opt.compression_level = DEFAULT_OSS_COMPRESS_LEVEL;
+			oss->write_opt.compression_level = zstd ? DEFAULT_ZSTD_COMPRESS_LEVEL : DEFAULT_OSS_COMPRESS_LEVEL;
+			oss->write_opt.adaptive_level = false;
+			oss->write_opt.member_size = 0;
 
 			tmp_str = get_opt_oss(oss->url, "num_parallel_worker");
 			if (tmp_str != NULL)
@@ -1275,7 +1760,25 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 			}
 			
 			tmp_str = get_opt_oss(oss->url, "compressionlevel");
-			if (tmp_str != NULL)
+			if (tmp_str != NULL && zstd)
+			{
+				/* adaptive starts from the default level */
+				if (strcasecmp(tmp_str, "adaptive") == 0)
+				{
+					oss->write_opt.adaptive_level = true;
+				}
+				else
+				{
+					oss->write_opt.compression_level = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(tmp_str)));
+					if (oss->write_opt.compression_level > MAX_ZSTD_COMPRESS_LEVEL ||
+						oss->write_opt.compression_level < MIN_ZSTD_COMPRESS_LEVEL)
+					{
+						elog(ERROR, "compression level must be greater than or equal to %d and less than or equal to %d, or adaptive",
+									MIN_ZSTD_COMPRESS_LEVEL, MAX_ZSTD_COMPRESS_LEVEL);
+					}
+				}
+			}
+			else if (tmp_str != NULL)
 			{
 				oss->write_opt.compression_level = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(tmp_str)));
 				if (oss->write_opt.compression_level > MAX_COMPRESS_LEVEL || 
@@ -1285,6 +1788,26 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 								MIN_COMPRESS_LEVEL, MAX_COMPRESS_LEVEL);
 				}
 			}
+
+			tmp_str = get_opt_oss(oss->url, "gzip_member_size");
+			if (tmp_str != NULL && !zstd)
+			{
+				int		member_size = DatumGetInt32(DirectFunctionCall1(int4in, CStringGetDatum(tmp_str)));
+
+				if (member_size < 0 || member_size > MAX_GZIP_MEMBER_SIZE)
+				{
+					elog(ERROR, "gzip_member_size must be greater than or equal to 0 and less than or equal to %d",
+								MAX_GZIP_MEMBER_SIZE);
+				}
+				oss->write_opt.member_size = (int64) member_size * WRITE_UNIT_SIZE;
+
+				/* every member restarts pigz and the writer thread */
+				if (member_size > 0 && oss->write_opt.member_size < oss->flush_block)
+				{
+					elog(ERROR, "gzip_member_size must not be less than the oss_flush_block_size of %u MB",
+								(uint32) (oss->flush_block / WRITE_UNIT_SIZE));
+				}
+			}
 		}
 	}
 
@@ -1321,10 +1844,19 @@ parse_oss_protocol(Relation rel, char *url, bool is_export)
 		pfree(connect_timeout);
 	}
 
+	oss->ro.http2 = false;
+	http2str = get_opt_oss(oss->url, "http2");
+	if (http2str)
+	{
+		oss->ro.http2 = DatumGetBool(DirectFunctionCall1(boolin, CStringGetDatum(http2str)));
+		pfree(http2str);
+	}
+
 	if (oss->segindex == 0)
 	{
-		elog(DEBUG1, "oss request options: speed_limit %d K speed_time %d s dns_cache_timeout %d s connect_timeout %d s",
-			oss->ro.speed_limit, oss->ro.speed_time, oss->ro.dns_cache_timeout, oss->ro.connect_timeout);
+		elog(DEBUG1, "oss request options: speed_limit %d K speed_time %d s dns_cache_timeout %d s connect_timeout %d s http2 %s",
+			oss->ro.speed_limit, oss->ro.speed_time, oss->ro.dns_cache_timeout, oss->ro.connect_timeout,
+			oss->ro.http2 ? "on" : "off");
 	}
 
 	MemoryContextSwitchTo(old_ctx);
@@ -1359,6 +1891,21 @@ free_data(ext_oss_t *myData)
 		myData->filelist = NIL;
 	}
 
+	oss_workqueue_stop(myData);
+
+	if (myData->conn.retry != NULL && myData->conn.retry->retries > 0)
+	{
+		elog(DEBUG1, "oss retries: " int64_FMT " for " int64_FMT " requests, " int64_FMT " refused by the budget",
+			 myData->conn.retry->retries, myData->conn.retry->requests, myData->conn.retry->denied);
+	}
+
+	oss_rate_limit_destroy(myData->conn.rate);
+	myData->conn.rate = NULL;
+
+	oss_buffer_release(myData, myData->mem_granted);
+
+	oss_host_body_pool_report();
+
 	MemoryContextDelete(myData->ctx);
 }
 
@@ -0,0 +1,337 @@
+#include "postgres.h"
+
+#include <zlib.h>
+
+#include "ossapi.h"
+#include "oss_gzindex.h"
+
+#define OSS_GZINDEX_HEADER_LEN	(24 + OSS_GZINDEX_ETAG_LEN)
+#define OSS_GZINDEX_POINT_LEN	32
+
+static oss_gzindex *oss_gzindex_parse(const char *data, int64 len, int64 length, bool *oom);
+
+#define GZIX_PUT(p, v) \
+	do { memcpy((p), &(v), sizeof(v)); (p) += sizeof(v); } while (0)
+#define GZIX_GET(p, v) \
+	do { memcpy(&(v), (p), sizeof(v)); (p) += sizeof(v); } while (0)
+
+oss_gzindex *
+oss_gzindex_create(void)
+{
+	return calloc(1, sizeof(oss_gzindex));
+}
+
+void
+oss_gzindex_free(oss_gzindex *index)
+{
+	int			i;
+
+	if (index == NULL)
+		return;
+
+	for (i = 0; i < index->npoints; i++)
+		free(index->points[i].window);
+	free(index->points);
+	free(index);
+}
+
+/*
+ * Add a checkpoint, dict being the uncompressed data before out the decoder
+ * needs as its window. Called from the read thread, returns false when out
+ * of memory.
+ */
+bool
+oss_gzindex_add(oss_gzindex *index, int64 in, int64 out, int bits, int flags,
+				const unsigned char *dict, int dict_len)
+{
+	oss_gz_point *point;
+
+	if (index->npoints == index->maxpoints)
+	{
+		int			maxpoints = Max(index->maxpoints * 2, 64);
+		oss_gz_point *points;
+
+		points = realloc(index->points, sizeof(oss_gz_point) * maxpoints);
+		if (points == NULL)
+			return false;
+		index->points = points;
+		index->maxpoints = maxpoints;
+	}
+
+	point = &index->points[index->npoints];
+	point->in = in;
+	point->out = out;
+	point->bits = bits;
+	point->flags = flags;
+	point->dict_len = 0;
+	point->window_len = 0;
+	point->window = NULL;
+
+	if (dict_len > 0)
+	{
+		uLongf		window_len = compressBound(dict_len);
+
+		point->window = malloc(window_len);
+		if (point->window == NULL)
+			return false;
+
+		if (compress2(point->window, &window_len, dict, dict_len, Z_BEST_SPEED) != Z_OK)
+		{
+			free(point->window);
+			return false;
+		}
+		point->dict_len = dict_len;
+		point->window_len = window_len;
+	}
+
+	index->npoints++;
+
+	return true;
+}
+
+/*
+ * Inflate the window of point into dict, which holds OSS_GZINDEX_WINDOW
+ * bytes.
+ */
+bool
+oss_gzindex_window(oss_gz_point *point, unsigned char *dict)
+{
+	uLongf		dict_len = OSS_GZINDEX_WINDOW;
+
+	if (point->dict_len == 0)
+		return true;
+
+	return uncompress(dict, &dict_len, point->window, point->window_len) == Z_OK &&
+		dict_len == point->dict_len;
+}
+
+/*
+ * Fetch the index of the gzip object filename of length bytes. Returns NULL
+ * when there is none or when it is of another version of the object, told
+ * by the ETag, the object is then read whole as before. Every segment of
+ * the scan cuts the object by what this returns, so an index which is there but can't be
+ * read is an error rather than no index: the segments which did read it
+ * would cut the object into other units.
+ */
+oss_gzindex *
+oss_gzindex_load(oss_connect *conn, char *filename, int64 length, oss_request_options ro)
+{
+	char		name[OSS_MAX_FILE_PATH];
+	char		msg[ERROR_MESSAGE_LEN];
+	oss_gzindex *index;
+	int64		size;
+	int64		current;
+	char		etag[OSS_GZINDEX_ETAG_LEN];
+	char	   *data;
+	size_t		n;
+	bool		oom;
+
+	snprintf(name, sizeof(name), "%s" OSS_GZINDEX_SUFFIX, filename);
+
+	size = oss_get_file_length(conn, name, ro);
+	if (size <= 0)
+		return NULL;
+
+	if (size > OSS_GZINDEX_MAX_SIZE)
+	{
+		elog(WARNING, "gzip index \"%s\" is too large, ignored", name);
+		return NULL;
+	}
+
+	data = palloc(size);
+	msg[0] = '\0';
+	n = oss_read_object(conn, name, data, size, true, msg, ro);
+	if (msg[0] != '\0')
+		elog(ERROR, "could not read gzip index \"%s\": %s", name, msg);
+	if ((int64) n != size)
+		elog(ERROR, "could not read gzip index \"%s\": read " int64_FMT " of " int64_FMT " bytes",
+			 name, (int64) n, size);
+
+	index = oss_gzindex_parse(data, size, length, &oom);
+	pfree(data);
+
+	if (oom)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory loading gzip index \"%s\"", name)));
+
+	/* written again at the same size by something not knowing of the index */
+	if (index != NULL &&
+		(!oss_get_file_etag(conn, filename, &current, etag, sizeof(etag), false, msg, ro) ||
+		 current != length || etag[0] == '\0' || strcmp(etag, index->etag) != 0))
+	{
+		oss_gzindex_free(index);
+		index = NULL;
+	}
+
+	if (index == NULL)
+		elog(DEBUG1, "gzip index \"%s\" does not match the object, ignored", name);
+	else
+		elog(DEBUG1, "gzip index \"%s\" has %d checkpoints", name, index->npoints);
+
+	return index;
+}
+
+/*
+ * The index in data, NULL if it is malformed or stale; *oom tells the
+ * index could not be allocated.
+ */
+static oss_gzindex *
+oss_gzindex_parse(const char *data, int64 len, int64 length, bool *oom)
+{
+	const char *p = data;
+	const char *end = data + len;
+	oss_gzindex *index;
+	int64		indexed;
+	int32		npoints;
+	int32		etag_len;
+	int			i;
+
+	*oom = false;
+
+	if (len < OSS_GZINDEX_HEADER_LEN || memcmp(p, OSS_GZINDEX_MAGIC, 8) != 0)
+		return NULL;
+	p += 8;
+	GZIX_GET(p, indexed);
+	GZIX_GET(p, npoints);
+	GZIX_GET(p, etag_len);
+
+	if (indexed != length || npoints < 0 || etag_len <= 0 || etag_len >= OSS_GZINDEX_ETAG_LEN)
+		return NULL;
+
+	index = oss_gzindex_create();
+	if (index == NULL)
+	{
+		*oom = true;
+		return NULL;
+	}
+	index->length = length;
+	memcpy(index->etag, p, etag_len);
+	index->etag[etag_len] = '\0';
+	p += OSS_GZINDEX_ETAG_LEN;
+
+	for (i = 0; i < npoints; i++)
+	{
+		oss_gz_point point;
+
+		if (end - p < OSS_GZINDEX_POINT_LEN)
+			goto bad;
+
+		GZIX_GET(p, point.in);
+		GZIX_GET(p, point.out);
+		GZIX_GET(p, point.bits);
+		GZIX_GET(p, point.flags);
+		GZIX_GET(p, point.dict_len);
+		GZIX_GET(p, point.window_len);
+
+		if (point.in < 0 || point.in > length || point.bits < 0 || point.bits > 7 ||
+			point.dict_len < 0 || point.dict_len > OSS_GZINDEX_WINDOW ||
+			point.window_len < 0 || end - p < point.window_len ||
+			(i > 0 && point.out <= index->points[i - 1].out))
+			goto bad;
+
+		if (index->npoints == index->maxpoints)
+		{
+			int			maxpoints = Max(index->maxpoints * 2, 64);
+			oss_gz_point *points = realloc(index->points, sizeof(oss_gz_point) * maxpoints);
+
+			if (points == NULL)
+				goto oom;
+			index->points = points;
+			index->maxpoints = maxpoints;
+		}
+
+		point.window = NULL;
+		if (point.window_len > 0)
+		{
+			point.window = malloc(point.window_len);
+			if (point.window == NULL)
+				goto oom;
+			memcpy(point.window, p, point.window_len);
+			p += point.window_len;
+		}
+
+		index->points[index->npoints++] = point;
+	}
+
+	return index;
+
+oom:
+	*oom = true;
+bad:
+	oss_gzindex_free(index);
+	return NULL;
+}
+
+/*
+ * Store index next to the gzip object filename, with the ETag the object has
+ * now. index->length must still be its length, otherwise it was written
+ * again while it was indexed. Called from the read thread too, errors are
+ * left in msg.
+ */
+bool
+oss_gzindex_save(oss_connect *conn, char *filename, oss_gzindex *index,
+				 oss_request_options ro, char *msg)
+{
+	char		name[OSS_MAX_FILE_PATH];
+	int64		len = OSS_GZINDEX_HEADER_LEN;
+	int32		npoints = index->npoints;
+	int32		etag_len;
+	int64		length;
+	char	   *data;
+	char	   *p;
+	bool		ok;
+	int			i;
+
+	if (!oss_get_file_etag(conn, filename, &length, index->etag, sizeof(index->etag), true, msg, ro))
+		return false;
+	if (length != index->length || index->etag[0] == '\0')
+	{
+		snprintf(msg, ERROR_MESSAGE_LEN, "the object changed while it was indexed");
+		return false;
+	}
+	etag_len = strlen(index->etag);
+
+	for (i = 0; i < index->npoints; i++)
+		len += OSS_GZINDEX_POINT_LEN + index->points[i].window_len;
+
+	data = malloc(len);
+	if (data == NULL)
+	{
+		snprintf(msg, ERROR_MESSAGE_LEN, "out of memory");
+		return false;
+	}
+
+	p = data;
+	memcpy(p, OSS_GZINDEX_MAGIC, 8);
+	p += 8;
+	GZIX_PUT(p, index->length);
+	GZIX_PUT(p, npoints);
+	GZIX_PUT(p, etag_len);
+	memset(p, 0, OSS_GZINDEX_ETAG_LEN);
+	memcpy(p, index->etag, etag_len);
+	p += OSS_GZINDEX_ETAG_LEN;
+
+	for (i = 0; i < index->npoints; i++)
+	{
+		oss_gz_point *point = &index->points[i];
+
+		GZIX_PUT(p, point->in);
+		GZIX_PUT(p, point->out);
+		GZIX_PUT(p, point->bits);
+		GZIX_PUT(p, point->flags);
+		GZIX_PUT(p, point->dict_len);
+		GZIX_PUT(p, point->window_len);
+		if (point->window_len > 0)
+		{
+			memcpy(p, point->window, point->window_len);
+			p += point->window_len;
+		}
+	}
+
+	snprintf(name, sizeof(name), "%s" OSS_GZINDEX_SUFFIX, filename);
+	ok = oss_write_object(conn, name, data, len, true, msg, ro);
+	free(data);
+
+	return ok;
+}
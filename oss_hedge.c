@@ -0,0 +1,298 @@
+#include "postgres.h"
+
+#include <sys/time.h>
+
+#include "utils/memutils.h"
+
+#include "ossapi.h"
+#include "oss_hedge.h"
+
+static void *oss_hedge_main(void *arg);
+static void oss_hedge_sample(oss_hedge *hg, int64 elapsed);
+static int	oss_hedge_cmp(const void *a, const void *b);
+static int64 oss_hedge_now(void);
+
+/*
+ * Start the hedge thread of the read thread. Called from the backend once
+ * the range sizes are settled; the twin gets a buffer of the largest range,
+ * hedging is left off when the host memory budget can't spare it.
+ */
+void
+oss_hedge_start(ext_oss_t *myData)
+{
+	oss_hedge  *hg;
+	int64		granted;
+
+	if (myData->hedge_budget <= 0)
+		return;
+
+	/*
+	 * Over HTTP/2 the twin would be one more stream on the connection of the
+	 * GET it backs up, and be held up by whatever holds that one up.
+	 */
+	if (myData->ro.http2)
+		return;
+
+	granted = oss_buffer_grant(myData, myData->range.max_size, 0);
+	if (granted < myData->range.max_size)
+	{
+		oss_buffer_release(myData, granted);
+		elog(DEBUG1, "no memory left for a second GET, oss range reads are not hedged");
+		return;
+	}
+
+	hg = MemoryContextAllocZero(myData->ctx, sizeof(oss_hedge));
+	hg->conn = myData->conn;
+	hg->ro = myData->ro;
+	hg->budget = myData->hedge_budget;
+	hg->percentile = myData->hedge_percentile;
+	hg->buf_size = granted;
+	hg->buf = MemoryContextAlloc(myData->ctx, hg->buf_size);
+
+	pthread_mutex_init(&hg->lock, NULL);
+	pthread_cond_init(&hg->cond, NULL);
+	if (pthread_create(&hg->th, NULL, oss_hedge_main, hg) != 0)
+	{
+		pthread_cond_destroy(&hg->cond);
+		pthread_mutex_destroy(&hg->lock);
+		pfree(hg->buf);
+		pfree(hg);
+		oss_buffer_release(myData, granted);
+		elog(WARNING, "create oss hedge thread faild, continue without hedging");
+		return;
+	}
+
+	myData->hedge = hg;
+}
+
+static void *
+oss_hedge_main(void *arg)
+{
+	oss_hedge  *hg = (oss_hedge *) arg;
+
+	pthread_mutex_lock(&hg->lock);
+
+	for (;;)
+	{
+		char		filename[OSS_MAX_FILE_PATH];
+		int64		offset;
+		size_t		len;
+		size_t		n;
+
+		while (!hg->pending && !hg->stop)
+			pthread_cond_wait(&hg->cond, &hg->lock);
+		if (hg->stop)
+			break;
+
+		/* give the GET of the read thread its delay */
+		while (hg->pending && !hg->stop)
+		{
+			int64		now = oss_hedge_now();
+			struct timespec ts;
+
+			if (now >= hg->deadline)
+				break;
+
+			ts.tv_sec = hg->deadline / 1000000;
+			ts.tv_nsec = (hg->deadline % 1000000) * 1000;
+			pthread_cond_timedwait(&hg->cond, &hg->lock, &ts);
+		}
+
+		if (hg->stop)
+			break;
+
+		/* the GET came back in time */
+		if (!hg->pending)
+			continue;
+
+		hg->pending = false;
+		hg->hedge_sent = true;
+		hg->hedged++;
+		snprintf(filename, OSS_MAX_FILE_PATH, "%s", hg->filename);
+		offset = hg->offset;
+		len = hg->len;
+		hg->errmsg[0] = '\0';
+
+		pthread_mutex_unlock(&hg->lock);
+
+		n = oss_read_buffer_cancel(&hg->conn, filename, hg->buf, offset, len,
+								   hg->errmsg, hg->ro, &hg->hedge_timing, &hg->cancel_hedge);
+
+		pthread_mutex_lock(&hg->lock);
+
+		hg->hedge_read = (hg->errmsg[0] == '\0') ? n : 0;
+		hg->hedge_done = true;
+		hg->busy = false;
+		if (hg->hedge_read > 0 && !hg->primary_done)
+			hg->cancel_primary = 1;
+		pthread_cond_broadcast(&hg->cond);
+	}
+
+	pthread_mutex_unlock(&hg->lock);
+
+	return NULL;
+}
+
+/*
+ * oss_read_buffer_timed() of the read thread, with a twin sent when the GET
+ * runs past the hedge delay. Errors are left in myData->errmsg, no elog.
+ */
+size_t
+oss_hedge_read(ext_oss_t *myData, void *buffer, int64 offset, size_t len,
+			   oss_read_timing *timing)
+{
+	oss_hedge  *hg = myData->hedge;
+	int64		start;
+	size_t		n;
+
+	if (hg == NULL)
+		return oss_read_buffer_timed(&myData->conn, myData->currentfile, buffer, offset, len,
+									 true, myData->errmsg, myData->ro, timing);
+
+	hg->requests++;
+	start = oss_hedge_now();
+
+	pthread_mutex_lock(&hg->lock);
+	if (hg->nsamples < OSS_HEDGE_MIN_SAMPLES || hg->busy ||
+		len > hg->buf_size || hg->hedged * 100 >= hg->requests * hg->budget)
+	{
+		pthread_mutex_unlock(&hg->lock);
+
+		n = oss_read_buffer_timed(&myData->conn, myData->currentfile, buffer, offset, len,
+								  true, myData->errmsg, myData->ro, timing);
+		if (n > 0)
+			oss_hedge_sample(hg, timing->elapsed);
+		return n;
+	}
+
+	snprintf(hg->filename, OSS_MAX_FILE_PATH, "%s", myData->currentfile);
+	hg->offset = offset;
+	hg->len = len;
+	hg->deadline = start + hg->delay;
+	hg->cancel_primary = 0;
+	hg->cancel_hedge = 0;
+	hg->primary_done = false;
+	hg->hedge_sent = false;
+	hg->hedge_done = false;
+	hg->hedge_read = 0;
+	hg->pending = true;
+	hg->busy = true;
+	pthread_cond_broadcast(&hg->cond);
+	pthread_mutex_unlock(&hg->lock);
+
+	n = oss_read_buffer_cancel(&myData->conn, myData->currentfile, buffer, offset, len,
+							   myData->errmsg, myData->ro, timing, &hg->cancel_primary);
+
+	pthread_mutex_lock(&hg->lock);
+
+	hg->primary_done = true;
+	if (!hg->hedge_sent)
+	{
+		hg->pending = false;
+		hg->busy = false;
+	}
+	if (n > 0 && myData->errmsg[0] == '\0')
+	{
+		/* the twin, if sent, is dropped and finishes on its own */
+		hg->cancel_hedge = 1;
+		pthread_cond_broadcast(&hg->cond);
+		pthread_mutex_unlock(&hg->lock);
+
+		oss_hedge_sample(hg, oss_hedge_now() - start);
+		return n;
+	}
+
+	/* cancelled by the twin, or failed while the twin may still make it */
+	while (hg->hedge_sent && !hg->hedge_done)
+		pthread_cond_wait(&hg->cond, &hg->lock);
+
+	if (hg->hedge_sent && hg->hedge_read > 0)
+	{
+		n = hg->hedge_read;
+		memcpy(buffer, hg->buf, n);
+		*timing = hg->hedge_timing;
+		myData->errmsg[0] = '\0';
+		hg->won++;
+	}
+	pthread_cond_broadcast(&hg->cond);
+	pthread_mutex_unlock(&hg->lock);
+
+	if (n > 0)
+		oss_hedge_sample(hg, oss_hedge_now() - start);
+
+	return n;
+}
+
+/*
+ * Record how long a GET took, as seen by the scan, and move the delay to
+ * the percentile of the recent ones now and then.
+ */
+static void
+oss_hedge_sample(oss_hedge *hg, int64 elapsed)
+{
+	int64		sorted[OSS_HEDGE_SAMPLES];
+	int64		delay;
+
+	hg->samples[hg->next_sample] = elapsed;
+	hg->next_sample = (hg->next_sample + 1) % OSS_HEDGE_SAMPLES;
+	if (hg->nsamples < OSS_HEDGE_SAMPLES)
+		hg->nsamples++;
+
+	if (hg->nsamples < OSS_HEDGE_MIN_SAMPLES ||
+		(++hg->stale < OSS_HEDGE_REFRESH && hg->delay > 0))
+		return;
+
+	memcpy(sorted, hg->samples, sizeof(int64) * hg->nsamples);
+	qsort(sorted, hg->nsamples, sizeof(int64), oss_hedge_cmp);
+	delay = sorted[(hg->nsamples - 1) * hg->percentile / 100];
+
+	hg->delay = Max(delay, OSS_HEDGE_MIN_DELAY);
+	hg->stale = 0;
+}
+
+static int
+oss_hedge_cmp(const void *a, const void *b)
+{
+	int64		x = *(const int64 *) a;
+	int64		y = *(const int64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int64
+oss_hedge_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (int64) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Stop the hedge thread, cancelling a twin still in flight. Called from
+ * the backend after the read thread is joined.
+ */
+void
+oss_hedge_stop(ext_oss_t *myData)
+{
+	oss_hedge  *hg = myData->hedge;
+
+	if (hg == NULL)
+		return;
+
+	pthread_mutex_lock(&hg->lock);
+	hg->stop = true;
+	hg->cancel_hedge = 1;
+	pthread_cond_broadcast(&hg->cond);
+	pthread_mutex_unlock(&hg->lock);
+
+	pthread_join(hg->th, NULL);
+	pthread_cond_destroy(&hg->cond);
+	pthread_mutex_destroy(&hg->lock);
+
+	elog(DEBUG1, "oss hedge: " int64_FMT " of " int64_FMT " GETs sent twice, " int64_FMT " answered by the twin, delay %.1f ms",
+		 hg->hedged, hg->requests, hg->won, hg->delay / 1000.0);
+
+	myData->hedge = NULL;
+}
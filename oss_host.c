@@ -0,0 +1,1238 @@
+#include "postgres.h"
+
+#include "miscadmin.h"
+
+#include "oss_host.h"
+#include "lib/aos_buf.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OSS_HOST_ATTACH_WAIT_MSEC	1000
+#define OSS_HOST_ATTACH_SLEEP_MSEC	10
+
+/* GUC: host memory budget in MB of the import and export buffers */
+int			oss_host_memory_budget = OSS_HOST_MEMORY_BUDGET_DEFAULT;
+
+/* GUCs: host caps of the transfer in MB/s and of the requests per second */
+int			oss_host_bandwidth_limit = 0;
+int			oss_host_request_limit = 0;
+
+/* GUC: memory in MB a process keeps for the next response bodies */
+int			oss_host_body_pool_size = OSS_HOST_BODY_POOL_DEFAULT;
+
+static oss_host_shared *oss_host = NULL;
+static bool oss_host_attach_failed = false;
+static int	oss_host_slot = -1;
+static pid_t oss_host_slot_pid = 0;
+
+static void oss_host_lock(oss_host_shared *host);
+static void oss_host_unlock(oss_host_shared *host);
+static oss_host_client *oss_host_my_client(oss_host_shared *host);
+static void oss_host_reap_clients(oss_host_shared *host);
+static bool oss_host_init_lock(oss_host_shared *host);
+static void oss_host_reap_scans(oss_host_shared *host);
+static bool oss_host_scan_attached(oss_host_scan *scan, int32 segindex);
+static oss_host_endpoint *oss_host_endpoint_get(oss_host_shared *host, const char *endpoint, int64 now);
+static int64 oss_host_now_msec(void);
+static bool oss_host_rate_fair(oss_host_shared *host, oss_host_client *client, int64 now_msec);
+
+/*
+ * Map the host state, creating it when this is the first segment of the host
+ * to get here. Called from the main thread before any worker thread starts.
+ * When the object can't be mapped the extension runs without host state:
+ * every grant is given in full, as before the governor existed.
+ */
+void
+oss_host_attach(void)
+{
+	char		name[MAXPGPATH];
+	oss_host_shared *host;
+	struct stat	st;
+	bool		created = false;
+	int			fd;
+	int			i;
+
+	if (oss_host != NULL || oss_host_attach_failed)
+		return;
+
+	snprintf(name, sizeof(name), OSS_HOST_SHM_NAME, (int) geteuid(), OSS_HOST_SHM_VERSION);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0)
+	{
+		created = true;
+		if (ftruncate(fd, sizeof(oss_host_shared)) != 0)
+		{
+			elog(WARNING, "could not size oss_ext host shared memory \"%s\": %s", name, strerror(errno));
+			close(fd);
+			shm_unlink(name);
+			oss_host_attach_failed = true;
+			return;
+		}
+	}
+	else if (errno == EEXIST)
+	{
+		fd = shm_open(name, O_RDWR, 0600);
+	}
+
+	if (fd < 0)
+	{
+		elog(WARNING, "could not open oss_ext host shared memory \"%s\": %s", name, strerror(errno));
+		oss_host_attach_failed = true;
+		return;
+	}
+
+	/* the creator may still be sizing it */
+	for (i = 0; !created && i < OSS_HOST_ATTACH_WAIT_MSEC / OSS_HOST_ATTACH_SLEEP_MSEC; i++)
+	{
+		if (fstat(fd, &st) == 0 && st.st_size >= sizeof(oss_host_shared))
+			break;
+		pg_usleep(OSS_HOST_ATTACH_SLEEP_MSEC * 1000);
+	}
+
+	host = mmap(NULL, sizeof(oss_host_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (host == MAP_FAILED)
+	{
+		elog(WARNING, "could not map oss_ext host shared memory \"%s\": %s", name, strerror(errno));
+		oss_host_attach_failed = true;
+		return;
+	}
+
+	if (created)
+	{
+		/* ftruncate() zero filled it */
+		if (!oss_host_init_lock(host))
+		{
+			elog(WARNING, "could not initialize oss_ext host shared memory lock");
+			munmap(host, sizeof(oss_host_shared));
+			shm_unlink(name);
+			oss_host_attach_failed = true;
+			return;
+		}
+		__sync_synchronize();
+		host->magic = OSS_HOST_SHM_MAGIC;
+
+		/* left by an earlier build, whose segments keep their mappings */
+		for (i = 1; i < OSS_HOST_SHM_VERSION; i++)
+		{
+			snprintf(name, sizeof(name), OSS_HOST_SHM_NAME, (int) geteuid(), i);
+			shm_unlink(name);
+		}
+	}
+	else
+	{
+		for (i = 0; host->magic != OSS_HOST_SHM_MAGIC && i < OSS_HOST_ATTACH_WAIT_MSEC / OSS_HOST_ATTACH_SLEEP_MSEC; i++)
+			pg_usleep(OSS_HOST_ATTACH_SLEEP_MSEC * 1000);
+
+		if (host->magic != OSS_HOST_SHM_MAGIC)
+		{
+			elog(WARNING, "oss_ext host shared memory \"%s\" is not initialized", name);
+			munmap(host, sizeof(oss_host_shared));
+			oss_host_attach_failed = true;
+			return;
+		}
+	}
+
+	oss_host = host;
+}
+
+static bool
+oss_host_init_lock(oss_host_shared *host)
+{
+	pthread_mutexattr_t	attr;
+	bool		ok;
+
+	if (pthread_mutexattr_init(&attr) != 0)
+		return false;
+
+	ok = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+		pthread_mutex_init(&host->lock, &attr) == 0;
+
+	pthread_mutexattr_destroy(&attr);
+
+	if (ok)
+	{
+		pthread_condattr_t cattr;
+
+		if (pthread_condattr_init(&cattr) != 0)
+			return false;
+
+		ok = pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED) == 0 &&
+			pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) == 0 &&
+			pthread_cond_init(&host->window_cond, &cattr) == 0;
+
+		pthread_condattr_destroy(&cattr);
+	}
+
+	return ok;
+}
+
+/*
+ * A segment killed while holding the lock leaves it to the next locker, the
+ * state it protects is only counters, so it is taken over as it is.
+ */
+static void
+oss_host_lock(oss_host_shared *host)
+{
+	if (pthread_mutex_lock(&host->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&host->lock);
+}
+
+static void
+oss_host_unlock(oss_host_shared *host)
+{
+	pthread_mutex_unlock(&host->lock);
+}
+
+/*
+ * The slot of this backend, allocated on first use. Returns NULL when the
+ * table is full, such a backend is simply not accounted. Lock must be held.
+ */
+static oss_host_client *
+oss_host_my_client(oss_host_shared *host)
+{
+	pid_t		pid = getpid();
+	int			i;
+
+	if (oss_host_slot >= 0 && oss_host_slot_pid == pid &&
+		host->clients[oss_host_slot].pid == pid)
+		return &host->clients[oss_host_slot];
+
+	for (i = 0; i < OSS_HOST_MAX_CLIENTS; i++)
+	{
+		if (host->clients[i].pid == pid)
+			goto found;
+	}
+
+	oss_host_reap_clients(host);
+
+	for (i = 0; i < OSS_HOST_MAX_CLIENTS; i++)
+	{
+		if (host->clients[i].pid == 0)
+		{
+			host->clients[i].pid = pid;
+			host->clients[i].mem_granted = 0;
+			memset(host->clients[i].inflight, 0, sizeof(host->clients[i].inflight));
+			host->clients[i].rate_last = 0;
+			host->clients[i].rate_second = 0;
+			host->nclients++;
+			goto found;
+		}
+	}
+
+	return NULL;
+
+found:
+	oss_host_slot = i;
+	oss_host_slot_pid = pid;
+	return &host->clients[i];
+}
+
+/*
+ * Give back what the backends which died without releasing held, buffers
+ * and request slots.
+ * Lock must be held.
+ */
+static void
+oss_host_reap_clients(oss_host_shared *host)
+{
+	int			i;
+	int			j;
+
+	for (i = 0; i < OSS_HOST_MAX_CLIENTS; i++)
+	{
+		oss_host_client *client = &host->clients[i];
+
+		if (client->pid == 0)
+			continue;
+
+		if (kill(client->pid, 0) != 0 && errno == ESRCH)
+		{
+			for (j = 0; j < OSS_HOST_MAX_ENDPOINTS; j++)
+				host->endpoints[j].inflight -= client->inflight[j];
+			host->mem_granted -= client->mem_granted;
+			client->pid = 0;
+			client->mem_granted = 0;
+			host->nclients--;
+		}
+	}
+}
+
+/*
+ * Ask the host for a buffer budget of want bytes. The grant is limited by
+ * what is left of the host budget and by a fair share of it between the
+ * backends holding grants, but it is never below min: a scan can always make
+ * progress, a host under pressure just runs with smaller buffers.
+ */
+int64
+oss_host_mem_acquire(int64 want, int64 min)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_client *client;
+	int64		budget = (int64) oss_host_memory_budget * 1024 * 1024;
+	int64		grant = want;
+
+	if (min > want)
+		min = want;
+
+	if (host == NULL)
+		return want;
+
+	oss_host_lock(host);
+
+	host->mem_budget = budget;
+
+	client = oss_host_my_client(host);
+	if (client == NULL)
+	{
+		oss_host_unlock(host);
+		return budget > 0 ? min : want;
+	}
+
+	if (budget > 0)
+	{
+		int64		left;
+		int64		share;
+		int			nactive = 0;
+		int			i;
+
+		if (host->mem_granted + want > budget)
+			oss_host_reap_clients(host);
+
+		for (i = 0; i < OSS_HOST_MAX_CLIENTS; i++)
+		{
+			if (host->clients[i].pid != 0 && host->clients[i].mem_granted > 0)
+				nactive++;
+		}
+		if (client->mem_granted == 0)
+			nactive++;
+
+		left = budget - host->mem_granted;
+		share = budget / nactive - client->mem_granted;
+
+		grant = Min(want, Min(left, share));
+		grant = Max(grant, min);
+		if (grant < want)
+			host->mem_reduced++;
+	}
+
+	client->mem_granted += grant;
+	host->mem_granted += grant;
+	if (host->mem_granted > host->mem_granted_peak)
+		host->mem_granted_peak = host->mem_granted;
+
+	oss_host_unlock(host);
+
+	return grant;
+}
+
+void
+oss_host_mem_release(int64 bytes)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_client *client;
+
+	if (host == NULL || bytes <= 0)
+		return;
+
+	oss_host_lock(host);
+
+	client = oss_host_my_client(host);
+	if (client != NULL)
+	{
+		bytes = Min(bytes, client->mem_granted);
+		client->mem_granted -= bytes;
+		host->mem_granted -= bytes;
+	}
+
+	oss_host_unlock(host);
+}
+
+/*
+ * Free the attachments of the backends which died without detaching, a scan
+ * nobody is attached to anymore is dropped. Lock must be held.
+ */
+static void
+oss_host_reap_scans(oss_host_shared *host)
+{
+	int			i;
+	int			j;
+
+	for (i = 0; i < OSS_HOST_MAX_SCANS; i++)
+	{
+		oss_host_scan *scan = &host->scans[i];
+
+		if (!scan->inuse)
+			continue;
+
+		for (j = 0; j < OSS_HOST_SCAN_MAX_SEGMENTS; j++)
+		{
+			if (scan->segments[j] < 0)
+				continue;
+
+			if (kill(scan->pids[j], 0) != 0 && errno == ESRCH)
+			{
+				scan->segments[j] = -1;
+				scan->pids[j] = 0;
+				scan->nattached--;
+			}
+		}
+
+		if (scan->nattached <= 0)
+			scan->inuse = false;
+	}
+}
+
+static bool
+oss_host_scan_attached(oss_host_scan *scan, int32 segindex)
+{
+	int			j;
+
+	for (j = 0; j < OSS_HOST_SCAN_MAX_SEGMENTS; j++)
+	{
+		if (scan->segments[j] == segindex)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Join the scan of key shared by the segments of this host, creating it when
+ * this segment is the first one to get here. Every segment of the scan must
+ * have cut the same nunits units of work. Returns the scan, or -1 when there
+ * is no host state or no room for it, the segment then reads its own units
+ * alone, and nobody takes them from it since it is not attached.
+ */
+int
+oss_host_scan_attach(const oss_host_scan_key *key, int segindex, int nunits)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_scan *scan = NULL;
+	int			found = -1;
+	int			i;
+	int			j;
+
+	if (host == NULL || nunits <= 0 || nunits > OSS_HOST_SCAN_MAX_UNITS)
+		return -1;
+
+	oss_host_lock(host);
+
+	oss_host_reap_scans(host);
+
+	for (i = 0; i < OSS_HOST_MAX_SCANS; i++)
+	{
+		if (host->scans[i].inuse &&
+			memcmp(&host->scans[i].key, key, sizeof(oss_host_scan_key)) == 0)
+		{
+			found = i;
+			break;
+		}
+	}
+
+	if (found < 0)
+	{
+		for (i = 0; i < OSS_HOST_MAX_SCANS; i++)
+		{
+			if (!host->scans[i].inuse)
+			{
+				found = i;
+				scan = &host->scans[i];
+				memset(scan, 0, sizeof(oss_host_scan));
+				scan->inuse = true;
+				scan->key = *key;
+				scan->nunits = nunits;
+				for (j = 0; j < OSS_HOST_SCAN_MAX_SEGMENTS; j++)
+					scan->segments[j] = -1;
+				break;
+			}
+		}
+	}
+
+	if (found >= 0)
+	{
+		scan = &host->scans[found];
+
+		/* a segment listing another set of files must not share the claims */
+		if (scan->nunits != nunits || oss_host_scan_attached(scan, segindex))
+			scan = NULL;
+	}
+
+	if (scan != NULL)
+	{
+		for (j = 0; j < OSS_HOST_SCAN_MAX_SEGMENTS; j++)
+		{
+			if (scan->segments[j] < 0)
+			{
+				scan->segments[j] = segindex;
+				scan->pids[j] = getpid();
+				scan->nattached++;
+				break;
+			}
+		}
+
+		if (j == OSS_HOST_SCAN_MAX_SEGMENTS)
+		{
+			if (scan->nattached == 0)
+				scan->inuse = false;
+			found = -1;
+		}
+	}
+	else
+	{
+		found = -1;
+	}
+
+	oss_host_unlock(host);
+
+	return found;
+}
+
+/*
+ * Claim the next unit of work for segindex, owners[] giving the segment each
+ * unit is statically assigned to. The units of the segment itself go first,
+ * in order; then it steals, from the end, the units of the other segments
+ * attached to the scan. Units of segments which are not attached are never
+ * taken, they may be on another host or read alone. Returns -1 when nothing
+ * is left.
+ */
+int
+oss_host_scan_claim(int scan_id, int segindex, const int32 *owners, int nunits, bool *stolen)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_scan *scan;
+	int			unit = -1;
+	int			i;
+
+	*stolen = false;
+
+	if (host == NULL || scan_id < 0)
+		return -1;
+
+	scan = &host->scans[scan_id];
+
+	oss_host_lock(host);
+
+	if (!scan->inuse || scan->nunits != nunits)
+	{
+		oss_host_unlock(host);
+		return -1;
+	}
+
+	for (i = 0; i < nunits; i++)
+	{
+		if (owners[i] == segindex && (scan->claimed[i / 8] & (1 << (i % 8))) == 0)
+		{
+			unit = i;
+			break;
+		}
+	}
+
+	if (unit < 0)
+	{
+		for (i = nunits - 1; i >= 0; i--)
+		{
+			if ((scan->claimed[i / 8] & (1 << (i % 8))) == 0 &&
+				oss_host_scan_attached(scan, owners[i]))
+			{
+				unit = i;
+				*stolen = true;
+				host->scan_units_stolen++;
+				break;
+			}
+		}
+	}
+
+	if (unit >= 0)
+		scan->claimed[unit / 8] |= (1 << (unit % 8));
+
+	oss_host_unlock(host);
+
+	return unit;
+}
+
+/*
+ * Leave the scan once this segment has nothing more to claim, or when it
+ * stops early. Its unclaimed units can't be stolen anymore after that.
+ */
+void
+oss_host_scan_detach(int scan_id)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_scan *scan;
+	pid_t		pid = getpid();
+	int			j;
+
+	if (host == NULL || scan_id < 0)
+		return;
+
+	scan = &host->scans[scan_id];
+
+	oss_host_lock(host);
+
+	for (j = 0; scan->inuse && j < OSS_HOST_SCAN_MAX_SEGMENTS; j++)
+	{
+		if (scan->segments[j] >= 0 && scan->pids[j] == pid)
+		{
+			scan->segments[j] = -1;
+			scan->pids[j] = 0;
+			scan->nattached--;
+			break;
+		}
+	}
+
+	if (scan->nattached <= 0)
+		scan->inuse = false;
+
+	oss_host_unlock(host);
+}
+
+/*
+ * Snapshot of the host counters for oss_ext_host_stats(). The state is
+ * copied under the lock and formatted after it: an error raised with the
+ * lock held would keep it from every backend of the host until this one
+ * exits.
+ */
+int
+oss_host_get_stats(oss_host_stat *stats, int max)
+{
+	oss_host_shared *host;
+	int			nscans = 0;
+	int			n = 0;
+	int			i;
+
+#define OSS_HOST_STAT(s, v) \
+	do { \
+		if (n < max) \
+		{ \
+			stats[n].name = (s); \
+			stats[n].value = (v); \
+			n++; \
+		} \
+	} while (0)
+
+	if (oss_host == NULL)
+		return 0;
+
+	host = palloc(sizeof(oss_host_shared));
+
+	oss_host_lock(oss_host);
+	memcpy(host, oss_host, sizeof(oss_host_shared));
+	oss_host_unlock(oss_host);
+
+	for (i = 0; i < OSS_HOST_MAX_SCANS; i++)
+	{
+		if (host->scans[i].inuse)
+			nscans++;
+	}
+
+	OSS_HOST_STAT("clients", host->nclients);
+	OSS_HOST_STAT("mem_budget", host->mem_budget);
+	OSS_HOST_STAT("mem_granted", host->mem_granted);
+	OSS_HOST_STAT("mem_granted_peak", host->mem_granted_peak);
+	OSS_HOST_STAT("mem_reduced", host->mem_reduced);
+	OSS_HOST_STAT("scans", nscans);
+	OSS_HOST_STAT("scan_units_stolen", host->scan_units_stolen);
+	OSS_HOST_STAT("retries", host->retries);
+	OSS_HOST_STAT("retries_denied", host->retries_denied);
+	OSS_HOST_STAT("breaker_trips", host->breaker_trips);
+	OSS_HOST_STAT("window_decreases", host->window_decreases);
+	OSS_HOST_STAT("window_waits", host->window_waits);
+	OSS_HOST_STAT("bandwidth_limit", host->bandwidth_limit);
+	OSS_HOST_STAT("request_limit", host->request_limit);
+	OSS_HOST_STAT("rate_waits", host->rate_waits);
+	OSS_HOST_STAT("rate_wait_msec", host->rate_wait_msec);
+	OSS_HOST_STAT("body_pool_peak", host->body_pool_peak);
+	OSS_HOST_STAT("body_pool_idle_peak", host->body_pool_idle_peak);
+	OSS_HOST_STAT("body_chunks_allocated", host->body_chunks_allocated);
+	OSS_HOST_STAT("body_chunks_reused", host->body_chunks_reused);
+	for (i = 0; i < AOS_BUF_POOL_CLASSES; i++)
+		OSS_HOST_STAT(psprintf("body_chunks_peak %d", AOS_BUF_POOL_MIN_SIZE << (2 * i)),
+					  host->body_chunks_peak[i]);
+	for (i = 0; i < OSS_HOST_MAX_ENDPOINTS; i++)
+	{
+		oss_host_endpoint *ep = &host->endpoints[i];
+
+		if (ep->name[0] == '\0')
+			continue;
+		OSS_HOST_STAT(psprintf("request_window %s", ep->name), (int64) ep->window);
+		OSS_HOST_STAT(psprintf("requests_in_flight %s", ep->name), ep->inflight);
+		OSS_HOST_STAT(psprintf("first_byte_usec %s", ep->name), (int64) ep->ttfb_avg);
+		OSS_HOST_STAT(psprintf("errors_per_mille %s", ep->name), (int64) (ep->error_avg * 1000));
+	}
+
+	pfree(host);
+
+#undef OSS_HOST_STAT
+
+	return n;
+}
+
+/*
+ * The slot of an endpoint, taken on first use. A slot is given up for
+ * another endpoint only once its breaker is closed, it has no failures and
+ * no request in flight.
+ * Returns NULL when all slots are busy. Lock must be held.
+ */
+static oss_host_endpoint *
+oss_host_endpoint_get(oss_host_shared *host, const char *endpoint, int64 now)
+{
+	oss_host_endpoint *free_slot = NULL;
+	int			i;
+
+	for (i = 0; i < OSS_HOST_MAX_ENDPOINTS; i++)
+	{
+		oss_host_endpoint *ep = &host->endpoints[i];
+
+		if (strncmp(ep->name, endpoint, OSS_HOST_ENDPOINT_LEN - 1) == 0)
+			return ep;
+
+		if (free_slot == NULL &&
+			(ep->name[0] == '\0' ||
+			 (ep->failures == 0 && ep->open_until <= now && ep->inflight == 0)))
+			free_slot = ep;
+	}
+
+	if (free_slot != NULL)
+	{
+		memset(free_slot, 0, sizeof(oss_host_endpoint));
+		snprintf(free_slot->name, OSS_HOST_ENDPOINT_LEN, "%s", endpoint);
+		free_slot->window = OSS_HOST_WINDOW_INIT;
+	}
+
+	return free_slot;
+}
+
+static int64
+oss_host_now_msec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (int64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*
+ * Take one retry from the host budget of the endpoint. Called from any
+ * thread; without host state every retry is allowed.
+ */
+bool
+oss_host_retry_acquire(const char *endpoint)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_endpoint *ep;
+	int64		now = oss_host_now_msec();
+	bool		ok = true;
+
+	if (host == NULL)
+		return true;
+
+	oss_host_lock(host);
+
+	ep = oss_host_endpoint_get(host, endpoint, now);
+	if (ep != NULL)
+	{
+		if (now - ep->window_start >= 1000)
+		{
+			ep->window_start = now;
+			ep->window_retries = 0;
+		}
+
+		if (ep->window_retries >= OSS_HOST_RETRY_RATE)
+			ok = false;
+		else
+			ep->window_retries++;
+	}
+
+	if (ok)
+		host->retries++;
+	else
+		host->retries_denied++;
+
+	oss_host_unlock(host);
+
+	return ok;
+}
+
+/*
+ * May a request be sent to the endpoint? False while its breaker is open.
+ * After the breaker was open for its while, the first request asking is
+ * the probe of the endpoint, and the breaker is open again for the others
+ * until the probe closes it. The lock is only taken when some endpoint has
+ * failures.
+ */
+bool
+oss_host_breaker_admit(const char *endpoint)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_endpoint *ep;
+	int64		now;
+	bool		ok = true;
+
+	if (host == NULL || host->failing == 0)
+		return true;
+
+	now = oss_host_now_msec();
+
+	oss_host_lock(host);
+
+	ep = oss_host_endpoint_get(host, endpoint, now);
+	if (ep != NULL)
+	{
+		if (ep->open_until > now)
+			ok = false;
+		else if (ep->failures >= OSS_HOST_BREAKER_FAILURES)
+			ep->open_until = now + OSS_HOST_BREAKER_OPEN_MSEC;
+	}
+
+	oss_host_unlock(host);
+
+	return ok;
+}
+
+/*
+ * Count a failed request of the endpoint. Returns false when its breaker
+ * is open, the caller then fails without retrying.
+ */
+bool
+oss_host_breaker_failure(const char *endpoint)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_endpoint *ep;
+	int64		now = oss_host_now_msec();
+	bool		ok = true;
+
+	if (host == NULL)
+		return true;
+
+	oss_host_lock(host);
+
+	ep = oss_host_endpoint_get(host, endpoint, now);
+	if (ep != NULL)
+	{
+		if (ep->failures++ == 0)
+			host->failing++;
+
+		if (ep->open_until > now)
+			ok = false;
+		else if (ep->failures >= OSS_HOST_BREAKER_FAILURES)
+		{
+			ep->open_until = now + OSS_HOST_BREAKER_OPEN_MSEC;
+			host->breaker_trips++;
+			ok = false;
+		}
+	}
+
+	oss_host_unlock(host);
+
+	return ok;
+}
+
+/*
+ * A request of the endpoint went through, which closes its breaker. The
+ * lock is only taken when some endpoint has failures.
+ */
+void
+oss_host_breaker_success(const char *endpoint)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_endpoint *ep;
+	int64		now;
+
+	if (host == NULL || host->failing == 0)
+		return;
+
+	now = oss_host_now_msec();
+
+	oss_host_lock(host);
+
+	ep = oss_host_endpoint_get(host, endpoint, now);
+	if (ep != NULL && ep->failures > 0)
+	{
+		ep->failures = 0;
+		ep->open_until = 0;
+		host->failing--;
+	}
+
+	oss_host_unlock(host);
+}
+
+/*
+ * Take a slot in the request window of the endpoint, waiting for one when
+ * the segments of the host already have the window full. Returns the slot
+ * to hand to oss_host_window_leave(), or -1 when the request is not
+ * accounted: no host state, no endpoint slot, or the query is cancelled.
+ * Called from any thread.
+ */
+int
+oss_host_window_enter(const char *endpoint)
+{
+	oss_host_shared *host = oss_host;
+	bool		waited = false;
+	int			waits = 0;
+	int			slot = -1;
+
+	if (host == NULL)
+		return -1;
+
+	oss_host_lock(host);
+
+	for (;;)
+	{
+		oss_host_endpoint *ep;
+		oss_host_client *client;
+		struct timespec deadline;
+
+		ep = oss_host_endpoint_get(host, endpoint, oss_host_now_msec());
+		client = oss_host_my_client(host);
+		if (ep == NULL || client == NULL)
+			break;
+
+		if (ep->inflight < (int) ep->window)
+		{
+			slot = ep - host->endpoints;
+			ep->inflight++;
+			client->inflight[slot]++;
+			if (waited)
+				host->window_waits++;
+			break;
+		}
+
+		/* the window may be held by a backend which died */
+		if (++waits % OSS_HOST_WINDOW_REAP_WAITS == 0)
+			oss_host_reap_clients(host);
+
+		if (InterruptPending)
+			break;
+
+		waited = true;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += OSS_HOST_WINDOW_WAIT_MSEC * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		host->window_waiters++;
+		if (pthread_cond_timedwait(&host->window_cond, &host->lock, &deadline) == EOWNERDEAD)
+			pthread_mutex_consistent(&host->lock);
+		host->window_waiters--;
+	}
+
+	oss_host_unlock(host);
+
+	return slot;
+}
+
+/*
+ * Give the slot back and move the window by how the request went. ttfb is
+ * its time to first byte in usec, 0 if unknown.
+ */
+void
+oss_host_window_leave(int slot, oss_window_outcome outcome, int64 ttfb)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_endpoint *ep;
+	oss_host_client *client;
+	int64		now;
+	bool		decrease = false;
+
+	if (host == NULL || slot < 0)
+		return;
+
+	now = oss_host_now_msec();
+
+	oss_host_lock(host);
+
+	ep = &host->endpoints[slot];
+	client = oss_host_my_client(host);
+	if (client != NULL && client->inflight[slot] > 0)
+	{
+		client->inflight[slot]--;
+		ep->inflight--;
+	}
+
+	if (outcome == OSS_WINDOW_OK && ttfb > 0)
+	{
+		if (ep->rtt_min == 0 || ttfb < ep->rtt_min ||
+			now - ep->rtt_min_stamp > OSS_HOST_RTT_MIN_MSEC)
+		{
+			ep->rtt_min = ttfb;
+			ep->rtt_min_stamp = now;
+		}
+
+		if (ttfb > OSS_HOST_RTT_FLOOR_USEC && ttfb > ep->rtt_min * OSS_HOST_WINDOW_INFLATION)
+			decrease = true;
+	}
+
+	if (outcome == OSS_WINDOW_CONGESTED)
+		decrease = true;
+
+	if (outcome != OSS_WINDOW_NEUTRAL)
+	{
+		ep->requests++;
+		ep->error_avg += OSS_HOST_HEALTH_WEIGHT *
+			((outcome == OSS_WINDOW_CONGESTED ? 1.0 : 0.0) - ep->error_avg);
+		if (outcome == OSS_WINDOW_OK && ttfb > 0)
+			ep->ttfb_avg = (ep->ttfb_avg == 0) ? ttfb :
+				ep->ttfb_avg + OSS_HOST_HEALTH_WEIGHT * (ttfb - ep->ttfb_avg);
+	}
+
+	if (decrease)
+	{
+		if (now - ep->last_decrease >= OSS_HOST_WINDOW_HOLD_MSEC)
+		{
+			ep->window = Max(ep->window * OSS_HOST_WINDOW_DECREASE, OSS_HOST_WINDOW_MIN);
+			ep->last_decrease = now;
+			host->window_decreases++;
+		}
+	}
+	else if (outcome == OSS_WINDOW_OK)
+	{
+		ep->window = Min(ep->window + 1.0 / ep->window, OSS_HOST_WINDOW_MAX);
+	}
+
+	/* the waiters of every endpoint share the condition, each looks at its own */
+	if (host->window_waiters > 0)
+		pthread_cond_broadcast(&host->window_cond);
+
+	oss_host_unlock(host);
+}
+
+/*
+ * How the requests of the segments of the host to the endpoint went lately:
+ * average time to first byte in usec, 0 when no download told it, the
+ * share of them which failed or were throttled, and whether its breaker
+ * is open. Returns false when the endpoint has no requests to tell by.
+ */
+bool
+oss_host_endpoint_health(const char *endpoint, double *ttfb, double *errors, bool *open)
+{
+	oss_host_shared *host = oss_host;
+	int64		now = oss_host_now_msec();
+	bool		found = false;
+	int			i;
+
+	if (host == NULL)
+		return false;
+
+	oss_host_lock(host);
+
+	for (i = 0; i < OSS_HOST_MAX_ENDPOINTS; i++)
+	{
+		oss_host_endpoint *ep = &host->endpoints[i];
+
+		if (strncmp(ep->name, endpoint, OSS_HOST_ENDPOINT_LEN - 1) != 0)
+			continue;
+
+		if (ep->requests > 0)
+		{
+			*ttfb = ep->ttfb_avg;
+			*errors = ep->error_avg;
+			*open = ep->open_until > now;
+			found = true;
+		}
+		break;
+	}
+
+	oss_host_unlock(host);
+
+	return found;
+}
+
+/*
+ * Add what the rate earned since the last refill, up to the burst.
+ */
+void
+oss_host_bucket_refill(oss_host_bucket *bucket, double rate, int64 now)
+{
+	double		cap = rate * OSS_HOST_RATE_BURST_SEC;
+
+	if (bucket->stamp == 0 || now < bucket->stamp)
+	{
+		bucket->tokens = cap;
+		bucket->stamp = now;
+		return;
+	}
+
+	bucket->tokens = Min(bucket->tokens + rate * (now - bucket->stamp) / 1000000.0, cap);
+	bucket->stamp = now;
+}
+
+/*
+ * Take bytes and requests from the host buckets. Returns 0 when taken, or
+ * the usec to wait before asking again. Called from any thread.
+ */
+int64
+oss_host_rate_take(int64 bytes, int requests)
+{
+	oss_host_shared *host = oss_host;
+	oss_host_client *client;
+	struct timeval tv;
+	int64		now;
+	int64		now_msec;
+	int64		wait = 0;
+
+	if (host == NULL || (oss_host_bandwidth_limit == 0 && oss_host_request_limit == 0))
+		return 0;
+
+	gettimeofday(&tv, NULL);
+	now = (int64) tv.tv_sec * 1000000 + tv.tv_usec;
+	now_msec = now / 1000;
+
+	oss_host_lock(host);
+
+	host->bandwidth_limit = (int64) oss_host_bandwidth_limit * 1024 * 1024;
+	host->request_limit = oss_host_request_limit;
+
+	if (host->bandwidth_limit > 0)
+	{
+		oss_host_bucket_refill(&host->bytes_bucket, host->bandwidth_limit, now);
+		if (bytes > 0 && host->bytes_bucket.tokens <= 0)
+			wait = Max(wait, (int64) (-host->bytes_bucket.tokens * 1000000 / host->bandwidth_limit) + 1);
+	}
+	if (host->request_limit > 0)
+	{
+		oss_host_bucket_refill(&host->requests_bucket, host->request_limit, now);
+		if (requests > 0 && host->requests_bucket.tokens < 1)
+			wait = Max(wait, (int64) ((1 - host->requests_bucket.tokens) * 1000000 / host->request_limit) + 1);
+	}
+
+	if (wait > 0)
+	{
+		host->rate_contended = now_msec;
+		oss_host_unlock(host);
+		return wait;
+	}
+
+	/* the buckets are not empty, but someone else is waiting for them */
+	client = oss_host_my_client(host);
+	if (client != NULL && !oss_host_rate_fair(host, client, now_msec))
+	{
+		oss_host_unlock(host);
+		return OSS_HOST_RATE_CONTENDED_MSEC * 1000 / 4;
+	}
+
+	if (host->bandwidth_limit > 0)
+		host->bytes_bucket.tokens -= bytes;
+	if (host->request_limit > 0)
+		host->requests_bucket.tokens -= requests;
+
+	if (client != NULL)
+	{
+		if (now_msec - client->rate_second >= 1000)
+		{
+			client->rate_second = now_msec;
+			client->rate_bytes = 0;
+			client->rate_requests = 0;
+		}
+		client->rate_bytes += bytes;
+		client->rate_requests += requests;
+		client->rate_last = now_msec;
+	}
+
+	oss_host_unlock(host);
+
+	return 0;
+}
+
+/*
+ * Whether the client is within its share of the rates. Only matters while
+ * some backend had to wait lately, otherwise whoever asks takes. The share
+ * is an even split between the backends which took lately. Lock must be
+ * held.
+ */
+static bool
+oss_host_rate_fair(oss_host_shared *host, oss_host_client *client, int64 now_msec)
+{
+	int			nactive = 0;
+	int			i;
+
+	if (now_msec - host->rate_contended > OSS_HOST_RATE_CONTENDED_MSEC)
+		return true;
+
+	if (now_msec - client->rate_second >= 1000)
+		return true;
+
+	for (i = 0; i < OSS_HOST_MAX_CLIENTS; i++)
+	{
+		if (host->clients[i].pid != 0 &&
+			now_msec - host->clients[i].rate_last < OSS_HOST_RATE_ACTIVE_MSEC)
+			nactive++;
+	}
+	if (now_msec - client->rate_last >= OSS_HOST_RATE_ACTIVE_MSEC)
+		nactive++;
+
+	if (host->bandwidth_limit > 0 && client->rate_bytes >= host->bandwidth_limit / nactive)
+		return false;
+	if (host->request_limit > 0 && client->rate_requests >= host->request_limit / nactive)
+		return false;
+
+	return true;
+}
+
+void
+oss_host_rate_waited(int64 msec)
+{
+	oss_host_shared *host = oss_host;
+
+	if (host == NULL)
+		return;
+
+	oss_host_lock(host);
+	host->rate_waits++;
+	host->rate_wait_msec += msec;
+	oss_host_unlock(host);
+}
+
+/*
+ * Fold the high-water marks of the body chunk pool of the process into the
+ * host counters, so that the pool can be sized from oss_ext_host_stats().
+ * Called from the backend at the end of a scan, when a reload may also
+ * have changed the size.
+ */
+void
+oss_host_body_pool_report(void)
+{
+	static int64 reported_allocated = 0;
+	static int64 reported_reused = 0;
+	oss_host_shared *host = oss_host;
+	aos_buf_pool_stats_t stats;
+	int64		allocated = 0;
+	int64		reused = 0;
+	int			i;
+
+	aos_buf_pool_set_max_idle((int64) oss_host_body_pool_size * 1024 * 1024);
+
+	if (host == NULL)
+		return;
+
+	aos_buf_pool_get_stats(&stats);
+	for (i = 0; i < AOS_BUF_POOL_CLASSES; i++)
+	{
+		allocated += stats.classes[i].allocated;
+		reused += stats.classes[i].reused;
+	}
+
+	oss_host_lock(host);
+	host->body_pool_peak = Max(host->body_pool_peak, stats.bytes_in_use_peak);
+	host->body_pool_idle_peak = Max(host->body_pool_idle_peak, stats.bytes_idle_peak);
+	for (i = 0; i < AOS_BUF_POOL_CLASSES; i++)
+		host->body_chunks_peak[i] = Max(host->body_chunks_peak[i], stats.classes[i].in_use_peak);
+	host->body_chunks_allocated += allocated - reported_allocated;
+	host->body_chunks_reused += reused - reported_reused;
+	oss_host_unlock(host);
+
+	reported_allocated = allocated;
+	reported_reused = reused;
+}
@@ -0,0 +1,486 @@
+#include "postgres.h"
+
+#include "utils/memutils.h"
+
+#include "ossapi.h"
+#include "oss_multireader.h"
+
+static size_t MultiReaderRead(void *selfp, void *buffer, size_t request_len);
+static void MultiReaderClose(void *selfp);
+static void *oss_multireader_main(void *arg);
+static bool mr_read_file(oss_multireader *mr, oss_mr_worker *w, oss_file *file, char *msg);
+static bool mr_reserve(oss_mr_worker *w, int64 need, char *msg);
+static bool mr_emit_lines(oss_multireader *mr, oss_mr_worker *w, bool all);
+static bool mr_push(oss_multireader *mr, char *data, int64 len);
+
+/*
+ * Read the files of the segment parallel_files at a time. Returns false,
+ * leaving the scan to the one file at a time sources, when there is only one
+ * file or the host memory budget can't afford two workers.
+ */
+bool
+CreateMultiReaderSource(ext_oss_t *self)
+{
+	oss_multireader *mr;
+	ListCell   *lc;
+	int64		granted;
+	int			nfiles = list_length(self->filelist);
+	int			nworkers = Min(self->parallel_files, nfiles);
+	int			i;
+
+	/*
+	 * The work queue hands out one unit at a time, and a bzip2 file is
+	 * decoded by several threads already.
+	 */
+	if (self->workqueue != NULL || self->file_opt.type == OSS_COMPRESSION_BZIP2)
+	{
+		elog(NOTICE, "parallel_files is ignored with %s",
+			 (self->workqueue != NULL) ? (self->work_stealing ? "work_stealing" : "gzip_index") :
+			 "compressiontype=bzip2");
+		return false;
+	}
+
+	if (nworkers < 2)
+		return false;
+
+	granted = oss_buffer_grant(self, nworkers * (int64) OSS_MR_WORKER_MEM, 0);
+	if (granted < 2 * OSS_MR_WORKER_MEM)
+	{
+		oss_buffer_release(self, granted);
+		return false;
+	}
+	nworkers = Min(nworkers, granted / OSS_MR_WORKER_MEM);
+
+	mr = MemoryContextAllocZero(self->ctx, sizeof(oss_multireader));
+	mr->conn = self->conn;
+	mr->ro = self->ro;
+	mr->type = self->file_opt.type;
+
+	mr->nfiles = nfiles;
+	mr->files = MemoryContextAlloc(self->ctx, sizeof(oss_file) * nfiles);
+	i = 0;
+	foreach(lc, self->filelist)
+	{
+		oss_file   *file = (oss_file *) lfirst(lc);
+
+		mr->files[i].filename = MemoryContextStrdup(self->ctx, file->filename);
+		mr->files[i].length = file->length;
+		i++;
+	}
+	mr->nextfile = 0;
+
+	mr->queue_limit = nworkers * 2 * (int64) OSS_MR_BLOCK_SIZE;
+	mr->workers = MemoryContextAllocZero(self->ctx, sizeof(pthread_t) * nworkers);
+
+	pthread_mutex_init(&mr->lock, NULL);
+	pthread_cond_init(&mr->cond, NULL);
+
+	self->com_hd = (void *) mr;
+	self->base.read = (SourceReadProc) MultiReaderRead;
+	self->base.close = (SourceCloseProc) MultiReaderClose;
+
+	for (i = 0; i < nworkers; i++)
+	{
+		pthread_mutex_lock(&mr->lock);
+		if (pthread_create(&mr->workers[i], NULL, oss_multireader_main, mr) != 0)
+		{
+			pthread_mutex_unlock(&mr->lock);
+			elog(ERROR, "create oss thread use pthread_create oss_multireader_main faild");
+		}
+		mr->nworkers++;
+		mr->running++;
+		pthread_mutex_unlock(&mr->lock);
+	}
+
+	if (self->segindex == 0)
+	{
+		elog(DEBUG1, "read %d oss files with %d workers", nfiles, nworkers);
+	}
+
+	return true;
+}
+
+static size_t
+MultiReaderRead(void *selfp, void *buffer, size_t request_len)
+{
+	ext_oss_t  *self = (ext_oss_t *) selfp;
+	oss_multireader *mr = (oss_multireader *) self->com_hd;
+	oss_mr_block *block;
+	size_t		n;
+
+	while (mr->cur == NULL)
+	{
+		pthread_mutex_lock(&mr->lock);
+
+		if (mr->error)
+		{
+			pthread_mutex_unlock(&mr->lock);
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("%s", mr->errmsg)));
+		}
+
+		if (mr->head != NULL)
+		{
+			mr->cur = mr->head;
+			mr->head = mr->head->next;
+			if (mr->head == NULL)
+				mr->tail = NULL;
+			mr->queued -= mr->cur->len;
+			pthread_cond_broadcast(&mr->cond);
+		}
+		else if (mr->running == 0)
+		{
+			pthread_mutex_unlock(&mr->lock);
+			return 0;
+		}
+
+		pthread_mutex_unlock(&mr->lock);
+
+		if (mr->cur == NULL)
+			pg_usleep(SPIN_SLEEP_MSEC * 1000);
+	}
+
+	block = mr->cur;
+	n = Min(request_len, (size_t) (block->len - block->pos));
+	memcpy(buffer, block->data + block->pos, n);
+	block->pos += n;
+
+	if (block->pos == block->len)
+	{
+		free(block);
+		mr->cur = NULL;
+	}
+
+	return n;
+}
+
+static void
+MultiReaderClose(void *selfp)
+{
+	ext_oss_t  *self = (ext_oss_t *) selfp;
+	oss_multireader *mr = (oss_multireader *) self->com_hd;
+	oss_mr_block *block;
+	int			i;
+
+	if (mr == NULL)
+		return;
+
+	pthread_mutex_lock(&mr->lock);
+	mr->stop = true;
+	pthread_cond_broadcast(&mr->cond);
+	pthread_mutex_unlock(&mr->lock);
+
+	for (i = 0; i < mr->nworkers; i++)
+	{
+		pthread_join(mr->workers[i], NULL);
+	}
+
+	while (mr->head != NULL)
+	{
+		block = mr->head;
+		mr->head = block->next;
+		free(block);
+	}
+	mr->tail = NULL;
+
+	if (mr->cur != NULL)
+	{
+		free(mr->cur);
+		mr->cur = NULL;
+	}
+
+	pthread_cond_destroy(&mr->cond);
+	pthread_mutex_destroy(&mr->lock);
+
+	self->com_hd = NULL;
+}
+
+static void *
+oss_multireader_main(void *arg)
+{
+	oss_multireader *mr = (oss_multireader *) arg;
+	oss_mr_worker w;
+	char		msg[ERROR_MESSAGE_LEN];
+
+	memset(&w, 0, sizeof(oss_mr_worker));
+
+	for (;;)
+	{
+		oss_file   *file = NULL;
+
+		pthread_mutex_lock(&mr->lock);
+		if (!mr->stop && !mr->error && mr->nextfile < mr->nfiles)
+		{
+			file = &mr->files[mr->nextfile++];
+		}
+		pthread_mutex_unlock(&mr->lock);
+
+		if (file == NULL)
+			break;
+
+		msg[0] = '\0';
+		if (!mr_read_file(mr, &w, file, msg))
+		{
+			pthread_mutex_lock(&mr->lock);
+			if (!mr->error && !mr->stop)
+			{
+				snprintf(mr->errmsg, ERROR_MESSAGE_LEN, "%s", msg);
+				mr->error = true;
+			}
+			pthread_cond_broadcast(&mr->cond);
+			pthread_mutex_unlock(&mr->lock);
+			break;
+		}
+	}
+
+	free(w.in);
+	free(w.carry);
+
+	pthread_mutex_lock(&mr->lock);
+	mr->running--;
+	pthread_mutex_unlock(&mr->lock);
+
+	return NULL;
+}
+
+/*
+ * Read one file and queue its content as blocks of whole lines. A file which
+ * does not end with a newline gets one, so its last row does not run into
+ * the first row of another file.
+ */
+static bool
+mr_read_file(oss_multireader *mr, oss_mr_worker *w, oss_file *file, char *msg)
+{
+	bool		gzip = (mr->type == OSS_COMPRESSION_GZIP);
+	int64		offset = 0;
+	bool		member_open = false;
+	bool		ok = false;
+
+	w->carry_len = 0;
+
+	if (gzip)
+	{
+		if (w->in == NULL && (w->in = malloc(OSS_MR_READ_SIZE)) == NULL)
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN, "oss read thread out of memory");
+			return false;
+		}
+
+		memset(&w->zs, 0, sizeof(z_stream));
+		if (inflateInit2(&w->zs, MAX_WBITS + 32) != Z_OK)
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN, "failed to initialize inflate for %s", file->filename);
+			return false;
+		}
+	}
+
+	while (offset < file->length && !mr->stop)
+	{
+		size_t		len = Min((int64) OSS_MR_READ_SIZE, file->length - offset);
+		char	   *dst;
+		size_t		n;
+
+		if (gzip)
+		{
+			dst = w->in;
+		}
+		else
+		{
+			if (!mr_reserve(w, len, msg))
+				goto done;
+			dst = w->carry + w->carry_len;
+		}
+
+		n = oss_read_buffer(&mr->conn, file->filename, dst, offset, len, true, msg, mr->ro);
+		if (n == 0)
+			goto done;
+		offset += n;
+
+		if (!gzip)
+		{
+			w->carry_len += n;
+		}
+		else
+		{
+			bool		full = false;
+
+			w->zs.next_in = (Bytef *) w->in;
+			w->zs.avail_in = n;
+
+			while (w->zs.avail_in > 0 || full)
+			{
+				int			ret;
+				uInt		avail;
+
+				if (!mr_reserve(w, OSS_MR_INFLATE_SIZE, msg))
+					goto done;
+
+				avail = (uInt) Min(w->carry_size - w->carry_len, (int64) 1 << 30);
+				w->zs.next_out = (Bytef *) (w->carry + w->carry_len);
+				w->zs.avail_out = avail;
+
+				ret = inflate(&w->zs, Z_NO_FLUSH);
+				w->carry_len += avail - w->zs.avail_out;
+				full = (w->zs.avail_out == 0);
+
+				if (ret == Z_STREAM_END)
+				{
+					/* concatenated gzip members, as pigz may write them */
+					inflateReset(&w->zs);
+					member_open = false;
+				}
+				else if (ret == Z_OK)
+				{
+					member_open = true;
+				}
+				else if (ret == Z_BUF_ERROR)
+				{
+					break;
+				}
+				else if (ret != Z_OK)
+				{
+					snprintf(msg, ERROR_MESSAGE_LEN, "failed to decompress %s: %s", file->filename,
+							 w->zs.msg ? w->zs.msg : "inflate error");
+					goto done;
+				}
+
+				if (!mr_emit_lines(mr, w, false))
+					goto done;
+			}
+		}
+
+		if (!mr_emit_lines(mr, w, false))
+			goto done;
+	}
+
+	if (mr->stop)
+		goto done;
+
+	/* the file ended in the middle of a member */
+	if (member_open)
+	{
+		snprintf(msg, ERROR_MESSAGE_LEN, "unexpected end of gzip file %s", file->filename);
+		goto done;
+	}
+
+	if (w->carry_len > 0 && w->carry[w->carry_len - 1] != '\n')
+	{
+		if (!mr_reserve(w, 1, msg))
+			goto done;
+		w->carry[w->carry_len++] = '\n';
+	}
+
+	ok = mr_emit_lines(mr, w, true);
+
+done:
+	if (gzip)
+	{
+		inflateEnd(&w->zs);
+	}
+
+	return ok;
+}
+
+static bool
+mr_reserve(oss_mr_worker *w, int64 need, char *msg)
+{
+	int64		size;
+	char	   *carry;
+
+	if (w->carry_size - w->carry_len >= need)
+		return true;
+
+	size = Max(w->carry_size * 2, w->carry_len + need);
+	size = Max(size, OSS_MR_READ_SIZE + OSS_MR_BLOCK_SIZE);
+	carry = realloc(w->carry, size);
+	if (carry == NULL)
+	{
+		snprintf(msg, ERROR_MESSAGE_LEN, "oss read thread out of memory");
+		return false;
+	}
+
+	w->carry = carry;
+	w->carry_size = size;
+
+	return true;
+}
+
+/*
+ * Queue the whole lines of the carry once there is a block worth of them,
+ * or all of it at the end of the file. Returns false when the scan stopped.
+ */
+static bool
+mr_emit_lines(oss_multireader *mr, oss_mr_worker *w, bool all)
+{
+	int64		len;
+
+	if (w->carry_len == 0 || (!all && w->carry_len < OSS_MR_BLOCK_SIZE))
+		return !mr->stop;
+
+	len = w->carry_len;
+	if (!all)
+	{
+		while (len > 0 && w->carry[len - 1] != '\n')
+			len--;
+		if (len == 0)
+			return !mr->stop;
+	}
+
+	if (!mr_push(mr, w->carry, len))
+		return false;
+
+	memmove(w->carry, w->carry + len, w->carry_len - len);
+	w->carry_len -= len;
+
+	return true;
+}
+
+static bool
+mr_push(oss_multireader *mr, char *data, int64 len)
+{
+	oss_mr_block *block;
+
+	block = malloc(offsetof(oss_mr_block, data) + len);
+	if (block == NULL)
+	{
+		pthread_mutex_lock(&mr->lock);
+		if (!mr->error && !mr->stop)
+		{
+			snprintf(mr->errmsg, ERROR_MESSAGE_LEN, "oss read thread out of memory");
+			mr->error = true;
+		}
+		pthread_mutex_unlock(&mr->lock);
+		return false;
+	}
+
+	memcpy(block->data, data, len);
+	block->len = len;
+	block->pos = 0;
+	block->next = NULL;
+
+	pthread_mutex_lock(&mr->lock);
+
+	while (mr->queued > 0 && mr->queued + len > mr->queue_limit && !mr->stop)
+	{
+		pthread_cond_wait(&mr->cond, &mr->lock);
+	}
+
+	if (mr->stop)
+	{
+		pthread_mutex_unlock(&mr->lock);
+		free(block);
+		return false;
+	}
+
+	if (mr->tail)
+		mr->tail->next = block;
+	else
+		mr->head = block;
+	mr->tail = block;
+	mr->queued += len;
+
+	pthread_mutex_unlock(&mr->lock);
+
+	return true;
+}
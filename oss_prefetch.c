@@ -0,0 +1,234 @@
+#include "postgres.h"
+
+#include "utils/memutils.h"
+
+#include "ossapi.h"
+#include "oss_prefetch.h"
+
+static void *oss_prefetch_main(void *arg);
+
+/*
+ * Start fetching the files after the current one. Called from the backend
+ * once the first file is open; does nothing when there is no next file, when
+ * prefetch is disabled or when the host memory budget can't spare two slots.
+ */
+void
+oss_prefetch_start(ext_oss_t *myData)
+{
+	oss_prefetch *pf;
+	ListCell   *lc;
+	int64		granted;
+	int			nfiles = list_length(myData->filelist) + 1;
+	int			nslots = Min(myData->prefetch_files + 1, nfiles);
+	int			i;
+
+	if (myData->currentfile == NULL || nslots < 2)
+		return;
+
+	granted = oss_buffer_grant(myData, nslots * (int64) OSS_PREFETCH_SLOT_SIZE, 0);
+	if (granted < 2 * OSS_PREFETCH_SLOT_SIZE)
+	{
+		oss_buffer_release(myData, granted);
+		return;
+	}
+	nslots = granted / OSS_PREFETCH_SLOT_SIZE;
+
+	pf = MemoryContextAllocZero(myData->ctx, sizeof(oss_prefetch));
+	pf->conn = myData->conn;
+	pf->ro = myData->ro;
+	pf->slot_size = OSS_PREFETCH_SLOT_SIZE;
+
+	pf->nfiles = nfiles;
+	pf->files = MemoryContextAlloc(myData->ctx, sizeof(oss_prefetch_file) * nfiles);
+	pf->files[0].filename = MemoryContextStrdup(myData->ctx, myData->currentfile);
+	pf->files[0].length = myData->length;
+	i = 1;
+	foreach(lc, myData->filelist)
+	{
+		oss_file   *file = (oss_file *) lfirst(lc);
+
+		pf->files[i].filename = MemoryContextStrdup(myData->ctx, file->filename);
+		pf->files[i].length = file->length;
+		i++;
+	}
+
+	pf->nslots = nslots;
+	pf->slots = MemoryContextAllocZero(myData->ctx, sizeof(oss_prefetch_slot) * nslots);
+	for (i = 0; i < nslots; i++)
+	{
+		pf->slots[i].fileno = -1;
+		pf->slots[i].state = OSS_PREFETCH_EMPTY;
+		pf->slots[i].data = MemoryContextAlloc(myData->ctx, pf->slot_size);
+	}
+
+	pf->consumed = 0;
+	pf->next = 1;
+	pf->cur = NULL;
+
+	pthread_mutex_init(&pf->lock, NULL);
+	if (pthread_create(&pf->th, NULL, oss_prefetch_main, pf) != 0)
+	{
+		pthread_mutex_destroy(&pf->lock);
+		elog(WARNING, "create oss prefetch thread faild, continue without prefetch");
+		return;
+	}
+
+	myData->prefetch = pf;
+
+	elog(DEBUG1, "prefetch %d of %d oss files ahead", nslots - 1, nfiles - 1);
+}
+
+static void *
+oss_prefetch_main(void *arg)
+{
+	oss_prefetch *pf = (oss_prefetch *) arg;
+
+	for (;;)
+	{
+		oss_prefetch_slot *slot;
+		oss_prefetch_file *file;
+		int			fileno;
+		int64		len;
+		size_t		n;
+
+		pthread_mutex_lock(&pf->lock);
+
+		if (pf->stop)
+		{
+			pthread_mutex_unlock(&pf->lock);
+			break;
+		}
+
+		/* files the scan has already reached are not worth fetching anymore */
+		if (pf->next <= pf->consumed)
+			pf->next = pf->consumed + 1;
+
+		if (pf->next >= pf->nfiles)
+		{
+			pthread_mutex_unlock(&pf->lock);
+			break;
+		}
+
+		/* every slot holds the current file or one after it */
+		if (pf->next >= pf->consumed + pf->nslots)
+		{
+			pthread_mutex_unlock(&pf->lock);
+			pg_usleep(SPIN_SLEEP_MSEC * 1000);
+			continue;
+		}
+
+		fileno = pf->next++;
+		file = &pf->files[fileno];
+		if (file->length <= 0)
+		{
+			pthread_mutex_unlock(&pf->lock);
+			continue;
+		}
+
+		slot = &pf->slots[fileno % pf->nslots];
+		slot->fileno = fileno;
+		slot->state = OSS_PREFETCH_LOADING;
+		slot->len = 0;
+
+		pthread_mutex_unlock(&pf->lock);
+
+		/*
+		 * A failed prefetch is not an error, the scan reads the file itself
+		 * and reports what goes wrong there.
+		 */
+		len = Min(file->length, pf->slot_size);
+		pf->errmsg[0] = '\0';
+		if (file->length <= pf->slot_size)
+		{
+			n = oss_read_object(&pf->conn, file->filename, slot->data, len, true, pf->errmsg, pf->ro);
+		}
+		else
+		{
+			n = oss_read_buffer(&pf->conn, file->filename, slot->data, 0, len, true, pf->errmsg, pf->ro);
+		}
+
+		pthread_mutex_lock(&pf->lock);
+		slot->len = n;
+		slot->state = ((int64) n == len) ? OSS_PREFETCH_READY : OSS_PREFETCH_FAILED;
+		pthread_mutex_unlock(&pf->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * The scan has moved to its next file, pick up what was prefetched of it.
+ * Called from oss_next_file(), in the backend or in the read thread. A file
+ * still being fetched is waited for rather than requested a second time.
+ */
+void
+oss_prefetch_next_file(ext_oss_t *myData)
+{
+	oss_prefetch *pf = myData->prefetch;
+	oss_prefetch_slot *slot;
+	int			fileno;
+
+	if (pf == NULL)
+		return;
+
+	pthread_mutex_lock(&pf->lock);
+
+	fileno = ++pf->consumed;
+	pf->cur = NULL;
+
+	slot = &pf->slots[fileno % pf->nslots];
+	while (slot->fileno == fileno && slot->state == OSS_PREFETCH_LOADING)
+	{
+		pthread_mutex_unlock(&pf->lock);
+		pg_usleep(SPIN_SLEEP_MSEC * 1000);
+		pthread_mutex_lock(&pf->lock);
+	}
+
+	if (slot->fileno == fileno && slot->state == OSS_PREFETCH_READY)
+		pf->cur = slot;
+
+	pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ * Copy what the prefetch holds of the current file at offset, returns 0 when
+ * the range is not prefetched. The slot of the current file is not reused
+ * until the scan moves on, so no lock is needed.
+ */
+size_t
+oss_prefetch_read(ext_oss_t *myData, void *buffer, int64 offset, size_t len)
+{
+	oss_prefetch *pf = myData->prefetch;
+	oss_prefetch_slot *slot;
+	size_t		n;
+
+	if (pf == NULL || pf->cur == NULL)
+		return 0;
+
+	slot = pf->cur;
+	if (offset >= slot->len)
+		return 0;
+
+	n = Min(len, (size_t) (slot->len - offset));
+	memcpy(buffer, slot->data + offset, n);
+
+	return n;
+}
+
+void
+oss_prefetch_stop(ext_oss_t *myData)
+{
+	oss_prefetch *pf = myData->prefetch;
+
+	if (pf == NULL)
+		return;
+
+	pthread_mutex_lock(&pf->lock);
+	pf->stop = true;
+	pthread_mutex_unlock(&pf->lock);
+
+	pthread_join(pf->th, NULL);
+	pthread_mutex_destroy(&pf->lock);
+
+	myData->prefetch = NULL;
+}
@@ -0,0 +1,53 @@
+#include "postgres.h"
+
+#include "ossapi.h"
+#include "oss_range.h"
+
+/*
+ * Start at the one megabyte the reads always used, within the bounds.
+ */
+void
+oss_range_init(oss_range_tuner *range, int64 min_size, int64 max_size)
+{
+	range->min_size = min_size;
+	range->max_size = Max(max_size, min_size);
+	range->size = Min(Max((int64) READ_UNIT_SIZE, range->min_size), range->max_size);
+	range->ttfb = 0;
+	range->rate = 0;
+	range->samples = 0;
+}
+
+/*
+ * Take the timing of a GET of bytes into account. On a link where the first
+ * byte takes long compared to the transfer the ranges grow, so that fewer
+ * GETs pay that wait; on a fast, near endpoint they shrink back and hold
+ * less memory. Called from the read thread, no elog.
+ */
+void
+oss_range_observe(oss_range_tuner *range, int64 bytes, oss_read_timing *timing)
+{
+	int64		transfer = timing->elapsed - timing->ttfb;
+	double		bdp;
+	int64		size;
+
+	if (bytes < OSS_RANGE_MIN_SAMPLE || transfer <= 0 || timing->ttfb < 0)
+		return;
+
+	if (range->samples == 0)
+	{
+		range->ttfb = timing->ttfb;
+		range->rate = (double) bytes / transfer;
+	}
+	else
+	{
+		range->ttfb += OSS_RANGE_ALPHA * (timing->ttfb - range->ttfb);
+		range->rate += OSS_RANGE_ALPHA * ((double) bytes / transfer - range->rate);
+	}
+	range->samples++;
+
+	bdp = range->ttfb * range->rate;
+	size = (int64) (bdp * OSS_RANGE_BDP_FACTOR);
+	size = size - size % OSS_RANGE_ALIGN + OSS_RANGE_ALIGN;
+
+	range->size = Min(Max(size, range->min_size), range->max_size);
+}
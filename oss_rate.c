@@ -0,0 +1,127 @@
+#include "postgres.h"
+
+#include <sys/time.h>
+
+#include "miscadmin.h"
+
+#include "ossapi.h"
+#include "oss_host.h"
+#include "oss_rate.h"
+
+static int64 oss_rate_scan_take(oss_rate_limit *limit, int64 bytes, int64 now);
+static int64 oss_rate_now(void);
+
+/*
+ * The buckets of a scan, NULL when the scan has no cap of its own.
+ */
+oss_rate_limit *
+oss_rate_limit_create(int bandwidth_mb, int requests)
+{
+	oss_rate_limit *limit;
+
+	if (bandwidth_mb <= 0 && requests <= 0)
+		return NULL;
+
+	limit = palloc0(sizeof(oss_rate_limit));
+	limit->bandwidth = (int64) Max(bandwidth_mb, 0) * 1024 * 1024;
+	limit->requests = Max(requests, 0);
+	pthread_mutex_init(&limit->lock, NULL);
+
+	return limit;
+}
+
+void
+oss_rate_limit_destroy(oss_rate_limit *limit)
+{
+	if (limit == NULL)
+		return;
+
+	pthread_mutex_destroy(&limit->lock);
+	pfree(limit);
+}
+
+/*
+ * Wait until the scan and the host may send one request moving bytes.
+ * The scan cap is taken first, so that a capped scan does not hold host
+ * tokens while it waits for its own. Called from any thread, no elog.
+ */
+void
+oss_rate_acquire(oss_rate_limit *limit, int64 bytes)
+{
+	int64		waited = 0;
+	int64		wait;
+
+	for (;;)
+	{
+		wait = (limit != NULL) ? oss_rate_scan_take(limit, bytes, oss_rate_now()) : 0;
+		if (wait == 0)
+			break;
+
+		if (InterruptPending)
+			break;
+
+		wait = Min(wait, OSS_RATE_SLEEP_STEP_MSEC * 1000L);
+		pg_usleep(wait);
+		waited += wait;
+	}
+
+	for (;;)
+	{
+		wait = oss_host_rate_take(bytes, 1);
+		if (wait == 0)
+			break;
+
+		if (InterruptPending)
+			break;
+
+		wait = Min(wait, OSS_RATE_SLEEP_STEP_MSEC * 1000L);
+		pg_usleep(wait);
+		waited += wait;
+	}
+
+	if (waited > 0)
+		oss_host_rate_waited(waited / 1000);
+}
+
+static int64
+oss_rate_scan_take(oss_rate_limit *limit, int64 bytes, int64 now)
+{
+	int64		wait = 0;
+
+	pthread_mutex_lock(&limit->lock);
+
+	if (limit->bandwidth > 0)
+	{
+		oss_host_bucket_refill(&limit->bytes_bucket, limit->bandwidth, now);
+		if (bytes > 0 && limit->bytes_bucket.tokens <= 0)
+			wait = Max(wait, (int64) (-limit->bytes_bucket.tokens * 1000000 / limit->bandwidth) + 1);
+	}
+	if (limit->requests > 0)
+	{
+		oss_host_bucket_refill(&limit->requests_bucket, limit->requests, now);
+		if (limit->requests_bucket.tokens < 1)
+			wait = Max(wait, (int64) ((1 - limit->requests_bucket.tokens) * 1000000 / limit->requests) + 1);
+	}
+
+	if (wait == 0)
+	{
+		if (limit->bandwidth > 0)
+			limit->bytes_bucket.tokens -= bytes;
+		if (limit->requests > 0)
+			limit->requests_bucket.tokens -= 1;
+	}
+
+	pthread_mutex_unlock(&limit->lock);
+
+	return wait;
+}
+
+static int64
+oss_rate_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (int64) tv.tv_sec * 1000000 + tv.tv_usec;
+}
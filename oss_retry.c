@@ -0,0 +1,203 @@
+#include "postgres.h"
+
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "miscadmin.h"
+
+#include "ossapi.h"
+#include "oss_host.h"
+#include "oss_retry.h"
+
+static bool oss_retry_throttled(aos_status_t *s);
+static int	oss_retry_after(aos_table_t *resp_headers);
+
+oss_retry_budget *
+oss_retry_budget_create(void)
+{
+	return (oss_retry_budget *) palloc0(sizeof(oss_retry_budget));
+}
+
+/*
+ * Start a request. Called from the backend or from a thread, no elog.
+ */
+void
+oss_retry_init(oss_retry *retry, oss_connect *conn)
+{
+	struct timeval tv;
+
+	retry->budget = conn->retry;
+	retry->rate = conn->rate;
+	retry->endpoint = conn->osshost;
+	retry->attempt = 0;
+	retry->sleep_msec = OSS_RETRY_BASE_MSEC;
+	retry->denied = NULL;
+	retry->refused = false;
+	retry->window_slot = -1;
+
+	/* segments failing together must not wake up together */
+	gettimeofday(&tv, NULL);
+	retry->seed = (unsigned int) (tv.tv_usec ^ (getpid() << 12) ^ (uintptr_t) retry);
+
+	if (retry->budget != NULL)
+		__sync_fetch_and_add(&retry->budget->requests, 1);
+}
+
+/*
+ * The request failed with s: wait and return true when it is worth another
+ * try. A retry is refused when the error is not transient, when the request
+ * used up its retries, when the scan or the host used up their budget, or
+ * when the breaker of the endpoint is open; retry->denied then tells which.
+ */
+bool
+oss_retry_next(oss_retry *retry, aos_status_t *s, aos_table_t *resp_headers)
+{
+	oss_retry_budget *budget = retry->budget;
+	int			after;
+	int			wait;
+	int			hi;
+
+	/* the attempt was not even sent, retry->denied tells why */
+	if (retry->refused)
+		return false;
+
+	retry->denied = NULL;
+
+	if (aos_should_retry(s) != 1 && !oss_retry_throttled(s))
+		return false;
+
+	if (!oss_host_breaker_failure(retry->endpoint))
+	{
+		retry->denied = "the endpoint is failing, circuit breaker open";
+		return false;
+	}
+
+	if (retry->attempt >= OSS_RETRY_COUNT)
+		return false;
+
+	if (budget != NULL &&
+		budget->retries >= OSS_RETRY_SCAN_MIN + budget->requests * OSS_RETRY_SCAN_RATIO / 100)
+	{
+		__sync_fetch_and_add(&budget->denied, 1);
+		retry->denied = "retry budget of the scan used up";
+		return false;
+	}
+
+	if (!oss_host_retry_acquire(retry->endpoint))
+	{
+		retry->denied = "retry budget of the host used up";
+		return false;
+	}
+
+	if (budget != NULL)
+		__sync_fetch_and_add(&budget->retries, 1);
+
+	hi = Min(retry->sleep_msec * 3, OSS_RETRY_CAP_MSEC);
+	wait = OSS_RETRY_BASE_MSEC + rand_r(&retry->seed) % (hi - OSS_RETRY_BASE_MSEC + 1);
+
+	after = oss_retry_after(resp_headers);
+	if (after > wait)
+		wait = after;
+	retry->sleep_msec = wait;
+
+	while (wait > 0)
+	{
+		if (InterruptPending)
+		{
+			retry->denied = "the query is cancelled";
+			return false;
+		}
+
+		pg_usleep(Min(wait, OSS_RETRY_SLEEP_STEP_MSEC) * 1000L);
+		wait -= OSS_RETRY_SLEEP_STEP_MSEC;
+	}
+
+	retry->attempt++;
+
+	return true;
+}
+
+void
+oss_retry_success(oss_retry *retry)
+{
+	oss_host_breaker_success(retry->endpoint);
+}
+
+/*
+ * Bracket one attempt of the request moving bytes: wait for the rate caps
+ * and for a slot in the request window of the host, then give the slot
+ * back with how the attempt went. Returns false, without waiting, when the
+ * breaker of the endpoint is open; the caller then fails the request with
+ * s NULL and oss_retry_leave() is not called.
+ */
+bool
+oss_retry_enter(oss_retry *retry, aos_http_controller_t *ctl, int64 bytes, bool upload)
+{
+	if (!oss_host_breaker_admit(retry->endpoint))
+	{
+		retry->refused = true;
+		retry->denied = "the endpoint is failing, circuit breaker open";
+		return false;
+	}
+
+	oss_rate_acquire(retry->rate, bytes);
+
+	/* the controller only stamps the first byte of its first response */
+	ctl->first_byte_time = 0;
+
+	retry->upload = upload;
+	retry->window_slot = oss_host_window_enter(retry->endpoint);
+
+	return true;
+}
+
+void
+oss_retry_leave(oss_retry *retry, aos_status_t *s, aos_http_controller_t *ctl)
+{
+	oss_window_outcome outcome = OSS_WINDOW_OK;
+	int64		ttfb = 0;
+
+	if (ctl->cancel != NULL && *ctl->cancel)
+		outcome = OSS_WINDOW_NEUTRAL;
+	else if (s == NULL || (!aos_status_is_ok(s) && (aos_should_retry(s) == 1 || oss_retry_throttled(s))))
+		outcome = OSS_WINDOW_CONGESTED;
+
+	/* the first byte of an upload comes after its body, it says nothing of the latency */
+	if (ctl->first_byte_time > 0 && !retry->upload)
+		ttfb = ctl->first_byte_time - ctl->start_time;
+
+	oss_host_window_leave(retry->window_slot, outcome, ttfb);
+	retry->window_slot = -1;
+}
+
+/* OSS sheds load with 503 SlowDown, other S3 like stores with 429 */
+static bool
+oss_retry_throttled(aos_status_t *s)
+{
+	return s != NULL &&
+		(s->code == OSS_HTTP_TOO_MANY_REQUESTS || s->code == OSS_HTTP_SERVICE_UNAVAILABLE);
+}
+
+/*
+ * The Retry-After of the response in msec, 0 when there is none. Only the
+ * delay in seconds is understood, not the HTTP date.
+ */
+static int
+oss_retry_after(aos_table_t *resp_headers)
+{
+	const char *value;
+	int			seconds;
+
+	if (resp_headers == NULL)
+		return 0;
+
+	value = apr_table_get(resp_headers, "Retry-After");
+	if (value == NULL)
+		return 0;
+
+	seconds = atoi(value);
+	if (seconds <= 0)
+		return 0;
+
+	return Min((int64) seconds * 1000, OSS_RETRY_AFTER_MAX_MSEC);
+}
@@ -0,0 +1,409 @@
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "cdb/cdbvars.h"
+#include "postmaster/postmaster.h"
+#include "utils/memutils.h"
+
+#include "ossapi.h"
+#include "oss_host.h"
+#include "oss_gzindex.h"
+#include "oss_workqueue.h"
+
+static int64 oss_wq_line_end(ext_oss_t *myData, oss_workqueue *wq, oss_file *file, int64 pos);
+static void oss_wq_free_indexes(oss_gzindex **indexes, int nfiles);
+static uint32 oss_wq_cluster(void);
+
+/* scans of this process in the current command, in executor order */
+static int32 oss_wq_command = -1;
+static int32 oss_wq_seq = 0;
+
+/*
+ * Share the files of the scan with the other segments of the host, and cut
+ * the indexed gzip files at their checkpoints. Called from the backend with
+ * the whole file list, before the static assignment. Returns false when
+ * there is no point in the queue, the caller then assigns the files
+ * statically.
+ */
+bool
+oss_workqueue_start(ext_oss_t *myData, List *files)
+{
+	oss_workqueue *wq;
+	oss_host_scan_key key;
+	oss_gzindex **indexes = NULL;
+	ListCell   *lc;
+	int			nfiles = list_length(files);
+	int64		split = 0;
+	int			stride = 1;
+	int			nunits;
+	int			scan = -1;
+	int			i;
+	int			u;
+
+	if (nfiles == 0 || nfiles > OSS_HOST_SCAN_MAX_UNITS)
+		return false;
+
+	/* lines can only be found in plain text */
+	if (myData->file_opt.type == OSS_COMPRESSION_NONE)
+		split = myData->split_size * 1024 * 1024;
+
+	/*
+	 * Every segment must cut the same units, so the empty files are looked
+	 * at by all of them, not only by the one they are assigned to.
+	 */
+	foreach(lc, files)
+	{
+		oss_file   *file = (oss_file *) lfirst(lc);
+
+		if (file->length == 0)
+			file->length = oss_get_file_length(&myData->conn, file->filename, myData->ro);
+	}
+
+	/* a gzip file smaller than the span has nothing to split at */
+	if (myData->gzip_index && myData->file_opt.type == OSS_COMPRESSION_GZIP)
+	{
+		indexes = MemoryContextAllocZero(myData->ctx, sizeof(oss_gzindex *) * nfiles);
+		i = 0;
+		foreach(lc, files)
+		{
+			oss_file   *file = (oss_file *) lfirst(lc);
+
+			if (file->length > OSS_GZINDEX_SPAN)
+				indexes[i] = oss_gzindex_load(&myData->conn, file->filename, file->length, myData->ro);
+			i++;
+		}
+	}
+
+	for (;;)
+	{
+		nunits = 0;
+		i = 0;
+		foreach(lc, files)
+		{
+			oss_file   *file = (oss_file *) lfirst(lc);
+
+			if (indexes != NULL && indexes[i] != NULL)
+				nunits += indexes[i]->npoints / stride + 1;
+			else if (split > 0 && file->length > split)
+				nunits += (file->length + split - 1) / split;
+			else
+				nunits++;
+			i++;
+
+			if (nunits > OSS_HOST_SCAN_MAX_UNITS)
+				break;
+		}
+
+		if (nunits <= OSS_HOST_SCAN_MAX_UNITS)
+			break;
+
+		/* too many ranges for the host state, cut larger ones */
+		split *= 2;
+		stride *= 2;
+	}
+
+	if (oss_wq_command != gp_command_count)
+	{
+		oss_wq_command = gp_command_count;
+		oss_wq_seq = 0;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.cluster = oss_wq_cluster();
+	key.session_id = gp_session_id;
+	key.command_id = gp_command_count;
+	key.slice_id = currentSliceId;
+	key.relid = myData->relid;
+	key.seq = oss_wq_seq++;
+
+	if (myData->work_stealing)
+		scan = oss_host_scan_attach(&key, myData->segindex, nunits);
+
+	/*
+	 * Without the host scan the files are assigned statically, which is
+	 * what the owners of whole files are. Files cut into ranges are read
+	 * from the unit list then as well, or the segments which got the host
+	 * scan would read the ranges of another assignment.
+	 */
+	if (scan < 0 && indexes == NULL && split == 0)
+	{
+		elog(DEBUG1, "oss work queue is not available, files are assigned statically");
+		return false;
+	}
+
+	wq = MemoryContextAllocZero(myData->ctx, sizeof(oss_workqueue));
+	wq->shared = (scan >= 0);
+	wq->scan = scan;
+	wq->cursor = 0;
+	wq->indexes = indexes;
+	wq->build = (indexes != NULL);
+	wq->nfiles = nfiles;
+	wq->files = MemoryContextAlloc(myData->ctx, sizeof(oss_file) * nfiles);
+	wq->nunits = nunits;
+	wq->units = MemoryContextAlloc(myData->ctx, sizeof(oss_wq_unit) * nunits);
+	wq->owners = MemoryContextAlloc(myData->ctx, sizeof(int32) * nunits);
+
+	i = 0;
+	u = 0;
+	foreach(lc, files)
+	{
+		oss_file   *file = (oss_file *) lfirst(lc);
+		int64		start = 0;
+
+		wq->files[i].filename = MemoryContextStrdup(myData->ctx, file->filename);
+		wq->files[i].length = file->length;
+
+		if (indexes != NULL && indexes[i] != NULL)
+		{
+			oss_gzindex *index = indexes[i];
+			int			point = -1;
+			int			k;
+
+			for (k = stride - 1; k < index->npoints; k += stride)
+			{
+				wq->units[u].file = i;
+				wq->units[u].point = point;
+				wq->units[u].start = start;
+				wq->units[u].end = index->points[k].out;
+				wq->owners[u] = u % myData->numsegments;
+				start = index->points[k].out;
+				point = k;
+				u++;
+			}
+
+			wq->units[u].file = i;
+			wq->units[u].point = point;
+			wq->units[u].start = start;
+			wq->units[u].end = -1;
+			wq->owners[u] = u % myData->numsegments;
+			u++;
+			i++;
+			continue;
+		}
+
+		/*
+		 * A whole file keeps the owner of the static assignment, by its
+		 * index in the list; ranges go round robin so that one large file
+		 * is spread over the segments.
+		 */
+		do
+		{
+			wq->units[u].file = i;
+			wq->units[u].point = -1;
+			wq->units[u].start = start;
+			wq->units[u].end = (split > 0) ? Min(start + split, file->length) : file->length;
+			if (start == 0 && wq->units[u].end >= file->length)
+				wq->owners[u] = i % myData->numsegments;
+			else
+				wq->owners[u] = u % myData->numsegments;
+			start = wq->units[u].end;
+			u++;
+		} while (start < file->length);
+
+		i++;
+	}
+	Assert(u == nunits);
+
+	if (split > 0)
+	{
+		oss_buffer_grant(myData, OSS_WQ_PROBE_SIZE, OSS_WQ_PROBE_SIZE);
+		wq->probe = MemoryContextAlloc(myData->ctx, OSS_WQ_PROBE_SIZE);
+	}
+
+	myData->workqueue = wq;
+
+	elog(DEBUG1, "oss work queue of %d units from %d files, split size " int64_FMT ", %s",
+		 nunits, nfiles, split, wq->shared ? "shared" : "not shared");
+
+	return true;
+}
+
+/*
+ * The cluster the scan runs in, by the address of its coordinator. The
+ * host state is shared by every segment the os user runs on the host, so
+ * two clusters of the user would otherwise meet there with the same
+ * session ids and relids, and claim the units of each other.
+ */
+static uint32
+oss_wq_cluster(void)
+{
+	char		buf[MAXPGPATH];
+
+	if (qdHostname != NULL && qdHostname[0] != '\0')
+		snprintf(buf, sizeof(buf), "%s:%d", qdHostname, qdPostmasterPort);
+	else
+		snprintf(buf, sizeof(buf), ":%d", PostPortNumber);
+
+	return DatumGetUInt32(hash_any((const unsigned char *) buf, strlen(buf)));
+}
+
+/*
+ * Claim the next unit and make it the current file of the scan. Called from
+ * oss_next_file(), in the backend or in the read thread, so errors are left
+ * in myData->errmsg with a negative length for the reader to raise.
+ */
+void
+oss_workqueue_next(ext_oss_t *myData)
+{
+	oss_workqueue *wq = myData->workqueue;
+	oss_wq_unit *unit;
+	oss_file   *file;
+	bool		stolen;
+	int			n;
+	int64		begin;
+	int64		end;
+
+	myData->currentfile = NULL;
+	myData->offset = 0;
+	myData->length = -1;
+	myData->gz_point = NULL;
+	myData->gz_end = -1;
+	myData->gz_build = false;
+
+	if (wq->shared)
+	{
+		if (wq->scan < 0)
+			return;
+
+		n = oss_host_scan_claim(wq->scan, myData->segindex, wq->owners, wq->nunits, &stolen);
+		if (n < 0)
+		{
+			/* nothing left, let the others know sooner rather than at the end */
+			oss_host_scan_detach(wq->scan);
+			wq->scan = -1;
+			return;
+		}
+	}
+	else
+	{
+		for (n = wq->cursor; n < wq->nunits && wq->owners[n] != myData->segindex; n++)
+			;
+		if (n >= wq->nunits)
+			return;
+		wq->cursor = n + 1;
+		stolen = false;
+	}
+
+	wq->claimed++;
+	if (stolen)
+		wq->stolen++;
+
+	unit = &wq->units[n];
+	file = &wq->files[unit->file];
+
+	myData->currentfile = file->filename;
+
+	/* the decompressor starts at the checkpoint and cuts the range itself */
+	if (wq->indexes != NULL && wq->indexes[unit->file] != NULL)
+	{
+		oss_gz_point *point = NULL;
+
+		if (unit->point >= 0)
+		{
+			point = &wq->indexes[unit->file]->points[unit->point];
+			myData->offset = point->in - (point->bits ? 1 : 0);
+		}
+
+		myData->gz_point = point;
+		myData->gz_end = unit->end;
+		myData->length = file->length;
+		return;
+	}
+
+	if (unit->start == 0 && unit->end >= file->length)
+	{
+		myData->length = file->length;
+		myData->gz_build = wq->build && file->length > OSS_GZINDEX_SPAN;
+		return;
+	}
+
+	begin = oss_wq_line_end(myData, wq, file, unit->start);
+	end = (begin < 0) ? -1 : oss_wq_line_end(myData, wq, file, unit->end);
+	if (end < 0)
+	{
+		snprintf(myData->errmsg, ERROR_MESSAGE_LEN, "%s", wq->errmsg);
+		return;
+	}
+
+	/* the reader takes length as the end of the range, offset as its start */
+	myData->offset = begin;
+	myData->length = end;
+}
+
+/*
+ * Offset of the line starting at or after pos, that is after the first
+ * newline at or after pos - 1. Returns -1 with wq->errmsg set on error.
+ */
+static int64
+oss_wq_line_end(ext_oss_t *myData, oss_workqueue *wq, oss_file *file, int64 pos)
+{
+	int64		off;
+
+	if (pos <= 0)
+		return 0;
+
+	for (off = pos - 1; off < file->length;)
+	{
+		int64		len = Min((int64) OSS_WQ_PROBE_SIZE, file->length - off);
+		char	   *nl;
+		size_t		n;
+
+		wq->errmsg[0] = '\0';
+		n = oss_read_buffer(&myData->conn, file->filename, wq->probe, off, len,
+							true, wq->errmsg, myData->ro);
+		if (wq->errmsg[0] != '\0')
+			return -1;
+
+		if (n == 0)
+		{
+			snprintf(wq->errmsg, ERROR_MESSAGE_LEN,
+					 "oss_import: could not read file \"%s\" at offset " int64_FMT,
+					 file->filename, off);
+			return -1;
+		}
+
+		nl = memchr(wq->probe, '\n', n);
+		if (nl != NULL)
+			return off + (nl - wq->probe) + 1;
+
+		off += n;
+	}
+
+	return file->length;
+}
+
+void
+oss_workqueue_stop(ext_oss_t *myData)
+{
+	oss_workqueue *wq = myData->workqueue;
+
+	if (wq == NULL)
+		return;
+
+	if (wq->scan >= 0)
+	{
+		oss_host_scan_detach(wq->scan);
+		wq->scan = -1;
+	}
+
+	elog(DEBUG1, "oss work queue: " int64_FMT " units read, " int64_FMT " of them stolen",
+		 wq->claimed, wq->stolen);
+
+	if (wq->indexes != NULL)
+		oss_wq_free_indexes(wq->indexes, wq->nfiles);
+
+	myData->gz_point = NULL;
+	myData->workqueue = NULL;
+}
+
+static void
+oss_wq_free_indexes(oss_gzindex **indexes, int nfiles)
+{
+	int			i;
+
+	for (i = 0; i < nfiles; i++)
+	{
+		oss_gzindex_free(indexes[i]);
+		indexes[i] = NULL;
+	}
+}
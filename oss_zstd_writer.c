@@ -0,0 +1,509 @@
+#include "postgres.h"
+
+#include <zstd.h>
+
+#include "utils/memutils.h"
+
+#include "ossapi.h"
+#include "compress_writer.h"
+#include "oss_zstd_writer.h"
+
+/*
+ * Upper bound of the input zstd holds before its output comes out: a job of
+ * a few windows for every worker plus the one being filled.
+ */
+#define ZSTD_JOB_SIZE					(8 * 1024 * 1024)
+#define ZSTD_INFLIGHT_SIZE(nworkers)	(((int64) (nworkers) + 1) * ZSTD_JOB_SIZE)
+
+/*
+ * State of a zstd export stream. The backend compresses into out with the
+ * workers of libzstd, a full out is handed to the upload thread, which
+ * appends it to the oss file while the backend fills the other buffer.
+ */
+typedef struct oss_zstd_state
+{
+	ZSTD_CCtx  *cctx;
+	int			nworkers;
+	int			level;
+	bool		adaptive;
+
+	char	   *out;
+	int64		out_pos;
+	int64		out_size;
+	int64		file_compressed;	/* handed to the upload thread */
+
+	pthread_t	th_upload;
+	bool		started;
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;		/* the upload buffer changed hands, or stop */
+	bool		stop;
+	char	   *upload;
+	int64		upload_len;		/* 0 when the buffer is free */
+	char		upload_file[OSS_MAX_FILE_PATH];
+	oss_connect	conn;
+	oss_request_options	ro;
+	bool		error;
+	char		error_msg[ERROR_MESSAGE_LEN];
+
+	/* what the backend waited on in the current adaptive period, ms */
+	TimevalStruct	period_start;
+	double		wait_upload;
+	double		wait_compress;
+	int			level_changes;
+} oss_zstd_state;
+
+static size_t zstd_write(void *selfp, void *buffer, size_t request_len);
+static void zstd_writer_close(void *selfp);
+static bool zstd_file_is_full(ext_oss_t *myData, size_t request_len);
+static void zstd_compress_chain(ext_oss_t *myData, ZSTD_EndDirective end);
+static void zstd_compress_iov(ext_oss_t *myData, struct iovec *iov, int iovcnt, ZSTD_EndDirective end);
+static void zstd_handoff(ext_oss_t *myData);
+static void zstd_wait_upload(oss_zstd_state *zs);
+static void zstd_finish_file(ext_oss_t *myData);
+static void zstd_adapt_level(oss_zstd_state *zs);
+static void zstd_stop_upload(oss_zstd_state *zs);
+static void *oss_zstd_upload_main(void *arg);
+
+/*
+ * Compress the export with num_parallel_worker zstd threads in process, the
+ * first oss file has been named by the caller.
+ */
+int
+init_zstd_writer(ext_oss_t *self)
+{
+	oss_zstd_state *zs;
+	size_t		rc;
+
+	zs = MemoryContextAllocZero(self->ctx, sizeof(oss_zstd_state));
+	zs->level = self->write_opt.compression_level;
+	zs->adaptive = self->write_opt.adaptive_level;
+	zs->nworkers = self->write_opt.nthread;
+	zs->conn = self->conn;
+	zs->ro = self->ro;
+
+	/* the backend fills one buffer of self->size while the other is uploaded */
+	self->size = oss_buffer_grant(self, 2 * (int64) self->write_opt.flush_block,
+								2 * OSS_FLUSH_BUF_MIN_SIZE) / 2;
+	zs->out_size = self->size;
+	zs->out = MemoryContextAlloc(self->ctx, zs->out_size);
+	zs->upload = MemoryContextAlloc(self->ctx, zs->out_size);
+
+	self->write_opt.pipe_block_size = oss_buffer_grant(self, self->write_opt.pipe_block_size,
+													MIN_PIPE_BLOCK_SIZE);
+	oss_write_chain_init(&self->chain, self->write_opt.pipe_block_size,
+						Min(self->write_opt.pipe_block_size, OSS_WRITE_CHUNK_SIZE), self->ctx);
+
+	zs->cctx = ZSTD_createCCtx();
+	if (zs->cctx == NULL)
+		elog(ERROR, "out of memory");
+
+	rc = ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_compressionLevel, zs->level);
+	if (ZSTD_isError(rc))
+		elog(ERROR, "could not set zstd compression level %d: %s", zs->level, ZSTD_getErrorName(rc));
+
+	ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_checksumFlag, 1);
+
+	/*
+	 * Even one worker takes the compression off the backend. A libzstd built
+	 * without threads compresses in the backend, at a fixed level since the
+	 * level can only change within a frame when there are workers.
+	 */
+	rc = ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_nbWorkers, zs->nworkers);
+	if (ZSTD_isError(rc))
+	{
+		elog(DEBUG1, "libzstd has no worker threads, compressing in the backend: %s",
+			 ZSTD_getErrorName(rc));
+		zs->nworkers = 0;
+		zs->adaptive = false;
+	}
+
+	pthread_mutex_init(&zs->lock, NULL);
+	pthread_cond_init(&zs->cond, NULL);
+
+	self->com_hd = (void *) zs;
+	self->base.write = (SourceWriteProc) zstd_write;
+	self->base.close = (SourceCloseProc) zstd_writer_close;
+
+	if (pthread_create(&zs->th_upload, NULL, oss_zstd_upload_main, zs) != 0)
+		elog(ERROR, "oss writer thread start fail");
+	zs->started = true;
+
+	GETTIMEOFDAY(&zs->period_start);
+	self->errmsg[0] = 0;
+
+	return 0;
+}
+
+static size_t
+zstd_write(void *selfp, void *buffer, size_t request_len)
+{
+	ext_oss_t  *myData = (ext_oss_t *) selfp;
+
+	if (request_len <= 0)
+	{
+		return 0;
+	}
+
+	myData->write_row_count++;
+	myData->write_byte_count += request_len;
+
+	if (zstd_file_is_full(myData, request_len))
+	{
+		zstd_finish_file(myData);
+		oss_wirte_next_file(myData);
+		myData->file_flush_offset = 0;
+	}
+
+	if ((myData->chain.len + request_len) > myData->write_opt.pipe_block_size)
+	{
+		zstd_compress_chain(myData, ZSTD_e_continue);
+	}
+
+	if (request_len > myData->write_opt.pipe_block_size)
+	{
+		struct iovec	iov;
+
+		/* one big row is compressed straight from the executor's buffer */
+		iov.iov_base = buffer;
+		iov.iov_len = request_len;
+		zstd_compress_iov(myData, &iov, 1, ZSTD_e_continue);
+	}
+	else
+	{
+		oss_write_chain_append(&myData->chain, buffer, request_len);
+	}
+	myData->file_flush_offset += request_len;
+
+	return request_len;
+}
+
+/*
+ * Like the pigz stream, the oss file is rolled over on its compressed size,
+ * the input still inside zstd being estimated with the ratio so far. The
+ * jobs of zstd are much larger than the pipe of pigz and how much of them is
+ * through is not known, so the ratio is taken over all the input, which is
+ * a lower bound; the file ends up at most a few jobs worth of output over.
+ */
+static bool
+zstd_file_is_full(ext_oss_t *myData, size_t request_len)
+{
+	oss_zstd_state *zs = (oss_zstd_state *) myData->com_hd;
+	int64		compressed = zs->file_compressed + zs->out_pos;
+	int64		inflight = ZSTD_INFLIGHT_SIZE(zs->nworkers) + myData->chain.len;
+	double		ratio;
+
+	if (compressed == 0)
+	{
+		return false;
+	}
+
+	inflight = Min(inflight, myData->file_flush_offset);
+	ratio = Min((double) compressed / myData->file_flush_offset, 1.0);
+
+	return compressed + (inflight + request_len) * ratio > myData->write_opt.file_max_size;
+}
+
+static void
+zstd_compress_chain(ext_oss_t *myData, ZSTD_EndDirective end)
+{
+	struct iovec   *iov = NULL;
+	int				iovcnt = 0;
+
+	if (myData->chain.len > 0)
+	{
+		iovcnt = oss_write_chain_iov(&myData->chain, &iov);
+	}
+
+	zstd_compress_iov(myData, iov, iovcnt, end);
+	oss_write_chain_reset(&myData->chain);
+}
+
+/*
+ * Feed the vector to zstd. With ZSTD_e_end the frame is completed, which
+ * takes calls until zstd has nothing left to flush.
+ */
+static void
+zstd_compress_iov(ext_oss_t *myData, struct iovec *iov, int iovcnt, ZSTD_EndDirective end)
+{
+	oss_zstd_state *zs = (oss_zstd_state *) myData->com_hd;
+	TimevalStruct	before, after;
+	double			elapsed_msec = 0;
+	int				i;
+
+	GETTIMEOFDAY(&before);
+
+	for (i = 0; i < iovcnt || (i == iovcnt && end == ZSTD_e_end); i++)
+	{
+		ZSTD_inBuffer	in;
+		ZSTD_EndDirective	mode = (i >= iovcnt - 1) ? end : ZSTD_e_continue;
+
+		in.src = (i < iovcnt) ? iov[i].iov_base : NULL;
+		in.size = (i < iovcnt) ? iov[i].iov_len : 0;
+		in.pos = 0;
+
+		for (;;)
+		{
+			ZSTD_outBuffer	out;
+			size_t		remaining;
+
+			if (zs->out_pos == zs->out_size)
+			{
+				GETTIMEOFDAY(&after);
+				DIFF_MSEC(&after, &before, elapsed_msec);
+				zs->wait_compress += elapsed_msec;
+
+				zstd_handoff(myData);
+
+				GETTIMEOFDAY(&before);
+			}
+
+			out.dst = zs->out;
+			out.size = zs->out_size;
+			out.pos = zs->out_pos;
+
+			remaining = ZSTD_compressStream2(zs->cctx, &out, &in, mode);
+			zs->out_pos = out.pos;
+
+			if (ZSTD_isError(remaining))
+			{
+				/* the frame is broken, close must not try to end it */
+				snprintf(zs->error_msg, ERROR_MESSAGE_LEN, "zstd compression of %s failed: %s",
+						 myData->currentfile, ZSTD_getErrorName(remaining));
+				zs->error = true;
+				zstd_stop_upload(zs);
+				elog(ERROR, "%s", zs->error_msg);
+			}
+
+			if (mode == ZSTD_e_end ? remaining == 0 : in.pos == in.size)
+				break;
+		}
+
+		if (mode == ZSTD_e_end)
+			break;
+	}
+
+	GETTIMEOFDAY(&after);
+	DIFF_MSEC(&after, &before, elapsed_msec);
+	zs->wait_compress += elapsed_msec;
+	myData->flush_data_timer += elapsed_msec;
+}
+
+/*
+ * Give out to the upload thread, taking back the buffer it is done with.
+ */
+static void
+zstd_handoff(ext_oss_t *myData)
+{
+	oss_zstd_state *zs = (oss_zstd_state *) myData->com_hd;
+	char	   *buf;
+
+	if (zs->out_pos == 0)
+		return;
+
+	zstd_wait_upload(zs);
+
+	pthread_mutex_lock(&zs->lock);
+	buf = zs->upload;
+	zs->upload = zs->out;
+	zs->upload_len = zs->out_pos;
+	snprintf(zs->upload_file, OSS_MAX_FILE_PATH, "%s", myData->currentfile);
+	pthread_cond_broadcast(&zs->cond);
+	pthread_mutex_unlock(&zs->lock);
+
+	zs->out = buf;
+	zs->file_compressed += zs->out_pos;
+	zs->out_pos = 0;
+
+	if (zs->adaptive)
+		zstd_adapt_level(zs);
+}
+
+/*
+ * Wait for the upload thread to be done with its buffer.
+ */
+static void
+zstd_wait_upload(oss_zstd_state *zs)
+{
+	TimevalStruct	before, after;
+	double			elapsed_msec = 0;
+
+	GETTIMEOFDAY(&before);
+
+	pthread_mutex_lock(&zs->lock);
+	while (zs->upload_len > 0 && !zs->error)
+	{
+		pthread_cond_wait(&zs->cond, &zs->lock);
+	}
+	pthread_mutex_unlock(&zs->lock);
+
+	GETTIMEOFDAY(&after);
+	DIFF_MSEC(&after, &before, elapsed_msec);
+	zs->wait_upload += elapsed_msec;
+
+	if (zs->error)
+	{
+		zstd_stop_upload(zs);
+		elog(ERROR, "%s", zs->error_msg);
+	}
+}
+
+/*
+ * End the frame of the current oss file and wait for all of it to be
+ * uploaded. The next file starts a new frame.
+ */
+static void
+zstd_finish_file(ext_oss_t *myData)
+{
+	oss_zstd_state *zs = (oss_zstd_state *) myData->com_hd;
+
+	zstd_compress_chain(myData, ZSTD_e_end);
+	zstd_handoff(myData);
+	zstd_wait_upload(zs);
+
+	elog(DEBUG1, "finish oss file %s, wrote " int64_FMT " byte, compressed " int64_FMT " byte at level %d",
+		 myData->currentfile, myData->file_flush_offset, zs->file_compressed, zs->level);
+
+	zs->file_compressed = 0;
+}
+
+/*
+ * When the backend mostly waits for the upload thread the link is the
+ * bottleneck, and cpu is spent on a higher level to send less. When it
+ * mostly waits for the zstd workers they are, and the level goes down.
+ * Time spent in the executor counts for neither.
+ */
+static void
+zstd_adapt_level(oss_zstd_state *zs)
+{
+	TimevalStruct	now;
+	double		period = 0;
+	int			level = zs->level;
+	size_t		rc;
+
+	GETTIMEOFDAY(&now);
+	DIFF_MSEC(&now, &zs->period_start, period);
+	if (period < ZSTD_ADAPT_PERIOD_MSEC)
+		return;
+
+	if (zs->wait_upload > period * ZSTD_ADAPT_WAIT_RATIO &&
+		zs->wait_upload > zs->wait_compress)
+	{
+		level = Min(level + 1, MAX_ZSTD_ADAPTIVE_LEVEL);
+	}
+	else if (zs->wait_compress > period * ZSTD_ADAPT_WAIT_RATIO)
+	{
+		level = Max(level - 1, MIN_ZSTD_COMPRESS_LEVEL);
+	}
+
+	zs->period_start = now;
+	zs->wait_upload = 0;
+	zs->wait_compress = 0;
+
+	if (level == zs->level)
+		return;
+
+	/* with workers the new level applies from the next job of the frame */
+	rc = ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_compressionLevel, level);
+	if (ZSTD_isError(rc))
+	{
+		elog(DEBUG1, "could not change zstd level to %d, keeping %d: %s",
+			 level, zs->level, ZSTD_getErrorName(rc));
+		zs->adaptive = false;
+		return;
+	}
+
+	elog(DEBUG1, "zstd compression level %d -> %d", zs->level, level);
+	zs->level = level;
+	zs->level_changes++;
+}
+
+static void
+zstd_writer_close(void *selfp)
+{
+	ext_oss_t  *myData = (ext_oss_t *) selfp;
+	oss_zstd_state *zs = (oss_zstd_state *) myData->com_hd;
+
+	if (zs == NULL)
+		return;
+
+	if (!zs->error)
+		zstd_finish_file(myData);
+
+	zstd_stop_upload(zs);
+
+	if (zs->error)
+		elog(ERROR, "%s", zs->error_msg);
+
+	elog(DEBUG1, "oss zstd compress end, wrote row " int64_FMT ", " int64_FMT " byte cost %.3f ms, "
+		 "level %d after %d changes",
+		 myData->write_row_count, myData->write_byte_count, myData->flush_data_timer,
+		 zs->level, zs->level_changes);
+}
+
+static void
+zstd_stop_upload(oss_zstd_state *zs)
+{
+	if (zs->started)
+	{
+		pthread_mutex_lock(&zs->lock);
+		zs->stop = true;
+		pthread_cond_broadcast(&zs->cond);
+		pthread_mutex_unlock(&zs->lock);
+
+		pthread_join(zs->th_upload, NULL);
+		zs->started = false;
+
+		pthread_cond_destroy(&zs->cond);
+		pthread_mutex_destroy(&zs->lock);
+	}
+
+	if (zs->cctx != NULL)
+	{
+		ZSTD_freeCCtx(zs->cctx);
+		zs->cctx = NULL;
+	}
+}
+
+static void *
+oss_zstd_upload_main(void *arg)
+{
+	oss_zstd_state *zs = (oss_zstd_state *) arg;
+	char		msg[ERROR_MESSAGE_LEN];
+
+	for (;;)
+	{
+		bool		ok;
+
+		pthread_mutex_lock(&zs->lock);
+		while (zs->upload_len == 0 && !zs->stop)
+		{
+			pthread_cond_wait(&zs->cond, &zs->lock);
+		}
+
+		if (zs->upload_len == 0)
+		{
+			pthread_mutex_unlock(&zs->lock);
+			break;
+		}
+		pthread_mutex_unlock(&zs->lock);
+
+		msg[0] = '\0';
+		ok = oss_append_file_from_buffer(&zs->conn, zs->upload_file, zs->upload, zs->upload_len,
+										false, 0, zs->ro, true, msg);
+
+		pthread_mutex_lock(&zs->lock);
+		zs->upload_len = 0;
+		if (!ok)
+		{
+			snprintf(zs->error_msg, ERROR_MESSAGE_LEN, "%s", msg);
+			zs->error = true;
+		}
+		pthread_cond_broadcast(&zs->cond);
+		pthread_mutex_unlock(&zs->lock);
+
+		if (!ok)
+			break;
+	}
+
+	return NULL;
+}
@@ -15,6 +15,11 @@
 #include "lib/aos_log.h"
 #include "lib/aos_list.h"
 #include "decompress_reader.h"
+#include "oss_host.h"
+#include "oss_prefetch.h"
+#include "oss_workqueue.h"
+#include "oss_retry.h"
+#include "oss_endpoint.h"
 
 #ifdef HAVE_LONG_INT_64
 #define int64_FMT			   "%ld"
@@ -28,8 +33,6 @@
 #define		OSS_NEXT_APPEND_POSITION		"x-oss-next-append-position"
 #define		OSS_ERROR_FILE_NOT_EXIST		404
 
-#define OSS_RETRY_COUNT		30
-
 #define MAX_RANGE_STR_LEN	64
 #define MAX_RANGE_STR	"bytes="int64_FMT"-"int64_FMT""
 #define ERROR_MESSAGE_LEN	1024
@@ -44,21 +47,33 @@ typedef struct oss_import_detail
 
 oss_import_detail	import_detail;
 
-static aos_status_t *oss_get_file_metainfo(aos_pool_t * p, oss_request_options_t * options,
+/*
+ * The GETs of a thread go mostly to one object, range after range; its
+ * host, uri, canonical resource and url are built once for all of them.
+ */
+static __thread oss_object_template_t oss_read_template;
+
+static aos_status_t *oss_get_file_metainfo(oss_connect *conn, aos_pool_t * p, oss_request_options_t * options,
 							aos_table_t ** resp_headers, aos_string_t bucket, aos_string_t object,
 							bool async, char *msg);
 static oss_request_options_t *oss_init_options(aos_pool_t * p, char *host, char *id, char *key, bool async, char *msg, oss_request_options ro);
-static int oss_api_throw_exception(aos_pool_t *p, aos_status_t *s, char *object, int retrycount, bool async, char *msg, char *api);
+static int oss_api_throw_exception(aos_pool_t *p, aos_status_t *s, char *object, oss_retry *retry, bool async, char *msg, char *api);
 static void set_oss_request_options(oss_request_options_t *options, oss_request_options ro);
 static void set_oss_import_ossfile(char *ossfile);
+static size_t oss_read_object_buffer(oss_connect *conn, char *filename, void *buffer, int64 offset, size_t len,
+				bool ranged, bool async, char *msg, oss_request_options ro, oss_read_timing *timing,
+				volatile int *cancel);
+static bool oss_content_range(aos_table_t *resp_headers, int64 *start, int64 *end);
+static int64 oss_copy_buf_list(aos_list_t *list, char *buf, int64 len);
 
 static int
-oss_api_throw_exception(aos_pool_t *p, aos_status_t *s, char *object, int retrycount, bool async, char *msg, char *api)
+oss_api_throw_exception(aos_pool_t *p, aos_status_t *s, char *object, oss_retry *retry, bool async, char *msg, char *api)
 {
 	int 	code = -1;
 	char	*error_code = "unknown";
 	char	*error_msg = "unknown";
 	char	*req_id = "-1";
+	const char *denied = "";
 
 	if (s != NULL)
 	{
@@ -70,18 +85,20 @@ oss_api_throw_exception(aos_pool_t *p, aos_status_t *s, char *object, int retryc
 		if (s->req_id != NULL)
 			req_id = s->req_id;
 	}
+	if (retry->denied != NULL)
+		denied = retry->denied;
 
 	if (async)
 	{
-		snprintf(msg, ERROR_MESSAGE_LEN, "object %s %s failed: code %d error_code %s error_msg %s req_id %s, retry %d/%d",
-			object, api, code, error_code, error_msg, req_id, retrycount, OSS_RETRY_COUNT);
+		snprintf(msg, ERROR_MESSAGE_LEN, "object %s %s failed: code %d error_code %s error_msg %s req_id %s, retry %d/%d %s",
+			object, api, code, error_code, error_msg, req_id, retry->attempt, OSS_RETRY_COUNT, denied);
 		aos_pool_destroy(p);
 		return 0;
 	}
 	else
 	{
-		elog(WARNING, "object %s %s failed: code %d error_code %s error_msg %s req_id %s, retry %d/%d",
-			object, api, code, error_code, error_msg, req_id, retrycount, OSS_RETRY_COUNT);
+		elog(WARNING, "object %s %s failed: code %d error_code %s error_msg %s req_id %s, retry %d/%d %s",
+			object, api, code, error_code, error_msg, req_id, retry->attempt, OSS_RETRY_COUNT, denied);
 		aos_pool_destroy(p);
 		elog(ERROR, "ossapi %s call failure", api);
 	}
@@ -97,6 +114,9 @@ oss_env_init(void)
 		elog(ERROR, "aos_http_io_initialize failure.");
 	}
 	aos_log_set_level(AOS_LOG_OFF);
+	aos_buf_pool_set_max_idle((int64) oss_host_body_pool_size * 1024 * 1024);
+
+	oss_host_attach();
 
 	return;
 }
@@ -131,7 +151,7 @@ oss_get_file_length(oss_connect *conn, char *filename, oss_request_options ro)
 		elog(ERROR, "aos_table_make failure.");
 	}
 
-	s = oss_get_file_metainfo(p, options, &resp_headers, bucket, object, false, NULL);
+	s = oss_get_file_metainfo(conn, p, options, &resp_headers, bucket, object, false, NULL);
 	if (s != NULL && aos_status_is_ok(s))
 	{
 		filestr = (char *) apr_table_get(resp_headers, OSS_CONTENT_LENGTH);
@@ -157,9 +177,111 @@ oss_get_file_length(oss_connect *conn, char *filename, oss_request_options ro)
 	return filelength;
 }
 
+/*
+ * The length and ETag of filename from a HEAD request, *length is -1 when
+ * there is no such object. Returns false when the request failed, with the
+ * error in msg when async.
+ */
+bool
+oss_get_file_etag(oss_connect *conn, char *filename, int64 *length, char *etag, int etag_len,
+				  bool async, char *msg, oss_request_options ro)
+{
+	aos_pool_t *p = NULL;
+	aos_string_t bucket;
+	aos_string_t object;
+	oss_request_options_t *options = NULL;
+	aos_status_t *s = NULL;
+	aos_table_t *resp_headers = NULL;
+	const char *value;
+
+	*length = -1;
+	etag[0] = '\0';
+
+	if (aos_pool_create(&p, NULL) != APR_SUCCESS)
+	{
+		if (async)
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN, "aos_pool_create failure.");
+			return false;
+		}
+		else
+		{
+			elog(ERROR, "aos_pool_create failure.");
+		}
+	}
+
+	/* these destroy the pool when they fail */
+	options = oss_init_options(p, conn->osshost, conn->ossid, conn->osskey, async, msg, ro);
+	if (options == NULL)
+		return false;
+
+	aos_str_set(&bucket, conn->bucket);
+	aos_str_set(&object, filename);
+
+	s = oss_get_file_metainfo(conn, p, options, &resp_headers, bucket, object, async, msg);
+	if (s == NULL)
+		return false;
+
+	if (aos_status_is_ok(s))
+	{
+		value = apr_table_get(resp_headers, OSS_CONTENT_LENGTH);
+		if (value != NULL)
+			*length = atol(value);
+		value = apr_table_get(resp_headers, "ETag");
+		if (value != NULL)
+			snprintf(etag, etag_len, "%s", value);
+	}
+
+	aos_pool_destroy(p);
+
+	return true;
+}
+
 size_t
 oss_read_buffer(oss_connect *conn, char *filename, void *buffer, int64 offset, size_t len,
 				bool async, char *msg, oss_request_options ro)
+{
+	return oss_read_object_buffer(conn, filename, buffer, offset, len, true, async, msg, ro, NULL, NULL);
+}
+
+/*
+ * oss_read_buffer() which also tells how long the GET took, for the range
+ * size tuning.
+ */
+size_t
+oss_read_buffer_timed(oss_connect *conn, char *filename, void *buffer, int64 offset, size_t len,
+					  bool async, char *msg, oss_request_options ro, oss_read_timing *timing)
+{
+	return oss_read_object_buffer(conn, filename, buffer, offset, len, true, async, msg, ro, timing, NULL);
+}
+
+/*
+ * oss_read_buffer_timed() for a thread which another one may cancel: once
+ * *cancel is set the transfer is dropped within about a second and no
+ * retry is made.
+ */
+size_t
+oss_read_buffer_cancel(oss_connect *conn, char *filename, void *buffer, int64 offset, size_t len,
+					   char *msg, oss_request_options ro, oss_read_timing *timing, volatile int *cancel)
+{
+	return oss_read_object_buffer(conn, filename, buffer, offset, len, true, true, msg, ro, timing, cancel);
+}
+
+/*
+ * Read a whole object of at most len bytes with a plain GET, for the small
+ * objects a ranged request buys nothing.
+ */
+size_t
+oss_read_object(oss_connect *conn, char *filename, void *buffer, size_t len,
+				bool async, char *msg, oss_request_options ro)
+{
+	return oss_read_object_buffer(conn, filename, buffer, 0, len, false, async, msg, ro, NULL, NULL);
+}
+
+static size_t
+oss_read_object_buffer(oss_connect *conn, char *filename, void *buffer, int64 offset, size_t len,
+				bool ranged, bool async, char *msg, oss_request_options ro, oss_read_timing *timing,
+				volatile int *cancel)
 {
 	aos_pool_t *p = NULL;
 	aos_string_t bucket;
@@ -170,13 +292,16 @@ oss_read_buffer(oss_connect *conn, char *filename, void *buffer, int64 offset, s
 	aos_table_t *params = NULL;
 	aos_table_t *resp_headers = NULL;
 	aos_list_t	ossbuffers;
-	aos_buf_t  *content;
 	char	   *buf = (char *) buffer;
 	int64		readlen = 0;
-	int64		size = 0;
-	int64		pos = 0;
+	int64		got = 0;		/* bytes of the range in buf */
+	int64		range_start;
+	int64		range_end;
+	bool		done;
 	char		rangbuf[MAX_RANGE_STR_LEN] = {0};
-	int			retrycount = 0;
+	char	   *etag = NULL;
+	oss_object_template_t *tpl = NULL;
+	oss_retry	retry;
 
 	if (aos_pool_create(&p, NULL) != APR_SUCCESS)
 	{
@@ -216,65 +341,129 @@ oss_read_buffer(oss_connect *conn, char *filename, void *buffer, int64 offset, s
 		}
 	}
 
-	snprintf(rangbuf, MAX_RANGE_STR_LEN, MAX_RANGE_STR, offset, (int64) (offset + len - 1));
-	apr_table_set(headers, "Range", rangbuf);
+	options->ctl->cancel = cancel;
 
-	aos_list_init(&ossbuffers);
+	if (oss_object_template_match(&oss_read_template, options, &bucket, &object) ||
+		oss_object_template_init(&oss_read_template, options, &bucket, &object) == AOSE_OK)
+		tpl = &oss_read_template;
+
+	oss_retry_init(&retry, conn);
 
 retry_get_buffer:
 
-	s = oss_get_object_to_buffer(options, &bucket, &object, headers, params, &ossbuffers, &resp_headers);
-	if (s == NULL || !aos_status_is_ok(s))
+	/*
+	 * After a broken transfer only the missing tail is asked for again, and
+	 * only from the same version of the object.
+	 */
+	if (ranged)
 	{
-		if (aos_should_retry(s) == 1 && retrycount < OSS_RETRY_COUNT)
-		{
-			retrycount++;
-			if (async == false)
-			{
-				elog(WARNING, "get ossfile %s oss_get_object_to_buffer time out, retry %d/%d", filename, retrycount, OSS_RETRY_COUNT);
-			}
-			goto retry_get_buffer;
-		}
+		snprintf(rangbuf, MAX_RANGE_STR_LEN, MAX_RANGE_STR, offset + got, (int64) (offset + len - 1));
+		apr_table_set(headers, "Range", rangbuf);
+	}
+	if (got > 0 && etag != NULL)
+		apr_table_set(headers, "If-Match", etag);
+
+	/* nothing of the last attempt is data of this one, nor when it is refused */
+	s = NULL;
+	aos_list_init(&ossbuffers);
+	resp_headers = NULL;
+	if (oss_retry_enter(&retry, options->ctl, len - got, false))
+	{
+		if (tpl != NULL)
+			s = oss_get_object_to_buffer_by_template(options, tpl, headers, params, &ossbuffers, &resp_headers);
 		else
-		{
-			return oss_api_throw_exception(p, s, filename, retrycount, async, msg, "oss_get_object_to_buffer");
-		}
+			s = oss_get_object_to_buffer(options, &bucket, &object, headers, params, &ossbuffers, &resp_headers);
+		oss_retry_leave(&retry, s, options->ctl);
 	}
 
 	readlen = aos_buf_list_len(&ossbuffers);
-	if (readlen > len || readlen <= 0)
+	done = false;
+
+	if (ranged && readlen > 0 && oss_content_range(resp_headers, &range_start, &range_end))
 	{
-		aos_pool_destroy(p);
-		if (async)
+		/* a 206 body is data of the range even when the transfer broke off */
+		if (range_start != offset + got || range_end > offset + (int64) len - 1 || range_end < range_start)
 		{
-			snprintf(msg, ERROR_MESSAGE_LEN, "abnormal aos_buf_list_len offset " int64_FMT " len %d", offset, (int) len);
-			return 0;
+			aos_pool_destroy(p);
+			if (async)
+			{
+				snprintf(msg, ERROR_MESSAGE_LEN, "get ossfile %s: Content-Range " int64_FMT "-" int64_FMT " does not match range %s",
+						 filename, range_start, range_end, rangbuf);
+				return 0;
+			}
+			else
+			{
+				elog(ERROR, "get ossfile %s: Content-Range " int64_FMT "-" int64_FMT " does not match range %s",
+					 filename, range_start, range_end, rangbuf);
+			}
 		}
-		else
+
+		if (got == 0 && apr_table_get(resp_headers, "ETag") != NULL)
+			etag = apr_pstrdup(p, apr_table_get(resp_headers, "ETag"));
+
+		readlen = Min(readlen, range_end - range_start + 1);
+		got += oss_copy_buf_list(&ossbuffers, buf + got, readlen);
+
+		/* the range ends at range_end, before the asked end at the end of the object */
+		if (offset + got > range_end)
+			done = true;
+		else if (s != NULL && aos_status_is_ok(s))
 		{
-			elog(ERROR, "abnormal aos_buf_list_len offset " int64_FMT " len %d", offset, (int) len);
+			/* a short body the transport took for complete, fetch the rest */
+			aos_status_set(s, AOSE_CONNECTION_FAILED, AOS_HTTP_IO_ERROR_CODE, "short read");
 		}
 	}
-
-	//copy buffer content to memory
-	aos_list_for_each_entry(aos_buf_t, content, &ossbuffers, node)
+	else if (s != NULL && aos_status_is_ok(s))
 	{
-		size = aos_buf_size(content);
-		memcpy(buf + pos, content->pos, (size_t) size);
-		pos += size;
-		if (pos > readlen)
+		/* the whole object, asked for or because the range was ignored */
+		if (readlen <= 0 || readlen > len - got || (ranged && offset + got != 0))
 		{
 			aos_pool_destroy(p);
 			if (async)
 			{
-				snprintf(msg, ERROR_MESSAGE_LEN, "abnormal copy buffer to local offset " int64_FMT " len %d", offset, (int) len);
+				snprintf(msg, ERROR_MESSAGE_LEN, "abnormal aos_buf_list_len offset " int64_FMT " len %d", offset, (int) len);
 				return 0;
 			}
 			else
 			{
-				elog(ERROR, "abnormal copy buffer to local offset " int64_FMT " len %d", offset, (int) len);
+				elog(ERROR, "abnormal aos_buf_list_len offset " int64_FMT " len %d", offset, (int) len);
+			}
+		}
+
+		got += oss_copy_buf_list(&ossbuffers, buf + got, readlen);
+		done = true;
+	}
+
+	if (!done)
+	{
+		if (cancel != NULL && *cancel)
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN, "get ossfile %s cancelled", filename);
+			aos_pool_destroy(p);
+			return 0;
+		}
+		if (oss_retry_next(&retry, s, resp_headers))
+		{
+			if (async == false)
+			{
+				elog(WARNING, "get ossfile %s oss_get_object_to_buffer time out at " int64_FMT " of %d, retry %d/%d",
+					 filename, got, (int) len, retry.attempt, OSS_RETRY_COUNT);
 			}
+			goto retry_get_buffer;
 		}
+		else
+		{
+			return oss_api_throw_exception(p, s, filename, &retry, async, msg, "oss_get_object_to_buffer");
+		}
+	}
+	oss_retry_success(&retry);
+
+	if (timing != NULL)
+	{
+		aos_http_controller_t *ctl = options->ctl;
+
+		timing->elapsed = ctl->finish_time - ctl->start_time;
+		timing->ttfb = (ctl->first_byte_time > 0) ? ctl->first_byte_time - ctl->start_time : timing->elapsed;
 	}
 
 	aos_pool_destroy(p);
@@ -284,7 +473,46 @@ retry_get_buffer:
 		elog(DEBUG5, "read buffer from oss success. offset " int64_FMT " len %d", offset, (int) len);
 	}
 
-	return (size_t) readlen;
+	return (size_t) got;
+}
+
+/*
+ * The first and last byte of a 206 response, false when there is no
+ * Content-Range or it tells no range, as the one of a 416 does.
+ */
+static bool
+oss_content_range(aos_table_t *resp_headers, int64 *start, int64 *end)
+{
+	const char *value;
+
+	if (resp_headers == NULL)
+		return false;
+
+	value = apr_table_get(resp_headers, "Content-Range");
+	if (value == NULL)
+		return false;
+
+	return sscanf(value, "bytes " int64_FMT "-" int64_FMT, start, end) == 2;
+}
+
+/* copy at most len bytes of the response body to buf */
+static int64
+oss_copy_buf_list(aos_list_t *list, char *buf, int64 len)
+{
+	aos_buf_t  *content;
+	int64		pos = 0;
+	int64		size;
+
+	aos_list_for_each_entry(aos_buf_t, content, list, node)
+	{
+		size = Min(aos_buf_size(content), len - pos);
+		if (size <= 0)
+			break;
+		memcpy(buf + pos, content->pos, (size_t) size);
+		pos += size;
+	}
+
+	return pos;
 }
 
 List *
@@ -297,7 +525,7 @@ list_ossfiles_ondir(oss_connect *conn, char *dir, oss_request_options ro, bool i
 	aos_status_t *s = NULL;
 	oss_list_object_params_t *params_t = NULL;
 	oss_list_object_content_t *content_t = NULL;
-	int			retrycount = 0;
+	oss_retry	retry;
 	char	   *filename = NULL;
 	int			filenamestrlen = 0;
 	List	   *filelist = NIL;
@@ -321,13 +549,20 @@ list_ossfiles_ondir(oss_connect *conn, char *dir, oss_request_options ro, bool i
 		aos_str_set(&params_t->delimiter, "/");
 	}
 
+	oss_retry_init(&retry, conn);
+
 	do
 	{
-		s = oss_list_object(options, &bucket, params_t, &resp_headers);
+		s = NULL;
+		if (oss_retry_enter(&retry, options->ctl, 0, false))
+		{
+			s = oss_list_object(options, &bucket, params_t, &resp_headers);
+			oss_retry_leave(&retry, s, options->ctl);
+		}
 		if (NULL != s && aos_status_is_ok(s))
 		{
 			/* found */
-			;
+			oss_retry_success(&retry);
 		}
 		else if (NULL != s && s->code == OSS_ERROR_FILE_NOT_EXIST)
 		{
@@ -335,15 +570,16 @@ list_ossfiles_ondir(oss_connect *conn, char *dir, oss_request_options ro, bool i
 			elog(DEBUG1, "ossdir %s does not exist.", dir);
 			return 0;
 		}
-		else if (aos_should_retry(s) == 1 && retrycount < OSS_RETRY_COUNT)
+		else if (oss_retry_next(&retry, s, resp_headers))
 		{
-			retrycount++;
-			elog(WARNING, "list ossdir %s use oss_get_object_to_buffer time out, retry %d/%d", dir, retrycount, OSS_RETRY_COUNT);
+			elog(WARNING, "list ossdir %s use oss_get_object_to_buffer time out, retry %d/%d", dir, retry.attempt, OSS_RETRY_COUNT);
+			/* the loop test would end the listing on a failed first page */
+			truncated = 1;
 			continue;
 		}
 		else
 		{
-			oss_api_throw_exception(p, s, dir, retrycount, false, NULL, "oss_list_object");
+			oss_api_throw_exception(p, s, dir, &retry, false, NULL, "oss_list_object");
 			return NIL;
 		}
 
@@ -402,7 +638,7 @@ is_ossfile_exist(oss_connect *conn, char *filename, oss_request_options ro)
 	aos_str_set(&bucket, conn->bucket);
 	aos_str_set(&object, filename);
 
-	s = oss_get_file_metainfo(p, options, &resp_headers, bucket, object, false, NULL);
+	s = oss_get_file_metainfo(conn, p, options, &resp_headers, bucket, object, false, NULL);
 	if (s != NULL && aos_status_is_ok(s))
 	{
 		exist = true;
@@ -421,6 +657,20 @@ bool
 oss_append_file_from_buffer(oss_connect *conn, char *filename, char *data, size_t len,
 								bool checktype, int64 append_position, oss_request_options ro,
 								bool async, char *msg)
+{
+	struct iovec	iov;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+
+	return oss_append_file_from_iov(conn, filename, &iov, 1, checktype, append_position,
+									ro, async, msg);
+}
+
+bool
+oss_append_file_from_iov(oss_connect *conn, char *filename, const struct iovec *iov, int iovcnt,
+								bool checktype, int64 append_position, oss_request_options ro,
+								bool async, char *msg)
 {
 	aos_pool_t *p = NULL;
 	aos_string_t bucket;
@@ -434,7 +684,9 @@ oss_append_file_from_buffer(oss_connect *conn, char *filename, char *data, size_
 	aos_buf_t  *content = NULL;
 	char	   *next_append_position = NULL;
 	char	   *object_type = NULL;
-	int			retrycount = 0;
+	oss_retry	retry;
+	int64		bytes = 0;
+	int			i;
 
 	if (aos_pool_create(&p, NULL) != APR_SUCCESS)
 	{
@@ -459,7 +711,7 @@ oss_append_file_from_buffer(oss_connect *conn, char *filename, char *data, size_
 	aos_str_set(&bucket, conn->bucket);
 	aos_str_set(&object, filename);
 
-	s = oss_get_file_metainfo(p, options, &resp_headers, bucket, object, async, msg);
+	s = oss_get_file_metainfo(conn, p, options, &resp_headers, bucket, object, async, msg);
 	if (s != NULL && aos_status_is_ok(s))
 	{
 		object_type = (char *) (apr_table_get(resp_headers, OSS_OBJECT_TYPE));
@@ -527,8 +779,109 @@ oss_append_file_from_buffer(oss_connect *conn, char *filename, char *data, size_
 	}
 
 	aos_list_init(&buffer);
+	for (i = 0; i < iovcnt; i++)
+	{
+		if (iov[i].iov_len == 0)
+		{
+			continue;
+		}
+
+		content = aos_buf_pack(p, iov[i].iov_base, iov[i].iov_len);
+		if (content == NULL)
+		{
+			aos_pool_destroy(p);
+			if (async)
+			{
+				snprintf(msg, ERROR_MESSAGE_LEN, "aos_buf_pack failure.");
+				return false;
+			}
+			else
+			{
+				elog(ERROR, "aos_buf_pack failure.");
+			}
+		}
+		aos_list_add_tail(&content->node, &buffer);
+		bytes += iov[i].iov_len;
+	}
+
+	oss_retry_init(&retry, conn);
+
+retry_loaddata:
+
+	s = NULL;
+	if (oss_retry_enter(&retry, options->ctl, bytes, true))
+	{
+		s = oss_append_object_from_buffer(options, &bucket, &object,
+									 position, &buffer, headers2, &resp_headers);
+		oss_retry_leave(&retry, s, options->ctl);
+	}
+	if (s != NULL && aos_status_is_ok(s))
+	{
+		oss_retry_success(&retry);
+	}
+	else if (oss_retry_next(&retry, s, resp_headers))
+	{
+		if (async == false)
+		{
+			elog(WARNING, "oss_append_object_from_buffer time out, filename %s, retry %d/%d", filename, retry.attempt, OSS_RETRY_COUNT);
+		}
+		goto retry_loaddata;
+	}
+	else
+	{
+		return oss_api_throw_exception(p, s, filename, &retry, async, msg, "oss_append_object_from_buffer");
+	}
+
+	aos_pool_destroy(p);
+
+	return true;
+}
+
+/*
+ * Write a small object whole with a plain PUT, replacing any object of that
+ * name.
+ */
+bool
+oss_write_object(oss_connect *conn, char *filename, char *data, size_t len,
+				 bool async, char *msg, oss_request_options ro)
+{
+	aos_pool_t *p = NULL;
+	aos_string_t bucket;
+	aos_string_t object;
+	aos_status_t *s = NULL;
+	aos_table_t *headers = NULL;
+	aos_table_t *resp_headers = NULL;
+	oss_request_options_t *options = NULL;
+	aos_list_t	buffer;
+	aos_buf_t  *content = NULL;
+	oss_retry	retry;
+
+	if (aos_pool_create(&p, NULL) != APR_SUCCESS)
+	{
+		if (async)
+		{
+			snprintf(msg, ERROR_MESSAGE_LEN, "aos_pool_create failure.");
+			return false;
+		}
+		else
+		{
+			elog(ERROR, "aos_pool_create failure.");
+		}
+	}
+
+	options = oss_init_options(p, conn->osshost, conn->ossid, conn->osskey, async, msg, ro);
+	if (async && options == NULL)
+	{
+		aos_pool_destroy(p);
+		return false;
+	}
+
+	aos_str_set(&bucket, conn->bucket);
+	aos_str_set(&object, filename);
+
+	headers = aos_table_make(p, 0);
 	content = aos_buf_pack(p, data, len);
-	if (content == NULL)
+	if (headers == NULL || content == NULL)
 	{
 		aos_pool_destroy(p);
 		if (async)
@@ -541,29 +894,36 @@ oss_append_file_from_buffer(oss_connect *conn, char *filename, char *data, size_
 			elog(ERROR, "aos_buf_pack failure.");
 		}
 	}
+
+	aos_list_init(&buffer);
 	aos_list_add_tail(&content->node, &buffer);
 
-retry_loaddata:
+	oss_retry_init(&retry, conn);
+
+retry_put:
 
-	s = oss_append_object_from_buffer(options, &bucket, &object,
-								 position, &buffer, headers2, &resp_headers);
-	if (s != NULL || aos_status_is_ok(s))
+	s = NULL;
+	if (oss_retry_enter(&retry, options->ctl, len, true))
 	{
-		;
+		s = oss_put_object_from_buffer(options, &bucket, &object, &buffer, headers, &resp_headers);
+		oss_retry_leave(&retry, s, options->ctl);
 	}
-	else if (aos_should_retry(s) == 1 && retrycount < OSS_RETRY_COUNT)
+	if (s == NULL || !aos_status_is_ok(s))
 	{
-		retrycount++;
-		if (async == false)
+		if (oss_retry_next(&retry, s, resp_headers))
+		{
+			if (async == false)
+			{
+				elog(WARNING, "oss_put_object_from_buffer time out, filename %s, retry %d/%d", filename, retry.attempt, OSS_RETRY_COUNT);
+			}
+			goto retry_put;
+		}
+		else
 		{
-			elog(WARNING, "oss_append_object_from_buffer time out, filename %s, retry %d/%d", filename, retrycount, OSS_RETRY_COUNT);
+			return oss_api_throw_exception(p, s, filename, &retry, async, msg, "oss_put_object_from_buffer");
 		}
-		goto retry_loaddata;
-	}
-	else
-	{
-		return oss_api_throw_exception(p, s, filename, retrycount, async, msg, "oss_append_object_from_buffer");
 	}
+	oss_retry_success(&retry);
 
 	aos_pool_destroy(p);
 
@@ -571,13 +931,13 @@ retry_loaddata:
 }
 
 static aos_status_t *
-oss_get_file_metainfo(aos_pool_t *p, oss_request_options_t * options,
+oss_get_file_metainfo(oss_connect *conn, aos_pool_t *p, oss_request_options_t * options,
 				aos_table_t ** resp_headers, aos_string_t bucket, aos_string_t object,
 				bool async, char *msg)
 {
 	aos_status_t *s = NULL;
 	aos_table_t *headers = NULL;
-	int			retrycount = 0;
+	oss_retry	retry;
 
 	if (p == NULL || options == NULL)
 	{
@@ -599,29 +959,31 @@ oss_get_file_metainfo(aos_pool_t *p, oss_request_options_t * options,
 		}
 	}
 
+	oss_retry_init(&retry, conn);
+
 retry_getmetainfo:
 
-	s = oss_head_object(options, &bucket, &object, headers, resp_headers);
-	if (NULL != s && aos_status_is_ok(s))
+	s = NULL;
+	if (oss_retry_enter(&retry, options->ctl, 0, false))
 	{
-		;
+		s = oss_head_object(options, &bucket, &object, headers, resp_headers);
+		oss_retry_leave(&retry, s, options->ctl);
 	}
-	else if (NULL != s && s->code == OSS_ERROR_FILE_NOT_EXIST)
+	if (NULL != s && (aos_status_is_ok(s) || s->code == OSS_ERROR_FILE_NOT_EXIST))
 	{
-		;
+		oss_retry_success(&retry);
 	}
-	else if (aos_should_retry(s) == 1 && retrycount < OSS_RETRY_COUNT)
+	else if (oss_retry_next(&retry, s, *resp_headers))
 	{
-		retrycount++;
 		if (async == false)
 		{
-			elog(WARNING, "get ossfile %s oss_head_object time out, retry %d/%d", object.data, retrycount, OSS_RETRY_COUNT);
+			elog(WARNING, "get ossfile %s oss_head_object time out, retry %d/%d", object.data, retry.attempt, OSS_RETRY_COUNT);
 		}
 		goto retry_getmetainfo;
 	}
 	else
 	{
-		oss_api_throw_exception(p, s, object.data, retrycount, async, msg, "oss_head_object");
+		oss_api_throw_exception(p, s, object.data, &retry, async, msg, "oss_head_object");
 		return NULL;
 	}
 
@@ -682,6 +1044,8 @@ oss_init_options(aos_pool_t * p, char *host, char *id, char *key, bool async, ch
 
 	set_oss_request_options(options, ro);
 
+	options->ctl->connect_to = oss_endpoint_connect_to(options->pool, host);
+
 	return options;
 }
 
@@ -695,10 +1059,147 @@ set_oss_request_options(oss_request_options_t *options, oss_request_options ro)
 	options->ctl->options->speed_time = ro.speed_time;
 	options->ctl->options->connect_timeout = ro.connect_timeout;
 	options->ctl->options->dns_cache_timeout = ro.dns_cache_timeout;
+	options->ctl->http2 = ro.http2;
 
 	return;
 }
 
+void
+oss_write_chain_init(oss_write_chain *chain, int64 capacity, int chunk_size, MemoryContext ctx)
+{
+	chain->chunk_size = chunk_size;
+	chain->capacity = capacity;
+	chain->maxchunks = (int) ((capacity + chunk_size - 1) / chunk_size) + 1;
+	chain->chunks = MemoryContextAllocZero(ctx, sizeof(oss_write_chunk) * chain->maxchunks);
+	chain->iov = MemoryContextAlloc(ctx, sizeof(struct iovec) * chain->maxchunks);
+	chain->nchunks = 0;
+	chain->cur = 0;
+	chain->len = 0;
+	chain->ctx = ctx;
+}
+
+/*
+ * Copy a row into the chain. A row may span chunks, chunks are allocated on
+ * first use and kept across flushes.
+ */
+void
+oss_write_chain_append(oss_write_chain *chain, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		oss_write_chunk *chunk;
+		size_t		n;
+
+		if (chain->cur == chain->nchunks)
+		{
+			if (chain->nchunks == chain->maxchunks)
+			{
+				elog(ERROR, "oss write chain overflow, " int64_FMT " byte buffered", chain->len);
+			}
+
+			chain->chunks[chain->nchunks].data = MemoryContextAlloc(chain->ctx, chain->chunk_size);
+			chain->chunks[chain->nchunks].len = 0;
+			chain->nchunks++;
+		}
+
+		chunk = &chain->chunks[chain->cur];
+		n = Min(len, (size_t) (chain->chunk_size - chunk->len));
+		memcpy(chunk->data + chunk->len, data, n);
+		chunk->len += n;
+		chain->len += n;
+		data += n;
+		len -= n;
+
+		if (chunk->len == chain->chunk_size)
+		{
+			chain->cur++;
+		}
+	}
+}
+
+/*
+ * Point *iov at the chunks holding data, returns the number of entries.
+ */
+int
+oss_write_chain_iov(oss_write_chain *chain, struct iovec **iov)
+{
+	int			i;
+	int			n = 0;
+
+	for (i = 0; i < chain->nchunks && chain->chunks[i].len > 0; i++)
+	{
+		chain->iov[n].iov_base = chain->chunks[i].data;
+		chain->iov[n].iov_len = chain->chunks[i].len;
+		n++;
+	}
+
+	*iov = chain->iov;
+	return n;
+}
+
+void
+oss_write_chain_reset(oss_write_chain *chain)
+{
+	int			i;
+
+	for (i = 0; i < chain->nchunks; i++)
+	{
+		chain->chunks[i].len = 0;
+	}
+
+	chain->cur = 0;
+	chain->len = 0;
+}
+
+void
+oss_write_chain_free(oss_write_chain *chain)
+{
+	int			i;
+
+	for (i = 0; i < chain->nchunks; i++)
+	{
+		pfree(chain->chunks[i].data);
+	}
+
+	if (chain->chunks)
+	{
+		pfree(chain->chunks);
+		pfree(chain->iov);
+	}
+
+	memset(chain, 0, sizeof(oss_write_chain));
+}
+
+/*
+ * Size a buffer of myData from the host memory budget: want bytes if the host
+ * can afford them, never less than min. The grant is charged to myData and
+ * given back by free_data().
+ */
+int64
+oss_buffer_grant(ext_oss_t *myData, int64 want, int64 min)
+{
+	int64		granted = oss_host_mem_acquire(want, min);
+
+	myData->mem_granted += granted;
+
+	if (granted < want)
+	{
+		elog(DEBUG1, "host memory budget grants " int64_FMT " of " int64_FMT " buffer byte",
+			granted, want);
+	}
+
+	return granted;
+}
+
+void
+oss_buffer_release(ext_oss_t *myData, int64 bytes)
+{
+	bytes = Min(bytes, myData->mem_granted);
+
+	oss_host_mem_release(bytes);
+	myData->mem_granted -= bytes;
+}
+
 size_t
 SourceRead(ext_oss_t *self, void *buffer, size_t len)
 {
@@ -717,8 +1218,24 @@ SourceRead_internal(ext_oss_t *myData, void *buffer, size_t len,
 retry:
 	datlen = len;
 
+	if (myData->ra_end > myData->ra_begin)
+	{
+		nread = Min(len, (size_t) (myData->ra_end - myData->ra_begin));
+		memcpy(data, myData->ra_buffer + myData->ra_begin, nread);
+		myData->ra_begin += nread;
+
+		return nread;
+	}
+
 	if (myData->length < 0)
 	{
+		/* the work queue failed to find the range of its unit */
+		if (!async && myData->errmsg[0] != '\0')
+		{
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("%s", myData->errmsg)));
+		}
 		return 0;
 	}
 	else if (myData->length == 0)
@@ -752,6 +1269,52 @@ retry:
 	}
 
 	offset = myData->offset;
+
+	nread = oss_prefetch_read(myData, data, offset, datlen);
+	if (nread > 0)
+	{
+		myData->offset += nread;
+		return nread;
+	}
+
+	/*
+	 * Small reads are served from a read ahead filled with large ranged GETs,
+	 * rather than paying a request for every call. The read thread never
+	 * comes here with a small read, the buffer is only touched by the
+	 * backend.
+	 */
+	if (!async && datlen < READ_AHEAD_LEN)
+	{
+		if (myData->ra_buffer == NULL)
+		{
+			myData->ra_size = oss_buffer_grant(myData, READ_AHEAD_LEN, READ_UNIT_SIZE);
+			myData->ra_buffer = MemoryContextAlloc(myData->ctx, myData->ra_size);
+		}
+
+		if (datlen < myData->ra_size)
+		{
+			int64		ralen = Min((int64) myData->ra_size, myData->length - offset);
+
+			nread = oss_read_buffer(&myData->conn, myData->currentfile, myData->ra_buffer,
+									offset, ralen, async, msg, myData->ro);
+
+			/* nothing where the listed length says there is more, don't loop */
+			if (nread == 0)
+			{
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("oss_import: unexpected end of file \"%s\" at " int64_FMT " of " int64_FMT,
+								myData->currentfile, offset, myData->length)));
+			}
+
+			myData->offset += nread;
+			myData->ra_begin = 0;
+			myData->ra_end = nread;
+
+			goto retry;
+		}
+	}
+
 	nread = oss_read_buffer(&myData->conn, myData->currentfile, data, offset, datlen, async, msg, myData->ro);
 
 	if (nread < 0)
@@ -771,6 +1334,8 @@ SourceClose(void *selfp)
 {
 	ext_oss_t *self = (ext_oss_t *)selfp;
 
+	oss_prefetch_stop(self);
+
 	if (self->file_opt.type == OSS_COMPRESSION_GZIP)
 	{
 		z_decompress_reader_destroy((z_decompress_reader *)(self->com_hd));
@@ -782,6 +1347,17 @@ oss_next_file(ext_oss_t * myData)
 {
 	ListCell   *l;
 
+	myData->ra_begin = 0;
+	myData->ra_end = 0;
+
+	/* the file names belong to the work queue */
+	if (myData->workqueue != NULL)
+	{
+		oss_workqueue_next(myData);
+		set_oss_import_ossfile(myData->currentfile);
+		return;
+	}
+
 	if (myData->currentfile)
 	{
 		pfree(myData->currentfile);
@@ -808,6 +1384,8 @@ oss_next_file(ext_oss_t * myData)
 		pfree(file);
 	}
 
+	oss_prefetch_next_file(myData);
+
 	return;
 }
 
@@ -0,0 +1,16 @@
+
+# Decompress the zstd files under an oss prefix to stdout, for the web
+# tables that read a zstd export back (readable tables don't take zstd).
+#
+# Usage: oss_zstd_cat.sh <bucket> <prefix>
+
+bucket=$1
+prefix=$2
+tmpfile=`mktemp` || exit 1
+
+trap "rm -f $tmpfile" EXIT
+
+for object in `osscmd ls oss://$bucket/$prefix |grep -o "oss://$bucket/[^ ]*"` ; do
+  osscmd get $object $tmpfile >/dev/null || exit 1
+  zstd -q -d -c $tmpfile || exit 1
+done
@@ -31,6 +31,8 @@ osscmd config --host=$oss_host --id=$oss_id --key=$oss_key
 #cleanup existing dir
 osscmd deleteallobject --force=true oss://$oss_bucket/oss_reg_test/
 osscmd deleteallobject --force=true oss://$oss_bucket/oss_reg_test2/
+osscmd deleteallobject --force=true oss://$oss_bucket/oss_reg_test3/
+osscmd deleteallobject --force=true oss://$oss_bucket/oss_reg_test4/
 osscmd deleteallobject --force=true oss://$oss_bucket/cdn_demo_20170824/
 osscmd deleteallobject --force=true oss://$oss_bucket/cdn_demo_201801/
 osscmd deleteallobject --force=true oss://$oss_bucket/oss_reg_test/expdir/
@@ -49,3 +51,22 @@ osscmd mkdir oss://$oss_bucket/oss_reg_test/expdir4/
 for file in `ls ./data|grep "1.gz"` ; do
   osscmd put data/$file oss://$oss_bucket/oss_reg_test/expdir4/$file
 done
+
+#a gzip file larger than the 32 MB span of a gzip index, made up here
+#rather than kept in ./data
+mkdir -p ./gen
+awk 'BEGIN { srand(1); for (i = 1; i <= 1000000; i++) { s = ""; for (j = 0; j < 8; j++) s = s sprintf("%08x", int(rand() * 4294967296)); printf("ossexample%d,%s,1.1,1.2,1.3,%d\n", i, s, i); } }' |gzip -6 >./gen/example_big.csv.gz
+osscmd put gen/example_big.csv.gz oss://$oss_bucket/oss_reg_test/gzindex/example_big.csv.gz
+
+#work_stealing split_size=1 data: several MB cut at every MB, with a row of
+#900 KB across the first cut and a last file without a newline at its end
+awk 'BEGIN { x = "x"; while (length(x) < 900000) x = x x; x = substr(x, 1, 900000); for (i = 1; i <= 100000; i++) { d = "ossexample" i; if (!big && off >= 600000) { d = d x; big = 1 } line = d ",2016-04-14 15:04:38." sprintf("%06d", i) "+08,1.1,1.2,1.3," i; print line; off += length(line) + 1 } }' >./gen/split_1.csv
+awk 'BEGIN { for (i = 100001; i <= 120000; i++) printf("%sossexample%d,2016-04-14 15:04:38.%06d+08,1.1,1.2,1.3,%d", (i > 100001) ? "\n" : "", i, i, i) }' >./gen/split_2.csv
+osscmd put gen/split_1.csv oss://$oss_bucket/oss_reg_test/split/split_1.csv
+osscmd put gen/split_2.csv oss://$oss_bucket/oss_reg_test/split/split_2.csv
+
+#parallel_files data: a dozen gzip files, so that each segment has several
+for n in `seq 1 12` ; do
+  awk -v n=$n 'BEGIN { for (i = (n - 1) * 10000 + 1; i <= n * 10000; i++) printf("ossexample%d,2016-04-14 15:04:38.%06d+08,1.1,1.2,1.3,%d\n", i, i, i) }' |gzip -6 >./gen/parallel_$n.csv.gz
+  osscmd put gen/parallel_$n.csv.gz oss://$oss_bucket/oss_reg_test/parallel/parallel_$n.csv.gz
+done
@@ -0,0 +1,86 @@
+
+# Local HTTP/2 front for the test bucket, for the http2=true tables.
+#
+# nghttpx takes h2 over TLS on the port of oss_h2_host and passes the
+# requests on as HTTP/1.1 to the bucket's virtual host on oss_host, with
+# the Host header rewritten to it. The signature covers the bucket and
+# the object, not the host, so the requests stay valid on the way.
+#
+# Usage: setup_h2proxy.sh start|stop
+#   stop fails when any request reached the proxy over something else
+#   than h2, i.e. the table fell back to HTTP/1.1.
+
+set -x
+
+MYPWD=`pwd`
+H2DIR=$MYPWD/h2proxy
+
+for line in `cat ./oss.conf.in` ; do
+
+  if [[ $line == "" ]] ; then
+    continue;
+  fi
+
+  varname=`echo $line |awk -F'=' '{print $1}'`
+  varvalue=`echo $line |awk -F'=' '{print $2}'`
+
+  if [[ $varname == "oss_host" ]]; then
+    oss_host=`echo $varvalue |awk -F'/' '{print $3}'` ;
+  elif [[ $varname == "oss_bucket" ]]; then
+    oss_bucket=$varvalue ;
+  elif [[ $varname == "oss_h2_host" ]]; then
+    h2_name=`echo $varvalue |awk -F'/' '{print $5}' |awk -F':' '{print $1}'` ;
+    h2_port=`echo $varvalue |awk -F':' '{print $NF}'` ;
+  fi
+done
+
+case "$1" in
+start)
+  if [[ -z `which nghttpx` ]]; then
+    echo "No nghttpx found! Can not run the http2 tests!"
+    exit 1;
+  fi
+
+  rm -fr $H2DIR
+  mkdir -p $H2DIR
+
+  # curl checks the name even though it doesn't verify the peer
+  openssl req -x509 -newkey rsa:2048 -nodes -days 30 \
+    -keyout $H2DIR/key.pem -out $H2DIR/cert.pem -subj "/CN=$h2_name" \
+    -addext "subjectAltName=DNS:$h2_name,DNS:$oss_bucket.$h2_name" || exit 1
+
+  # any address, the segments may resolve the name to ::1 as well
+  nghttpx --daemon --pid-file=$H2DIR/nghttpx.pid \
+    --frontend="*,$h2_port" \
+    --backend="$oss_bucket.$oss_host,80" --host-rewrite \
+    --errorlog-file=$H2DIR/error.log \
+    --accesslog-file=$H2DIR/access.log \
+    --accesslog-format='$alpn $method $path $status' \
+    $H2DIR/key.pem $H2DIR/cert.pem || exit 1
+
+  sleep 1
+  if [[ ! -s $H2DIR/nghttpx.pid ]] || ! kill -0 `cat $H2DIR/nghttpx.pid` ; then
+    echo "nghttpx did not start, see $H2DIR/error.log"
+    exit 1;
+  fi
+  ;;
+stop)
+  if [[ -s $H2DIR/nghttpx.pid ]]; then
+    kill `cat $H2DIR/nghttpx.pid`
+  fi
+
+  if [[ ! -s $H2DIR/access.log ]]; then
+    echo "No request reached the http2 proxy!"
+    exit 1;
+  fi
+
+  if grep -v "^h2 " $H2DIR/access.log ; then
+    echo "Requests reached the http2 proxy without HTTP/2!"
+    exit 1;
+  fi
+  ;;
+*)
+  echo "Usage: $0 start|stop"
+  exit 1;
+  ;;
+esac